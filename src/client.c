@@ -21,12 +21,15 @@
 #include <syslog.h>
 #include <pthread.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 
 #include "sanlock.h"
 #include "sanlock_internal.h"
@@ -130,9 +133,9 @@ retry:
 	return rv;
 }
 
-int send_command(int cmd, uint32_t data);
+int send_command_flags(int cmd, uint32_t cmd_flags, uint32_t data);
 
-int send_command(int cmd, uint32_t data)
+int send_command_flags(int cmd, uint32_t cmd_flags, uint32_t data)
 {
 	int rv, sock;
 
@@ -140,7 +143,7 @@ int send_command(int cmd, uint32_t data)
 	if (rv < 0)
 		return rv;
 
-	rv = send_header(sock, cmd, 0, 0, data, 0);
+	rv = send_header(sock, cmd, cmd_flags, 0, data, 0);
 	if (rv < 0) {
 		close(sock);
 		return rv;
@@ -149,6 +152,13 @@ int send_command(int cmd, uint32_t data)
 	return sock;
 }
 
+int send_command(int cmd, uint32_t data);
+
+int send_command(int cmd, uint32_t data)
+{
+	return send_command_flags(cmd, 0, data);
+}
+
 static int recv_result(int fd)
 {
 	struct sm_header h;
@@ -370,6 +380,325 @@ int sanlock_get_hosts(const char *ls_name, uint64_t host_id,
 	return rv;
 }
 
+/*
+ * The sanlock_shm_ functions read the status segment that the daemon
+ * publishes in its run dir (see sanlock_sock.h).  The file is mapped
+ * the first time it is used and stays mapped; the daemon does not
+ * recreate it when restarted.
+ */
+
+#define SHM_READ_TRIES 1000
+
+static pthread_mutex_t shm_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *shm_map;
+
+static int shm_status_map(const struct sanlk_shm_header **hdr_out)
+{
+	const struct sanlk_shm_header *hdr;
+	const char *run_dir;
+	char path[PATH_MAX];
+	struct stat st;
+	char *map;
+	int fd, rv = 0;
+
+	map = __atomic_load_n(&shm_map, __ATOMIC_ACQUIRE);
+	if (map)
+		goto check;
+
+	pthread_mutex_lock(&shm_map_mutex);
+	map = shm_map;
+	if (map)
+		goto unlock;
+
+	run_dir = env_get("SANLOCK_RUN_DIR", DEFAULT_RUN_DIR);
+	snprintf(path, PATH_MAX, "%s/%s", run_dir, SANLK_SHM_NAME);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		rv = -errno;
+		goto unlock;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		rv = -errno;
+		close(fd);
+		goto unlock;
+	}
+
+	if (st.st_size < (off_t)SANLK_SHM_SIZE) {
+		rv = -EAGAIN;
+		close(fd);
+		goto unlock;
+	}
+
+	map = mmap(NULL, SANLK_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		rv = -errno;
+		map = NULL;
+		goto unlock;
+	}
+
+	__atomic_store_n(&shm_map, map, __ATOMIC_RELEASE);
+ unlock:
+	pthread_mutex_unlock(&shm_map_mutex);
+	if (rv < 0)
+		return rv;
+ check:
+	hdr = (const struct sanlk_shm_header *)map;
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SANLK_SHM_MAGIC)
+		return -EAGAIN;
+
+	if (hdr->version != SANLK_SHM_VERSION ||
+	    hdr->header_size != sizeof(struct sanlk_shm_header) ||
+	    hdr->space_size != SANLK_SHM_SPACE_SIZE ||
+	    hdr->max_spaces != SANLK_SHM_MAX_SPACES)
+		return -EPROTO;
+
+	if (!hdr->daemon_pid)
+		return -ECONNREFUSED;
+
+	/* the daemon was killed without clearing daemon_pid */
+	if (kill(hdr->daemon_pid, 0) < 0 && errno == ESRCH)
+		return -ECONNREFUSED;
+
+	*hdr_out = hdr;
+	return 0;
+}
+
+static const struct sanlk_shm_space *shm_status_space(const struct sanlk_shm_header *hdr, int slot)
+{
+	return (const struct sanlk_shm_space *)((const char *)hdr + hdr->header_size +
+						(size_t)slot * hdr->space_size);
+}
+
+/* copy a slot, and its hosts if hosts is set, under its seqlock */
+
+static int shm_status_read(const struct sanlk_shm_space *ss, struct sanlk_shm_space *sc,
+			   struct sanlk_shm_host *hosts)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < SHM_READ_TRIES; i++) {
+		seq = __atomic_load_n(&ss->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(sc, ss, sizeof(struct sanlk_shm_space));
+
+		if (hosts && sc->used && sc->num_hosts <= SANLK_SHM_MAX_HOSTS)
+			memcpy(hosts, ss->hosts, sc->num_hosts * sizeof(struct sanlk_shm_host));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&ss->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+/* same as get_host_flag in the daemon */
+
+static uint32_t shm_host_flag(const struct sanlk_shm_host *sh, uint64_t now)
+{
+	if (!sh->timestamp)
+		return SANLK_HOST_FREE;
+
+	if (sh->flags & SANLK_SHM_HOST_SELF)
+		return SANLK_HOST_LIVE;
+
+	if ((now - sh->last <= sh->fail_seconds) && (sh->flags & SANLK_SHM_HOST_UNSEEN))
+		return SANLK_HOST_UNKNOWN;
+
+	if (now - sh->last <= sh->fail_seconds)
+		return SANLK_HOST_LIVE;
+
+	if (now - sh->last > sh->dead_seconds)
+		return SANLK_HOST_DEAD;
+
+	return SANLK_HOST_FAIL;
+}
+
+int sanlock_shm_inq_lockspace(struct sanlk_lockspace *ls, uint32_t flags GNUC_UNUSED)
+{
+	const struct sanlk_shm_header *hdr;
+	struct sanlk_shm_space sc;
+	int i, rv;
+
+	rv = shm_status_map(&hdr);
+	if (rv < 0)
+		return rv;
+
+	for (i = 0; i < SANLK_SHM_MAX_SPACES; i++) {
+		rv = shm_status_read(shm_status_space(hdr, i), &sc, NULL);
+		if (rv < 0)
+			return rv;
+		if (!sc.used)
+			continue;
+		if (strncmp(sc.ls.name, ls->name, SANLK_NAME_LEN))
+			continue;
+		if (strncmp(sc.ls.host_id_disk.path, ls->host_id_disk.path, SANLK_PATH_LEN))
+			continue;
+		if (sc.ls.host_id_disk.offset != ls->host_id_disk.offset)
+			continue;
+		if (ls->host_id && sc.ls.host_id != ls->host_id)
+			continue;
+
+		return sc.ls.flags ? -EINPROGRESS : 0;
+	}
+
+	return hdr->spaces_unpublished ? -EOVERFLOW : -ENOENT;
+}
+
+int sanlock_shm_get_lockspaces(struct sanlk_lockspace **lss, int *lss_count,
+			       uint32_t flags GNUC_UNUSED)
+{
+	const struct sanlk_shm_header *hdr;
+	struct sanlk_shm_space sc;
+	struct sanlk_lockspace *lsbuf;
+	int i, rv, count = 0;
+
+	rv = shm_status_map(&hdr);
+	if (rv < 0)
+		return rv;
+
+	if (hdr->spaces_unpublished)
+		return -EOVERFLOW;
+
+	lsbuf = malloc(SANLK_SHM_MAX_SPACES * sizeof(struct sanlk_lockspace));
+	if (!lsbuf)
+		return -ENOMEM;
+
+	for (i = 0; i < SANLK_SHM_MAX_SPACES; i++) {
+		rv = shm_status_read(shm_status_space(hdr, i), &sc, NULL);
+		if (rv < 0) {
+			free(lsbuf);
+			return rv;
+		}
+		if (!sc.used)
+			continue;
+		memcpy(&lsbuf[count++], &sc.ls, sizeof(struct sanlk_lockspace));
+	}
+
+	*lss_count = count;
+
+	if (lss)
+		*lss = lsbuf;
+	else
+		free(lsbuf);
+	return 0;
+}
+
+int sanlock_shm_get_hosts(const char *ls_name, uint64_t host_id,
+			  struct sanlk_host **hss, int *hss_count,
+			  uint32_t flags GNUC_UNUSED)
+{
+	const struct sanlk_shm_header *hdr;
+	struct sanlk_shm_space sc;
+	struct sanlk_shm_host *hosts, *sh;
+	struct sanlk_shm_host free_host;
+	struct sanlk_host *hsbuf, *hs;
+	struct timespec ts;
+	uint64_t now;
+	int i, rv, tries = 0, count = 0;
+
+	if (!ls_name)
+		return -EINVAL;
+
+	rv = shm_status_map(&hdr);
+	if (rv < 0)
+		return rv;
+
+	hosts = malloc(SANLK_SHM_MAX_HOSTS * sizeof(struct sanlk_shm_host));
+	if (!hosts)
+		return -ENOMEM;
+
+	/* find the slot without its hosts, then copy the hosts from it */
+ retry:
+	for (i = 0; i < SANLK_SHM_MAX_SPACES; i++) {
+		rv = shm_status_read(shm_status_space(hdr, i), &sc, NULL);
+		if (rv < 0)
+			goto out;
+		/* get_hosts only finds lockspaces that have been joined */
+		if (!sc.used || sc.ls.flags)
+			continue;
+		if (!strncmp(sc.ls.name, ls_name, SANLK_NAME_LEN))
+			break;
+	}
+
+	if (i == SANLK_SHM_MAX_SPACES) {
+		rv = hdr->spaces_unpublished ? -EOVERFLOW : -ENOENT;
+		goto out;
+	}
+
+	rv = shm_status_read(shm_status_space(hdr, i), &sc, hosts);
+	if (rv < 0)
+		goto out;
+
+	/* the slot was given to another lockspace in between */
+	if (!sc.used || sc.ls.flags || strncmp(sc.ls.name, ls_name, SANLK_NAME_LEN)) {
+		if (++tries < SHM_READ_TRIES)
+			goto retry;
+		rv = -EAGAIN;
+		goto out;
+	}
+
+	/* other hosts have not been checked since the lockspace was added */
+	if (!sc.checked) {
+		rv = -EAGAIN;
+		goto out;
+	}
+
+	hsbuf = malloc((sc.num_hosts ? sc.num_hosts : 1) * sizeof(struct sanlk_host));
+	if (!hsbuf) {
+		rv = -ENOMEM;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec;
+
+	/* host_ids after the last one in use are free */
+	memset(&free_host, 0, sizeof(free_host));
+
+	hs = hsbuf;
+
+	for (i = 0; i < (int)sc.max_hosts; i++) {
+		if (host_id && host_id != (uint64_t)(i + 1))
+			continue;
+
+		if (i < (int)sc.num_hosts)
+			sh = &hosts[i];
+		else if (host_id)
+			sh = &free_host;
+		else
+			break;
+
+		if (!host_id && !sh->timestamp)
+			continue;
+
+		hs->host_id = i + 1;
+		hs->generation = sh->generation;
+		hs->timestamp = sh->timestamp;
+		hs->io_timeout = sh->io_timeout;
+		hs->flags = shm_host_flag(sh, now);
+		hs++;
+		count++;
+	}
+
+	*hss_count = count;
+
+	if (hss)
+		*hss = hsbuf;
+	else
+		free(hsbuf);
+ out:
+	free(hosts);
+	return rv;
+}
+
 int sanlock_set_config(const char *ls_name, uint32_t flags, uint32_t cmd, GNUC_UNUSED void *data)
 {
 	struct sanlk_lockspace ls;
@@ -1830,6 +2159,863 @@ int sanlock_delete_resource(struct sanlk_rindex *rx, uint32_t flags,
 	return rv;
 }
 
+/*
+ * Persistent connections
+ *
+ * The daemon processes one command at a time from a connection, in the
+ * order they were sent, and copies the seq from each request header into
+ * its reply header.  So several requests can be sent on a connection
+ * before reading any replies, and each reply is matched to the oldest
+ * request still waiting.  A nonzero seq also tells the daemon to keep the
+ * connection open after get_lockspaces and get_hosts, which it otherwise
+ * closes after replying.  seq 0 is never used on a persistent connection.
+ *
+ * conn->pending is the list of requests waiting for a reply, oldest
+ * first, each with the caller's buffers for the reply data.  Once its
+ * reply is read, a request is moved to conn->done until the caller
+ * collects the result with sanlock_conn_result().
+ */
+
+#define CONN_MAX_PENDING 32
+
+struct conn_req {
+	struct conn_req *next;
+	uint32_t seq;
+	uint32_t cmd;
+	int pid;		/* acquire, release: target pid, sent in data2 */
+	int id;			/* async request id */
+	int result;
+	void *out;		/* read_lockspace, read_resource */
+	uint32_t *out_data2;	/* read_lockspace io_timeout */
+	void **out_array;	/* get_lockspaces, get_hosts */
+	int *out_count;
+	int out_size;
+};
+
+struct conn {
+	struct conn *next;
+	pthread_mutex_t mutex;
+	int fd;
+	int error;
+	uint32_t seq;
+	int pending_count;
+	struct conn_req *pending;
+	struct conn_req *pending_tail;
+	struct conn_req *done;
+};
+
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *conns;
+
+/* returns with conn->mutex held */
+
+static struct conn *lock_conn(int fd)
+{
+	struct conn *cn;
+
+	pthread_mutex_lock(&conns_mutex);
+	for (cn = conns; cn; cn = cn->next) {
+		if (cn->fd == fd) {
+			pthread_mutex_lock(&cn->mutex);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conns_mutex);
+	return cn;
+}
+
+static void conn_req_done(struct conn *cn, struct conn_req *req)
+{
+	cn->pending = req->next;
+	if (!cn->pending)
+		cn->pending_tail = NULL;
+	cn->pending_count--;
+
+	req->next = cn->done;
+	cn->done = req;
+}
+
+/*
+ * The connection cannot be used after an error since the daemon and
+ * the library may no longer agree on where the next message begins.
+ */
+
+static void conn_fail(struct conn *cn, int error)
+{
+	if (!cn->error)
+		cn->error = error;
+
+	while (cn->pending) {
+		cn->pending->result = cn->error;
+		conn_req_done(cn, cn->pending);
+	}
+}
+
+/* read the reply for the oldest pending request */
+
+static int conn_recv_reply(struct conn *cn)
+{
+	struct conn_req *req = cn->pending;
+	struct sm_header h;
+	char *buf = NULL;
+	int len, count, rv;
+
+	memset(&h, 0, sizeof(h));
+
+	rv = recv_data(cn->fd, &h, sizeof(h), MSG_WAITALL);
+	if (rv < 0) {
+		rv = -errno;
+		goto fail;
+	}
+	if (rv != sizeof(h)) {
+		rv = -ENOTCONN;
+		goto fail;
+	}
+
+	if (h.magic != SM_MAGIC || h.length < sizeof(h) || h.seq != req->seq) {
+		rv = -EPROTO;
+		goto fail;
+	}
+
+	len = h.length - sizeof(h);
+	if (len) {
+		buf = malloc(len);
+		if (!buf) {
+			rv = -ENOMEM;
+			goto fail;
+		}
+
+		rv = recv_data(cn->fd, buf, len, MSG_WAITALL);
+		if (rv < 0) {
+			rv = -errno;
+			goto fail;
+		}
+		if (rv != len) {
+			rv = -ENOTCONN;
+			goto fail;
+		}
+	}
+
+	req->result = (int)h.data;
+
+	switch (req->cmd) {
+	case SM_CMD_READ_LOCKSPACE:
+		if (req->result < 0 || len < req->out_size)
+			break;
+		memcpy(req->out, buf, req->out_size);
+		*req->out_data2 = h.data2;
+		break;
+	case SM_CMD_READ_RESOURCE:
+		if (len < req->out_size)
+			break;
+		memcpy(req->out, buf, req->out_size);
+		break;
+	case SM_CMD_GET_LOCKSPACES:
+	case SM_CMD_GET_HOSTS:
+		/* -ENOSPC means that the daemon's send buffer ran out of space */
+		if (req->result < 0 && req->result != -ENOSPC)
+			break;
+
+		count = h.data2;
+		*req->out_count = count;
+
+		if (!req->out_array || len != count * req->out_size)
+			break;
+
+		*req->out_array = buf;
+		buf = NULL;
+		break;
+	};
+
+	free(buf);
+	conn_req_done(cn, req);
+	return 0;
+
+ fail:
+	free(buf);
+	conn_fail(cn, rv);
+	return rv;
+}
+
+/*
+ * Sends the header and data in a single send so that requests from
+ * threads sharing the connection are not interleaved.  The reply data
+ * is copied into the buffers in tmpl when the reply is read.
+ */
+
+static int conn_send(int conn, struct conn_req *tmpl, uint32_t flags,
+		     uint32_t data, const void *buf1, int len1,
+		     const void *buf2, int len2)
+{
+	struct sm_header *h;
+	struct conn_req *req;
+	struct conn *cn;
+	char *msg;
+	int rv;
+
+	req = malloc(sizeof(struct conn_req));
+	if (!req)
+		return -ENOMEM;
+	memcpy(req, tmpl, sizeof(struct conn_req));
+	req->next = NULL;
+
+	msg = malloc(sizeof(struct sm_header) + len1 + len2);
+	if (!msg) {
+		free(req);
+		return -ENOMEM;
+	}
+
+	cn = lock_conn(conn);
+	if (!cn) {
+		rv = -EBADF;
+		goto out_free;
+	}
+
+	/* the daemon does not read the next request until it has sent
+	   the previous reply, so do not let too many replies back up */
+
+	while (!cn->error && cn->pending_count >= CONN_MAX_PENDING)
+		conn_recv_reply(cn);
+
+	if (cn->error) {
+		rv = cn->error;
+		goto out_unlock;
+	}
+
+	if (!++cn->seq)
+		cn->seq = 1;
+	req->seq = cn->seq;
+
+	h = (struct sm_header *)msg;
+	memset(h, 0, sizeof(struct sm_header));
+	h->magic = SM_MAGIC;
+	h->version = SM_PROTO;
+	h->cmd = req->cmd;
+	h->cmd_flags = flags;
+	h->length = sizeof(struct sm_header) + len1 + len2;
+	h->seq = req->seq;
+	h->data = data;
+	h->data2 = req->pid;
+
+	if (len1)
+		memcpy(msg + sizeof(struct sm_header), buf1, len1);
+	if (len2)
+		memcpy(msg + sizeof(struct sm_header) + len1, buf2, len2);
+
+	rv = send_data(cn->fd, msg, h->length, MSG_NOSIGNAL);
+	if (rv < 0) {
+		conn_fail(cn, rv);
+		goto out_unlock;
+	}
+
+	if (cn->pending_tail)
+		cn->pending_tail->next = req;
+	else
+		cn->pending = req;
+	cn->pending_tail = req;
+	cn->pending_count++;
+
+	rv = req->seq;
+	req = NULL;
+ out_unlock:
+	pthread_mutex_unlock(&cn->mutex);
+ out_free:
+	free(msg);
+	free(req);
+	return rv;
+}
+
+int sanlock_conn_open(void)
+{
+	struct conn *cn;
+	int rv, fd;
+
+	cn = malloc(sizeof(struct conn));
+	if (!cn)
+		return -ENOMEM;
+	memset(cn, 0, sizeof(struct conn));
+	pthread_mutex_init(&cn->mutex, NULL);
+
+	rv = connect_socket(&fd);
+	if (rv < 0) {
+		free(cn);
+		return rv;
+	}
+	cn->fd = fd;
+
+	pthread_mutex_lock(&conns_mutex);
+	cn->next = conns;
+	conns = cn;
+	pthread_mutex_unlock(&conns_mutex);
+
+	return fd;
+}
+
+int sanlock_conn_close(int conn)
+{
+	struct conn **pcn, *cn;
+	struct conn_req *req;
+
+	pthread_mutex_lock(&conns_mutex);
+	for (pcn = &conns; *pcn; pcn = &(*pcn)->next) {
+		if ((*pcn)->fd == conn)
+			break;
+	}
+	cn = *pcn;
+	if (cn)
+		*pcn = cn->next;
+	pthread_mutex_unlock(&conns_mutex);
+
+	if (!cn)
+		return -EBADF;
+
+	/* wait for any thread still using the connection */
+	pthread_mutex_lock(&cn->mutex);
+	close(cn->fd);
+	conn_fail(cn, -ENOTCONN);
+	while ((req = cn->done)) {
+		cn->done = req->next;
+		free(req);
+	}
+	pthread_mutex_unlock(&cn->mutex);
+
+	pthread_mutex_destroy(&cn->mutex);
+	free(cn);
+	return 0;
+}
+
+int sanlock_conn_result(int conn, int seq)
+{
+	struct conn_req **preq, *req;
+	struct conn *cn;
+	int rv;
+
+	if (seq <= 0)
+		return -EINVAL;
+
+	cn = lock_conn(conn);
+	if (!cn)
+		return -EBADF;
+
+	while (1) {
+		for (preq = &cn->done; *preq; preq = &(*preq)->next) {
+			if ((*preq)->seq == (uint32_t)seq)
+				goto found;
+		}
+
+		for (req = cn->pending; req; req = req->next) {
+			if (req->seq == (uint32_t)seq)
+				break;
+		}
+		if (!req) {
+			rv = -ENOENT;
+			goto out;
+		}
+
+		conn_recv_reply(cn);
+	}
+
+ found:
+	req = *preq;
+	*preq = req->next;
+	rv = req->result;
+	free(req);
+ out:
+	pthread_mutex_unlock(&cn->mutex);
+	return rv;
+}
+
+static int conn_lockspace(int conn, int cmd, struct sanlk_lockspace *ls,
+			  uint32_t flags, uint32_t data)
+{
+	struct conn_req tmpl;
+
+	if (!ls)
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = cmd;
+
+	return conn_send(conn, &tmpl, flags, data,
+			 ls, sizeof(struct sanlk_lockspace), NULL, 0);
+}
+
+int sanlock_conn_add_lockspace(int conn, struct sanlk_lockspace *ls,
+			       uint32_t flags, uint32_t io_timeout)
+{
+	return conn_lockspace(conn, SM_CMD_ADD_LOCKSPACE, ls, flags, io_timeout);
+}
+
+int sanlock_conn_inq_lockspace(int conn, struct sanlk_lockspace *ls, uint32_t flags)
+{
+	return conn_lockspace(conn, SM_CMD_INQ_LOCKSPACE, ls, flags, 0);
+}
+
+int sanlock_conn_rem_lockspace(int conn, struct sanlk_lockspace *ls, uint32_t flags)
+{
+	return conn_lockspace(conn, SM_CMD_REM_LOCKSPACE, ls, flags, 0);
+}
+
+int sanlock_conn_read_lockspace(int conn, struct sanlk_lockspace *ls,
+				uint32_t flags, uint32_t *io_timeout)
+{
+	struct conn_req tmpl;
+
+	if (!ls || !ls->host_id_disk.path[0] || !io_timeout)
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = SM_CMD_READ_LOCKSPACE;
+	tmpl.out = ls;
+	tmpl.out_data2 = io_timeout;
+	tmpl.out_size = sizeof(struct sanlk_lockspace);
+
+	return conn_send(conn, &tmpl, flags, 0,
+			 ls, sizeof(struct sanlk_lockspace), NULL, 0);
+}
+
+int sanlock_conn_read_resource(int conn, struct sanlk_resource *res, uint32_t flags)
+{
+	struct conn_req tmpl;
+
+	if (!res || !res->num_disks || res->num_disks > SANLK_MAX_DISKS ||
+	    !res->disks[0].path[0])
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = SM_CMD_READ_RESOURCE;
+	tmpl.out = res;
+	tmpl.out_size = sizeof(struct sanlk_resource);
+
+	return conn_send(conn, &tmpl, flags, 0,
+			 res, sizeof(struct sanlk_resource),
+			 res->disks, sizeof(struct sanlk_disk) * res->num_disks);
+}
+
+int sanlock_conn_get_lockspaces(int conn, struct sanlk_lockspace **lss,
+				int *lss_count, uint32_t flags)
+{
+	struct conn_req tmpl;
+
+	if (!lss_count)
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = SM_CMD_GET_LOCKSPACES;
+	tmpl.out_array = (void **)lss;
+	tmpl.out_count = lss_count;
+	tmpl.out_size = sizeof(struct sanlk_lockspace);
+
+	return conn_send(conn, &tmpl, flags, 0, NULL, 0, NULL, 0);
+}
+
+int sanlock_conn_get_hosts(int conn, const char *ls_name, uint64_t host_id,
+			   struct sanlk_host **hss, int *hss_count,
+			   uint32_t flags)
+{
+	struct sanlk_lockspace ls;
+	struct conn_req tmpl;
+
+	if (!ls_name || !hss_count)
+		return -EINVAL;
+
+	memset(&ls, 0, sizeof(struct sanlk_lockspace));
+	memcpy(ls.name, ls_name, strnlen(ls_name, SANLK_NAME_LEN));
+	ls.host_id = host_id;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = SM_CMD_GET_HOSTS;
+	tmpl.out_array = (void **)hss;
+	tmpl.out_count = hss_count;
+	tmpl.out_size = sizeof(struct sanlk_host);
+
+	return conn_send(conn, &tmpl, flags, 0,
+			 &ls, sizeof(struct sanlk_lockspace), NULL, 0);
+}
+
+int sanlock_conn_request(int conn, uint32_t flags, uint32_t force_mode,
+			 struct sanlk_resource *res)
+{
+	struct conn_req tmpl;
+
+	if (!res)
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = SM_CMD_REQUEST;
+
+	return conn_send(conn, &tmpl, flags, force_mode,
+			 res, sizeof(struct sanlk_resource),
+			 res->disks, sizeof(struct sanlk_disk) * res->num_disks);
+}
+
+int sanlock_conn_examine(int conn, uint32_t flags, struct sanlk_lockspace *ls,
+			 struct sanlk_resource *res)
+{
+	struct conn_req tmpl;
+
+	if (!ls && !res)
+		return -EINVAL;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+
+	if (ls && ls->host_id_disk.path[0]) {
+		tmpl.cmd = SM_CMD_EXAMINE_LOCKSPACE;
+		return conn_send(conn, &tmpl, flags, 0,
+				 ls, sizeof(struct sanlk_lockspace), NULL, 0);
+	}
+
+	tmpl.cmd = SM_CMD_EXAMINE_RESOURCE;
+	return conn_send(conn, &tmpl, flags, 0,
+			 res, sizeof(struct sanlk_resource), NULL, 0);
+}
+
+/*
+ * Asynchronous acquire and release
+ *
+ * The daemon runs one command at a time from a connection, and fails a
+ * command for a registered pid with -EBUSY while another command for
+ * that pid is running.  So an async context sends its requests over
+ * several persistent connections: a request for a pid that already has
+ * a request outstanding goes on the same connection, behind it; other
+ * requests go on an idle connection, opening a new one if needed up to
+ * ASYNC_MAX_CONNS, or else on the connection with the fewest requests
+ * outstanding.  The context's epoll fd is readable when a reply is
+ * waiting on any of its connections.
+ */
+
+#define ASYNC_MAX_CONNS 16
+
+struct async_ctx {
+	struct async_ctx *next;
+	pthread_mutex_t mutex;
+	int epfd;
+	int id;
+	int conn_count;
+	int conns[ASYNC_MAX_CONNS];
+};
+
+static pthread_mutex_t asyncs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct async_ctx *asyncs;
+
+/* returns with ctx->mutex held */
+
+static struct async_ctx *lock_async(int epfd)
+{
+	struct async_ctx *ctx;
+
+	pthread_mutex_lock(&asyncs_mutex);
+	for (ctx = asyncs; ctx; ctx = ctx->next) {
+		if (ctx->epfd == epfd) {
+			pthread_mutex_lock(&ctx->mutex);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&asyncs_mutex);
+	return ctx;
+}
+
+/* called with ctx->mutex held, returns a conn fd or -errno */
+
+static int async_conn(struct async_ctx *ctx, int pid)
+{
+	struct epoll_event ev;
+	struct conn_req *req;
+	struct conn *cn;
+	int best = -1, best_count = 0, idle = -1;
+	int i, conn, full = 0;
+
+	for (i = 0; i < ctx->conn_count; i++) {
+		cn = lock_conn(ctx->conns[i]);
+		if (!cn)
+			continue;
+
+		if (cn->error) {
+			pthread_mutex_unlock(&cn->mutex);
+			continue;
+		}
+
+		for (req = cn->pending; req; req = req->next) {
+			if (req->pid == pid)
+				break;
+		}
+		if (req) {
+			full = (cn->pending_count >= CONN_MAX_PENDING);
+			pthread_mutex_unlock(&cn->mutex);
+			return full ? -EAGAIN : ctx->conns[i];
+		}
+
+		if (!cn->pending_count && idle < 0)
+			idle = ctx->conns[i];
+
+		if (best < 0 || cn->pending_count < best_count) {
+			best = ctx->conns[i];
+			best_count = cn->pending_count;
+		}
+		pthread_mutex_unlock(&cn->mutex);
+	}
+
+	if (idle >= 0)
+		return idle;
+
+	if (ctx->conn_count < ASYNC_MAX_CONNS) {
+		conn = sanlock_conn_open();
+		if (conn < 0)
+			goto use_best;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = conn;
+
+		if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, conn, &ev) < 0) {
+			sanlock_conn_close(conn);
+			goto use_best;
+		}
+
+		ctx->conns[ctx->conn_count++] = conn;
+		return conn;
+	}
+
+ use_best:
+	if (best < 0)
+		return -ENOTCONN;
+	if (best_count >= CONN_MAX_PENDING)
+		return -EAGAIN;
+	return best;
+}
+
+static int async_send(int actx, int cmd, int pid, uint32_t flags,
+		      uint32_t data, const void *buf, int len)
+{
+	struct async_ctx *ctx;
+	struct conn_req tmpl;
+	int conn, rv;
+
+	ctx = lock_async(actx);
+	if (!ctx)
+		return -EBADF;
+
+	conn = async_conn(ctx, pid);
+	if (conn < 0) {
+		rv = conn;
+		goto out;
+	}
+
+	if (ctx->id == INT_MAX)
+		ctx->id = 0;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.cmd = cmd;
+	tmpl.pid = pid;
+	tmpl.id = ++ctx->id;
+
+	rv = conn_send(conn, &tmpl, flags, data, buf, len, NULL, 0);
+	if (rv > 0)
+		rv = tmpl.id;
+ out:
+	pthread_mutex_unlock(&ctx->mutex);
+	return rv;
+}
+
+int sanlock_async_open(void)
+{
+	struct async_ctx *ctx;
+	int epfd;
+
+	ctx = malloc(sizeof(struct async_ctx));
+	if (!ctx)
+		return -ENOMEM;
+	memset(ctx, 0, sizeof(struct async_ctx));
+	pthread_mutex_init(&ctx->mutex, NULL);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		free(ctx);
+		return -errno;
+	}
+	ctx->epfd = epfd;
+
+	pthread_mutex_lock(&asyncs_mutex);
+	ctx->next = asyncs;
+	asyncs = ctx;
+	pthread_mutex_unlock(&asyncs_mutex);
+
+	return epfd;
+}
+
+int sanlock_async_close(int actx)
+{
+	struct async_ctx **pctx, *ctx;
+	int i;
+
+	pthread_mutex_lock(&asyncs_mutex);
+	for (pctx = &asyncs; *pctx; pctx = &(*pctx)->next) {
+		if ((*pctx)->epfd == actx)
+			break;
+	}
+	ctx = *pctx;
+	if (ctx)
+		*pctx = ctx->next;
+	pthread_mutex_unlock(&asyncs_mutex);
+
+	if (!ctx)
+		return -EBADF;
+
+	/* wait for any thread still using the context */
+	pthread_mutex_lock(&ctx->mutex);
+	for (i = 0; i < ctx->conn_count; i++)
+		sanlock_conn_close(ctx->conns[i]);
+	close(ctx->epfd);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+	return 0;
+}
+
+int sanlock_async_result(int actx, int *id, int *result)
+{
+	struct epoll_event events[ASYNC_MAX_CONNS];
+	struct conn_req **preq, *req;
+	struct async_ctx *ctx;
+	struct conn *cn;
+	int i, n, conn, rv = -EAGAIN;
+
+	if (!id || !result)
+		return -EINVAL;
+
+	ctx = lock_async(actx);
+	if (!ctx)
+		return -EBADF;
+
+	/* read one waiting reply from each connection that has one */
+
+	n = epoll_wait(ctx->epfd, events, ASYNC_MAX_CONNS, 0);
+
+	for (i = 0; i < n; i++) {
+		cn = lock_conn(events[i].data.fd);
+		if (!cn)
+			continue;
+		if (cn->pending)
+			conn_recv_reply(cn);
+		else if (!cn->error)
+			conn_fail(cn, -ENOTCONN); /* closed by the daemon */
+		pthread_mutex_unlock(&cn->mutex);
+	}
+
+	/* return the oldest completed request, closing failed connections */
+
+	for (i = 0; i < ctx->conn_count; i++) {
+		conn = ctx->conns[i];
+
+		cn = lock_conn(conn);
+		if (!cn)
+			continue;
+
+		if (cn->done) {
+			for (preq = &cn->done; (*preq)->next; preq = &(*preq)->next)
+				;
+			req = *preq;
+			*preq = NULL;
+			*id = req->id;
+			*result = req->result;
+			free(req);
+			pthread_mutex_unlock(&cn->mutex);
+			rv = 0;
+			break;
+		}
+
+		if (!cn->error) {
+			pthread_mutex_unlock(&cn->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&cn->mutex);
+
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, conn, NULL);
+		sanlock_conn_close(conn);
+		ctx->conns[i--] = ctx->conns[--ctx->conn_count];
+	}
+
+	pthread_mutex_unlock(&ctx->mutex);
+	return rv;
+}
+
+int sanlock_async_acquire(int actx, int pid, uint32_t flags, int res_count,
+			  struct sanlk_resource *res_args[],
+			  struct sanlk_options *opt_in)
+{
+	struct sanlk_resource *res;
+	struct sanlk_options opt;
+	char *buf, *p;
+	int rv, i, datalen = 0;
+
+	if (pid <= 0 || res_count <= 0 || res_count > SANLK_MAX_RESOURCES)
+		return -EINVAL;
+
+	for (i = 0; i < res_count; i++) {
+		res = res_args[i];
+		if (res->num_disks > SANLK_MAX_DISKS)
+			return -EINVAL;
+		datalen += sizeof(struct sanlk_resource);
+		datalen += (res->num_disks * sizeof(struct sanlk_disk));
+	}
+	datalen += sizeof(struct sanlk_options);
+
+	/* the daemon does not read data beyond opt, and on a pipelined
+	   connection unread data would be taken as the next request */
+	if (opt_in && opt_in->len)
+		return -EINVAL;
+
+	if (opt_in)
+		memcpy(&opt, opt_in, sizeof(struct sanlk_options));
+	else
+		memset(&opt, 0, sizeof(opt));
+
+	buf = malloc(datalen);
+	if (!buf)
+		return -ENOMEM;
+	p = buf;
+
+	for (i = 0; i < res_count; i++) {
+		res = res_args[i];
+		memcpy(p, res, sizeof(struct sanlk_resource));
+		p += sizeof(struct sanlk_resource);
+		memcpy(p, res->disks, sizeof(struct sanlk_disk) * res->num_disks);
+		p += sizeof(struct sanlk_disk) * res->num_disks;
+	}
+	memcpy(p, &opt, sizeof(struct sanlk_options));
+
+	rv = async_send(actx, SM_CMD_ACQUIRE, pid, flags, res_count, buf, datalen);
+	free(buf);
+	return rv;
+}
+
+int sanlock_async_release(int actx, int pid, uint32_t flags, int res_count,
+			  struct sanlk_resource *res_args[])
+{
+	char *buf;
+	int rv, i;
+
+	if (pid <= 0 || res_count < 0 || res_count > SANLK_MAX_RESOURCES)
+		return -EINVAL;
+
+	if (!res_count)
+		return async_send(actx, SM_CMD_RELEASE, pid, flags, 0, NULL, 0);
+
+	buf = malloc(res_count * sizeof(struct sanlk_resource));
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < res_count; i++)
+		memcpy(buf + i * sizeof(struct sanlk_resource), res_args[i],
+		       sizeof(struct sanlk_resource));
+
+	rv = async_send(actx, SM_CMD_RELEASE, pid, flags, res_count,
+			buf, res_count * sizeof(struct sanlk_resource));
+	free(buf);
+	return rv;
+}
+
 /*
  * src may have colons/spaces escaped (with backslash) or unescaped.
  * if unescaped colons/spaces are found, insert backslash before them.
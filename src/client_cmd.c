@@ -37,6 +37,7 @@
 #endif
 
 extern int send_command(int cmd, uint32_t data);
+extern int send_command_flags(int cmd, uint32_t cmd_flags, uint32_t data);
 
 static void print_debug(char *str, int len)
 {
@@ -180,6 +181,15 @@ static void status_host(struct sanlk_state *st, char *str, int debug)
 		print_debug(str, st->str_len);
 }
 
+static void status_device(struct sanlk_state *st, char *str, int debug)
+{
+	printf("d %.48s depth %u renewals %llu\n", st->name, st->data32,
+	       (unsigned long long)st->data64);
+
+	if (st->str_len && debug)
+		print_debug(str, st->str_len);
+}
+
 static void print_st(struct sanlk_state *st, char *str, char *bin, int debug)
 {
 	switch (st->type) {
@@ -195,6 +205,9 @@ static void print_st(struct sanlk_state *st, char *str, char *bin, int debug)
 	case SANLK_STATE_RESOURCE:
 		status_resource(st, str, bin, debug);
 		break;
+	case SANLK_STATE_DEVICE:
+		status_device(st, str, debug);
+		break;
 	}
 }
 
@@ -372,36 +385,398 @@ static void recv_bin(int fd, struct sanlk_state *st, char *bin)
 	}
 }
 
-int sanlock_status(int debug, char sort_arg)
+/*
+ * The daemon sends the status as binary records (SANLK_STATUS_BIN),
+ * which are turned back into a sanlk_state, its string and its binary
+ * data here, and printed the same as the sanlk_state sent by a daemon
+ * without binary status.
+ */
+
+#define STATUS_RECV_SIZE (64 * 1024)
+
+struct state_stream {
+	int fd;
+	int bin;
+	int off;	/* next record in buf */
+	int len;	/* end of data in buf */
+	char *buf;
+};
+
+static const char *list_str(uint32_t list, const char *main_name)
+{
+	switch (list) {
+	case SANLK_STATUS_LIST_MAIN:
+		return main_name;
+	case SANLK_STATUS_LIST_ADD:
+		return "add";
+	case SANLK_STATUS_LIST_REM:
+		return "rem";
+	case SANLK_STATUS_LIST_ORPHAN:
+		return "orphan";
+	}
+	return "unknown";
+}
+
+static int rec_daemon(struct sanlk_status_rec *rec, struct sanlk_state *st, char *str)
+{
+	struct sanlk_status_daemon *sd = (struct sanlk_status_daemon *)rec;
+
+	if (rec->len < sizeof(*sd) || sd->str_len > rec->len - sizeof(*sd))
+		return -EPROTO;
+
+	memcpy(st->name, sd->name, SANLK_NAME_LEN);
+
+	if (sd->str_len) {
+		st->str_len = sd->str_len < SANLK_STATE_MAXSTR ? sd->str_len : SANLK_STATE_MAXSTR;
+		memcpy(str, sd->str, st->str_len);
+		str[st->str_len - 1] = '\0';
+	}
+	return 0;
+}
+
+static int rec_client(struct sanlk_status_rec *rec, struct sanlk_state *st, char *str)
+{
+	struct sanlk_status_client *sc = (struct sanlk_status_client *)rec;
+
+	if (rec->len < sizeof(*sc))
+		return -EPROTO;
+
+	st->data32 = sc->pid;
+	memcpy(st->name, sc->name, SANLK_NAME_LEN);
+
+	snprintf(str, SANLK_STATE_MAXSTR-1,
+		 "ci=%d "
+		 "fd=%d "
+		 "pid=%d "
+		 "flags=%x "
+		 "restricted=%x "
+		 "cmd_active=%d "
+		 "cmd_last=%d "
+		 "pid_dead=%d "
+		 "kill_count=%d "
+		 "kill_last=%llu "
+		 "suspend=%d "
+		 "need_free=%d",
+		 sc->ci,
+		 sc->fd,
+		 sc->pid,
+		 sc->flags,
+		 sc->restricted,
+		 sc->cmd_active,
+		 sc->cmd_last,
+		 sc->pid_dead,
+		 sc->kill_count,
+		 (unsigned long long)sc->kill_last,
+		 sc->suspend,
+		 sc->need_free);
+
+	st->str_len = strlen(str) + 1;
+	return 0;
+}
+
+static int rec_lockspace(struct sanlk_status_rec *rec, struct sanlk_state *st, char *str, char *bin)
+{
+	struct sanlk_status_lockspace *sl = (struct sanlk_status_lockspace *)rec;
+
+	if (rec->len < sizeof(*sl))
+		return -EPROTO;
+
+	st->data64 = sl->ls.host_id;
+	memcpy(st->name, sl->ls.name, SANLK_NAME_LEN);
+	memcpy(bin, &sl->ls, sizeof(struct sanlk_lockspace));
+
+	snprintf(str, SANLK_STATE_MAXSTR-1,
+		 "list=%s "
+		 "space_id=%u "
+		 "io_timeout=%d "
+		 "sector_size=%d "
+		 "align_size=%d "
+		 "host_generation=%llu "
+		 "renew_fail=%d "
+		 "space_dead=%d "
+		 "killing_pids=%d "
+		 "used_retries=%u "
+		 "external_used=%d "
+		 "used_by_orphans=%d "
+		 "renewal_read_extend_sec=%u "
+		 "renewal_full_scan_sec=%u "
+		 "renewal_read_hosts=%d "
+		 "set_max_sectors_kb=%u "
+		 "corrupt_result=%d "
+		 "acquire_last_result=%d "
+		 "renewal_last_result=%d "
+		 "acquire_last_attempt=%llu "
+		 "acquire_last_success=%llu "
+		 "renewal_last_attempt=%llu "
+		 "renewal_last_success=%llu",
+		 list_str(sl->list, "spaces"),
+		 sl->space_id,
+		 sl->io_timeout,
+		 sl->sector_size,
+		 sl->align_size,
+		 (unsigned long long)sl->host_generation,
+		 sl->renew_fail,
+		 sl->space_dead,
+		 sl->killing_pids,
+		 sl->used_retries,
+		 sl->external_used,
+		 sl->used_by_orphans,
+		 sl->renewal_read_extend_sec,
+		 sl->renewal_full_scan_sec,
+		 sl->renewal_read_hosts,
+		 sl->set_max_sectors_kb,
+		 sl->corrupt_result,
+		 sl->acquire_last_result,
+		 sl->renewal_last_result,
+		 (unsigned long long)sl->acquire_last_attempt,
+		 (unsigned long long)sl->acquire_last_success,
+		 (unsigned long long)sl->renewal_last_attempt,
+		 (unsigned long long)sl->renewal_last_success);
+
+	st->str_len = strlen(str) + 1;
+	return 0;
+}
+
+static int rec_resource(struct sanlk_status_rec *rec, struct sanlk_state *st, char *str, char *bin)
+{
+	struct sanlk_status_resource *sr = (struct sanlk_status_resource *)rec;
+	struct sanlk_resource *res = (struct sanlk_resource *)bin;
+	int disks_len;
+
+	if (rec->len < sizeof(*sr) || sr->r.num_disks > SANLK_MAX_DISKS)
+		return -EPROTO;
+
+	disks_len = sr->r.num_disks * sizeof(struct sanlk_disk);
+	if (disks_len > rec->len - sizeof(*sr))
+		return -EPROTO;
+
+	st->data32 = sr->pid;
+	st->data64 = sr->lver;
+	memcpy(st->name, sr->r.name, SANLK_NAME_LEN);
+	memcpy(res, &sr->r, sizeof(struct sanlk_resource));
+	memcpy(res->disks, sr->r.disks, disks_len);
+
+	snprintf(str, SANLK_STATE_MAXSTR-1,
+		 "list=%s "
+		 "flags=%x "
+		 "sector_size=%d "
+		 "align_size=%d "
+		 "lver=%llu "
+		 "reused=%u "
+		 "res_id=%u "
+		 "token_id=%u",
+		 list_str(sr->list, "held"),
+		 sr->flags,
+		 sr->sector_size,
+		 sr->align_size,
+		 (unsigned long long)sr->lver,
+		 sr->reused,
+		 sr->res_id,
+		 sr->token_id);
+
+	st->str_len = strlen(str) + 1;
+	return 0;
+}
+
+static int rec_device(struct sanlk_status_rec *rec, struct sanlk_state *st, char *str)
+{
+	struct sanlk_status_device *sd = (struct sanlk_status_device *)rec;
+
+	if (rec->len < sizeof(*sd))
+		return -EPROTO;
+
+	st->data32 = sd->depth;
+	st->data64 = sd->renewals;
+	memcpy(st->name, sd->name, SANLK_NAME_LEN);
+
+	snprintf(str, SANLK_STATE_MAXSTR-1,
+		 "path=%.1024s "
+		 "lockspaces=%d "
+		 "depth=%d "
+		 "max_depth=%d "
+		 "renewals=%llu "
+		 "delayed=%llu "
+		 "delay_ms=%llu "
+		 "read_count=%llu "
+		 "read_ms=%llu "
+		 "read_ms_max=%d "
+		 "write_count=%llu "
+		 "write_ms=%llu "
+		 "write_ms_max=%d",
+		 sd->path,
+		 sd->lockspaces,
+		 sd->depth,
+		 sd->max_depth,
+		 (unsigned long long)sd->renewals,
+		 (unsigned long long)sd->delayed,
+		 (unsigned long long)sd->delay_ms,
+		 (unsigned long long)sd->read_count,
+		 (unsigned long long)sd->read_ms,
+		 sd->read_ms_max,
+		 (unsigned long long)sd->write_count,
+		 (unsigned long long)sd->write_ms,
+		 sd->write_ms_max);
+
+	st->str_len = strlen(str) + 1;
+	return 0;
+}
+
+/* returns 0 with the stream open, data is the last SANLK_STATE_ wanted */
+
+static int open_state_stream(struct state_stream *ss, uint32_t data)
 {
 	struct sm_header h;
-	struct sanlk_state state;
-	char maxstr[SANLK_STATE_MAXSTR];
-	char maxbin[SANLK_STATE_MAXSTR];
-	struct sanlk_state *st;
-	char *buf = NULL, *str, *bin;
-	int fd, rv, len;
-	int sort_p = 0, sort_s = 0;
+	int fd, rv;
 
-	if (sort_arg == 'p')
-		sort_p = 1;
-	else if (sort_arg == 's')
-		sort_s = 1;
+	memset(ss, 0, sizeof(struct state_stream));
 
-	fd = send_command(SM_CMD_STATUS, 0);
+	fd = send_command_flags(SM_CMD_STATUS, SANLK_STATUS_BIN, data);
 	if (fd < 0)
 		return fd;
 
 	rv = recv(fd, &h, sizeof(h), MSG_WAITALL);
 	if (rv < 0) {
 		rv = -errno;
-		goto out;
+		goto fail;
 	}
 	if (rv != sizeof(h)) {
 		rv = -1;
-		goto out;
+		goto fail;
 	}
 
+	/* an older daemon ignores SANLK_STATUS_BIN and leaves data2 0 */
+
+	if (h.data2 && h.data2 != SANLK_STATUS_VERSION) {
+		rv = -EPROTO;
+		goto fail;
+	}
+
+	if ((int)h.data < 0) {
+		rv = (int)h.data;
+		goto fail;
+	}
+
+	if (h.data2) {
+		ss->buf = malloc(STATUS_RECV_SIZE);
+		if (!ss->buf) {
+			rv = -ENOMEM;
+			goto fail;
+		}
+		ss->bin = 1;
+	}
+
+	ss->fd = fd;
+	return 0;
+ fail:
+	close(fd);
+	return rv;
+}
+
+static void close_state_stream(struct state_stream *ss)
+{
+	close(ss->fd);
+	free(ss->buf);
+}
+
+/* returns 1 for the next st, 0 at the end of the stream */
+
+static int recv_state(struct state_stream *ss, struct sanlk_state *st, char *str, char *bin)
+{
+	struct sanlk_status_rec *rec;
+	int avail, rv;
+
+	if (!ss->bin) {
+		rv = recv(ss->fd, st, sizeof(struct sanlk_state), MSG_WAITALL);
+		if (rv != sizeof(struct sanlk_state))
+			return 0;
+
+		if (st->str_len) {
+			rv = recv(ss->fd, str, st->str_len, MSG_WAITALL);
+			if (rv != st->str_len)
+				return 0;
+		}
+
+		recv_bin(ss->fd, st, bin);
+		return 1;
+	}
+
+ next:
+	while (1) {
+		rec = (struct sanlk_status_rec *)(ss->buf + ss->off);
+		avail = ss->len - ss->off;
+
+		if (avail >= (int)sizeof(struct sanlk_status_rec)) {
+			if (rec->len < sizeof(struct sanlk_status_rec) ||
+			    rec->len > STATUS_RECV_SIZE || rec->len % 8)
+				return -EPROTO;
+			if (avail >= (int)rec->len)
+				break;
+		}
+
+		if (ss->off) {
+			memmove(ss->buf, ss->buf + ss->off, avail);
+			ss->len = avail;
+			ss->off = 0;
+			continue;
+		}
+
+		rv = recv(ss->fd, ss->buf + ss->len, STATUS_RECV_SIZE - ss->len, 0);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return 0;
+		ss->len += rv;
+	}
+
+	ss->off += rec->len;
+
+	switch (rec->type) {
+	case SANLK_STATE_DAEMON:
+		rv = rec_daemon(rec, st, str);
+		break;
+	case SANLK_STATE_CLIENT:
+		rv = rec_client(rec, st, str);
+		break;
+	case SANLK_STATE_LOCKSPACE:
+		rv = rec_lockspace(rec, st, str, bin);
+		break;
+	case SANLK_STATE_RESOURCE:
+		rv = rec_resource(rec, st, str, bin);
+		break;
+	case SANLK_STATE_DEVICE:
+		rv = rec_device(rec, st, str);
+		break;
+	default:
+		goto next;
+	}
+
+	if (rv < 0)
+		return rv;
+
+	st->type = rec->type;
+	return 1;
+}
+
+int sanlock_status(int debug, char sort_arg)
+{
+	struct state_stream ss;
+	struct sanlk_state state;
+	char maxstr[SANLK_STATE_MAXSTR];
+	char maxbin[SANLK_STATE_MAXSTR*3];
+	struct sanlk_state *st;
+	char *buf = NULL, *str, *bin;
+	int rv, len;
+	int sort_p = 0, sort_s = 0;
+
+	if (sort_arg == 'p')
+		sort_p = 1;
+	else if (sort_arg == 's')
+		sort_s = 1;
+
+	rv = open_state_stream(&ss, 0);
+	if (rv < 0)
+		return rv;
+
 	st = &state;
 	str = maxstr;
 	bin = maxbin;
@@ -422,19 +797,11 @@ int sanlock_status(int debug, char sort_arg)
 			memset(maxbin, 0, sizeof(maxbin));
 		}
 
-		rv = recv(fd, st, sizeof(struct sanlk_state), MSG_WAITALL);
+		rv = recv_state(&ss, st, str, bin);
+		if (rv < 0)
+			goto out;
 		if (!rv)
 			break;
-		if (rv != sizeof(struct sanlk_state))
-			break;
-
-		if (st->str_len) {
-			rv = recv(fd, str, st->str_len, MSG_WAITALL);
-			if (rv != st->str_len)
-				break;
-		}
-
-		recv_bin(fd, st, bin);
 
 		if (sort_s || sort_p) {
 			if ((sort_count == MAX_SORT_ENTRIES) || (!buf)) {
@@ -454,6 +821,7 @@ int sanlock_status(int debug, char sort_arg)
 		print_type(SANLK_STATE_DAEMON, debug);
 		print_p(-1, debug);
 		print_type(SANLK_STATE_LOCKSPACE, debug);
+		print_type(SANLK_STATE_DEVICE, debug);
 		print_r_by_p(debug);
 		if (sort_done < sort_count) {
 			printf("-\n");
@@ -464,6 +832,7 @@ int sanlock_status(int debug, char sort_arg)
 		print_p(-1, debug);
 		print_type(SANLK_STATE_CLIENT, debug);
 		print_r_by_s(debug);
+		print_type(SANLK_STATE_DEVICE, debug);
 		if (sort_done < sort_count) {
 			printf("-\n");
 			print_type(0, debug);
@@ -472,7 +841,7 @@ int sanlock_status(int debug, char sort_arg)
 
 	rv = 0;
  out:
-	close(fd);
+	close_state_stream(&ss);
 	return rv;
 }
 
@@ -536,32 +905,21 @@ static int lockspace_host_status(int debug, char *lockspace_name)
 
 int sanlock_host_status(int debug, char *lockspace_name)
 {
-	struct sm_header h;
+	struct state_stream ss;
 	struct sanlk_state state;
 	char maxstr[SANLK_STATE_MAXSTR];
-	char maxbin[SANLK_STATE_MAXSTR];
+	char maxbin[SANLK_STATE_MAXSTR*3];
 	struct sanlk_state *st;
 	char *str, *bin;
 	struct sanlk_lockspace *ls;
-	int fd, rv, i;
+	int rv, i;
 
 	if (lockspace_name && lockspace_name[0])
 		return lockspace_host_status(debug, lockspace_name);
 
-	fd = send_command(SM_CMD_STATUS, SANLK_STATE_LOCKSPACE);
-	if (fd < 0)
-		return fd;
-
-	rv = recv(fd, &h, sizeof(h), MSG_WAITALL);
-	if (rv < 0) {
-		rv = -errno;
-		close(fd);
+	rv = open_state_stream(&ss, SANLK_STATE_LOCKSPACE);
+	if (rv < 0)
 		return rv;
-	}
-	if (rv != sizeof(h)) {
-		close(fd);
-		return -1;
-	}
 
 	st = &state;
 	str = maxstr;
@@ -572,20 +930,10 @@ int sanlock_host_status(int debug, char *lockspace_name)
 		memset(maxstr, 0, sizeof(maxstr));
 		memset(maxbin, 0, sizeof(maxbin));
 
-		rv = recv(fd, st, sizeof(struct sanlk_state), MSG_WAITALL);
-		if (!rv)
-			break;
-		if (rv != sizeof(struct sanlk_state))
+		rv = recv_state(&ss, st, str, bin);
+		if (rv <= 0)
 			break;
 
-		if (st->str_len) {
-			rv = recv(fd, str, st->str_len, MSG_WAITALL);
-			if (rv != st->str_len)
-				break;
-		}
-
-		recv_bin(fd, st, bin);
-
 		if (st->type != SANLK_STATE_LOCKSPACE)
 			continue;
 
@@ -594,7 +942,7 @@ int sanlock_host_status(int debug, char *lockspace_name)
 		sort_bufs[sort_count++] = strdup(ls->name);
 	}
 
-	close(fd);
+	close_state_stream(&ss);
 
 	for (i = 0; i < sort_count; i++) {
 		printf("lockspace %s\n", sort_bufs[i]);
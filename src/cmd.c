@@ -32,6 +32,7 @@
 #include <sys/mman.h>
 #include <sys/mman.h>
 #include <sys/utsname.h>
+#include <sys/sysmacros.h>
 #include <uuid/uuid.h>
 
 #include "sanlock_internal.h"
@@ -47,13 +48,18 @@
 #include "task.h"
 #include "cmd.h"
 #include "rindex.h"
+#include "iosched.h"
+#include "renew.h"
+#include "diskcache.h"
 
 /* from main.c */
+void main_loop_wake(void);
 void client_resume(int ci);
 void client_free(int ci);
 void client_recv_all(int ci, struct sm_header *h_recv, int pos);
 void client_pid_dead(int ci);
 void send_result(int ci, int fd, struct sm_header *h_recv, int result);
+int print_state_pool(char *str, int len);
 
 static uint32_t token_id_counter = 1;
 
@@ -89,32 +95,182 @@ retry:
 	return 0;
 }
 
-static void release_cl_tokens(struct task *task, struct client *cl)
+/*
+ * The pid is dead, so nothing waits for its leases to be released on disk;
+ * the resource workers release them all concurrently, as client_pid_dead
+ * does when no command is active.
+ */
+
+static void release_cl_tokens(struct client *cl)
 {
-	struct token *token;
 	int j;
 
+	release_tokens_async(cl->tokens, cl->tokens_slots);
+
 	for (j = 0; j < cl->tokens_slots; j++) {
-		token = cl->tokens[j];
-		if (!token)
-			continue;
-		release_token(task, token, NULL);
-		free(token);
+		if (cl->tokens[j])
+			free(cl->tokens[j]);
 	}
 }
 
 static void release_new_tokens(struct task *task, struct token *new_tokens[],
-			       int alloc_count, int acquire_count)
+			       int new_acquired[], int alloc_count)
 {
 	int i;
 
-	for (i = 0; i < acquire_count; i++)
-		release_token(task, new_tokens[i], NULL);
+	for (i = 0; i < alloc_count; i++) {
+		if (new_acquired[i])
+			release_token(task, new_tokens[i], NULL);
+	}
 
 	for (i = 0; i < alloc_count; i++)
 		free(new_tokens[i]);
 }
 
+/*
+ * The tokens in one acquire request are independent, so the paxos
+ * ballots for them are run concurrently.  Up to ACQUIRE_THREADS workers
+ * take the next token from the request in turn: the worker running
+ * cmd_acquire, and threads with their own task (each task needs its own
+ * aio context.)  The request is all or nothing, so after one acquire
+ * fails, no more are started.  A token naming the same resource as an
+ * earlier token in the request is acquired after the others are done,
+ * as it was when the tokens were acquired one by one, so that the
+ * second shared token is added to the first rather than finding it
+ * still being acquired.
+ */
+
+#define ACQUIRE_THREADS 4
+
+struct acquire_tokens {
+	pthread_mutex_t mutex;
+	struct token **tokens;
+	int *rv;
+	int *done;
+	int *later;
+	int count;
+	int next;
+	int failed;
+	uint32_t cmd_flags;
+	char *killpath;
+	char *killargs;
+};
+
+static void acquire_tokens_work(struct task *task, struct acquire_tokens *at)
+{
+	int i, rv;
+
+	while (1) {
+		pthread_mutex_lock(&at->mutex);
+		while (at->next < at->count && at->later[at->next])
+			at->next++;
+		if (at->failed || at->next >= at->count) {
+			pthread_mutex_unlock(&at->mutex);
+			break;
+		}
+		i = at->next++;
+		pthread_mutex_unlock(&at->mutex);
+
+		rv = acquire_token(task, at->tokens[i], at->cmd_flags,
+				   at->killpath, at->killargs);
+
+		pthread_mutex_lock(&at->mutex);
+		at->rv[i] = rv;
+		at->done[i] = 1;
+		if (rv < 0)
+			at->failed = 1;
+		pthread_mutex_unlock(&at->mutex);
+	}
+}
+
+static void *acquire_tokens_thread(void *data)
+{
+	struct acquire_tokens *at = data;
+	struct task task;
+
+	memset(&task, 0, sizeof(struct task));
+	setup_task_aio(&task, main_task.use_aio, WORKER_AIO_CB_SIZE);
+	snprintf(task.name, NAME_ID_SIZE, "acquire");
+
+	acquire_tokens_work(&task, at);
+
+	close_task_aio(&task);
+	return NULL;
+}
+
+static int same_resource(struct token *a, struct token *b)
+{
+	return !strncmp(a->r.lockspace_name, b->r.lockspace_name, SANLK_NAME_LEN) &&
+	       !strncmp(a->r.name, b->r.name, SANLK_NAME_LEN);
+}
+
+/* new_done[i] is set for each token that acquire_token was called for */
+
+static void acquire_new_tokens(struct task *task, struct token *new_tokens[],
+			       int new_tokens_count, int new_rv[], int new_done[],
+			       uint32_t cmd_flags, char *killpath, char *killargs)
+{
+	struct acquire_tokens at;
+	pthread_t threads[ACQUIRE_THREADS];
+	int later[SANLK_MAX_RESOURCES];
+	int now_count = 0, thread_count = 0;
+	int i, j, rv;
+
+	memset(&at, 0, sizeof(at));
+	pthread_mutex_init(&at.mutex, NULL);
+	at.tokens = new_tokens;
+	at.rv = new_rv;
+	at.done = new_done;
+	at.later = later;
+	at.count = new_tokens_count;
+	at.cmd_flags = cmd_flags;
+	at.killpath = killpath;
+	at.killargs = killargs;
+
+	for (i = 0; i < new_tokens_count; i++) {
+		later[i] = 0;
+		for (j = 0; j < i; j++) {
+			if (same_resource(new_tokens[i], new_tokens[j])) {
+				later[i] = 1;
+				break;
+			}
+		}
+		if (!later[i])
+			now_count++;
+	}
+
+	/* this worker is one of the ACQUIRE_THREADS */
+
+	for (i = 0; i < now_count - 1 && i < ACQUIRE_THREADS - 1; i++) {
+		rv = pthread_create(&threads[i], NULL, acquire_tokens_thread, &at);
+		if (rv) {
+			/* the remaining tokens are acquired by fewer workers */
+			log_error("acquire_new_tokens thread error %d", rv);
+			break;
+		}
+		thread_count++;
+	}
+
+	acquire_tokens_work(task, &at);
+
+	for (i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&at.mutex);
+
+	for (i = 0; i < new_tokens_count; i++) {
+		if (at.failed)
+			break;
+		if (!later[i])
+			continue;
+		new_rv[i] = acquire_token(task, new_tokens[i], cmd_flags,
+					  killpath, killargs);
+		new_done[i] = 1;
+		if (new_rv[i] < 0)
+			at.failed = 1;
+	}
+}
+
 /* called with both spaces_mutex and cl->mutex held */
 
 static int check_new_tokens_space(struct client *cl,
@@ -193,6 +349,9 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	struct client *cl;
 	struct token *token = NULL;
 	struct token *new_tokens[SANLK_MAX_RESOURCES];
+	int new_acquired[SANLK_MAX_RESOURCES];
+	int new_rv[SANLK_MAX_RESOURCES];
+	int new_done[SANLK_MAX_RESOURCES];
 	struct token **grow_tokens;
 	struct sanlk_resource res;
 	struct sanlk_options opt;
@@ -201,7 +360,7 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	char killargs[SANLK_HELPER_ARGS_LEN];
 	int token_len, disks_len;
 	int fd, rv, i, j, empty_slots, lvl;
-	int alloc_count = 0, acquire_count = 0;
+	int alloc_count = 0;
 	int pos = 0, pid_dead = 0;
 	int new_tokens_count;
 	int recv_done = 0;
@@ -215,6 +374,8 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	fd = client[ca->ci_in].fd;
 
 	new_tokens_count = ca->header.data;
+	memset(new_acquired, 0, sizeof(new_acquired));
+	memset(new_done, 0, sizeof(new_done));
 
 	log_cmd(cmd, "cmd_acquire %d,%d,%d ci_in %d fd %d count %d flags %x",
 		  cl_ci, cl_fd, cl_pid, ca->ci_in, fd, new_tokens_count, ca->header.cmd_flags);
@@ -414,42 +575,54 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 
 	}
 
+	acquire_new_tokens(task, new_tokens, new_tokens_count, new_rv, new_done,
+			   ca->header.cmd_flags, killpath, killargs);
+
 	for (i = 0; i < new_tokens_count; i++) {
 		token = new_tokens[i];
+		rv = new_rv[i];
 
-		rv = acquire_token(task, token, ca->header.cmd_flags, killpath, killargs);
-		if (rv < 0) {
-			switch (rv) {
-			case -EEXIST:
-			case -EAGAIN:
-			case -EBUSY:
-				lvl = LOG_DEBUG;
-				break;
-			case SANLK_ACQUIRE_IDLIVE:
-			case SANLK_ACQUIRE_OWNED:
-			case SANLK_ACQUIRE_OTHER:
-			case SANLK_ACQUIRE_OWNED_RETRY:
-				lvl = com.quiet_fail ? LOG_DEBUG : LOG_ERR;
-				break;
-			default:
-				lvl = LOG_ERR;
-			}
+		/* not started after an earlier token failed */
+		if (!new_done[i])
+			continue;
 
-			if (token->res_id)
-				log_level(token->space_id, token->res_id, NULL, lvl,
-					  "cmd_acquire %d,%d,%d acquire_token %d %s",
-					  cl_ci, cl_fd, cl_pid, rv, acquire_error_str(rv));
-			else
-				log_level(token->space_id, 0, NULL, lvl,
-					  "cmd_acquire %d,%d,%d acquire_token %s %d %s",
-					  cl_ci, cl_fd, cl_pid,
-					  token->r.name, rv, acquire_error_str(rv));
-			result = rv;
-			goto done;
+		if (rv >= 0) {
+			new_acquired[i] = 1;
+			continue;
 		}
-		acquire_count++;
+
+		switch (rv) {
+		case -EEXIST:
+		case -EAGAIN:
+		case -EBUSY:
+			lvl = LOG_DEBUG;
+			break;
+		case SANLK_ACQUIRE_IDLIVE:
+		case SANLK_ACQUIRE_OWNED:
+		case SANLK_ACQUIRE_OTHER:
+		case SANLK_ACQUIRE_OWNED_RETRY:
+			lvl = com.quiet_fail ? LOG_DEBUG : LOG_ERR;
+			break;
+		default:
+			lvl = LOG_ERR;
+		}
+
+		if (token->res_id)
+			log_level(token->space_id, token->res_id, NULL, lvl,
+				  "cmd_acquire %d,%d,%d acquire_token %d %s",
+				  cl_ci, cl_fd, cl_pid, rv, acquire_error_str(rv));
+		else
+			log_level(token->space_id, 0, NULL, lvl,
+				  "cmd_acquire %d,%d,%d acquire_token %s %d %s",
+				  cl_ci, cl_fd, cl_pid,
+				  token->r.name, rv, acquire_error_str(rv));
+		if (!result)
+			result = rv;
 	}
 
+	if (result)
+		goto done;
+
 	/*
 	 * Success acquiring the leases:
 	 * lock mutex,
@@ -486,14 +659,10 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	 * cl->mutex.  So, lock spaces_mutex first, then cl->mutex to avoid the
 	 * deadlock.
 	 *
-	 * Other approaches:
-	 * A solution may be to record in each sp all the pids/cis using it
-	 * prior to starting the acquire.  Then we would not need to do this
-	 * check here to see if the lockspace has been killed (if it was, the
-	 * pid for this ci would have been killed in kill_pids), and
-	 * all_pids_dead() and kill_pids() would not need to go through each cl
-	 * and each cl->token to check if it's using the sp (it would know by
-	 * just looking at sp->pids[] and killing each).
+	 * kill_pids() and all_pids_dead() look only at the clients recorded
+	 * in sp->clients, so the client is recorded in the lockspace of each
+	 * new token here, with spaces_mutex held, before the tokens are added
+	 * to the client.
 	 */
 
  done:
@@ -514,6 +683,19 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 		}
 	}
 
+	/* record the client in each lockspace for kill_pids */
+
+	if (!result && !pid_dead) {
+		for (i = 0; i < new_tokens_count; i++) {
+			rv = space_add_client(new_tokens[i]->r.lockspace_name, cl_ci);
+			if (rv < 0) {
+				/* case 1 becomes case 3 */
+				result = rv;
+				break;
+			}
+		}
+	}
+
 	/* 1. Success acquiring leases, and pid is live */
 
 	if (!result && !pid_dead) {
@@ -541,8 +723,8 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	/* 2. Success acquiring leases, and pid is dead */
 
 	if (!result && pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
-		release_cl_tokens(task, cl);
+		release_new_tokens(task, new_tokens, new_acquired, alloc_count);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 		result = -ENOTTY;
 		goto reply;
@@ -551,15 +733,15 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	/* 3. Failure acquiring leases, and pid is live */
 
 	if (result && !pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
+		release_new_tokens(task, new_tokens, new_acquired, alloc_count);
 		goto reply;
 	}
 
 	/* 4. Failure acquiring leases, and pid is dead */
 
 	if (result && pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
-		release_cl_tokens(task, cl);
+		release_new_tokens(task, new_tokens, new_acquired, alloc_count);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 		goto reply;
 	}
@@ -757,7 +939,7 @@ static void cmd_release(struct task *task, struct cmd_args *ca, uint32_t cmd)
 
 	if (pid_dead) {
 		/* release any tokens not already released above */
-		release_cl_tokens(task, cl);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 	}
 
@@ -874,7 +1056,7 @@ static void cmd_inquire(struct task *task, struct cmd_args *ca, uint32_t cmd)
 		  cl_ci, cl_fd, cl_pid, result, pid_dead, res_count, cat_count, state_strlen);
 
 	if (pid_dead) {
-		release_cl_tokens(task, cl);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 	}
 
@@ -973,7 +1155,7 @@ static void cmd_convert(struct task *task, struct cmd_args *ca, uint32_t cmd)
 		  cl_ci, cl_fd, cl_pid, result, pid_dead);
 
 	if (pid_dead) {
-		release_cl_tokens(task, cl);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 	}
 
@@ -1242,6 +1424,7 @@ static int daemon_shutdown_start(int ci, int fd, int force)
 		shutdown_reply_ci = ci;
 		shutdown_reply_fd = fd;
 		external_shutdown = 2;
+		main_loop_wake();
 		return 0;
 	}
 
@@ -1258,6 +1441,8 @@ static int daemon_shutdown_start(int ci, int fd, int force)
 	}
 	pthread_mutex_unlock(&spaces_mutex);
 
+	if (!rv)
+		main_loop_wake();
 	return rv;
 }
 
@@ -2018,7 +2203,7 @@ static void cmd_killpath(struct task *task, struct cmd_args *ca, uint32_t cmd)
 	if (pid_dead) {
 		/* release tokens in case a client sets/changes its killpath
 		   after it has acquired leases */
-		release_cl_tokens(task, cl);
+		release_cl_tokens(cl);
 		client_free(cl_ci);
 		return;
 	}
@@ -2281,6 +2466,8 @@ void call_cmd_thread(struct task *task, struct cmd_args *ca)
 
 static int print_state_daemon(char *str)
 {
+	int len;
+
 	memset(str, 0, SANLK_STATE_MAXSTR);
 
 	snprintf(str, SANLK_STATE_MAXSTR-1,
@@ -2347,6 +2534,12 @@ static int print_state_daemon(char *str)
 		 sanlock_version_combined,
 		 SM_PROTO);
 
+	len = strlen(str);
+	len += print_state_pool(str + len, SANLK_STATE_MAXSTR - 1 - len);
+	len += print_state_renew(str + len, SANLK_STATE_MAXSTR - 1 - len);
+	len += print_state_resource_workers(str + len, SANLK_STATE_MAXSTR - 1 - len);
+	print_state_disk_cache(str + len, SANLK_STATE_MAXSTR - 1 - len);
+
 	return strlen(str) + 1;
 }
 
@@ -2401,6 +2594,8 @@ static int print_state_lockspace(struct space *sp, char *str, const char *list_n
 		 "external_used=%d "
 		 "used_by_orphans=%d "
 		 "renewal_read_extend_sec=%u "
+		 "renewal_full_scan_sec=%u "
+		 "renewal_read_hosts=%d "
 		 "set_max_sectors_kb=%u "
 		 "corrupt_result=%d "
 		 "acquire_last_result=%d "
@@ -2422,6 +2617,8 @@ static int print_state_lockspace(struct space *sp, char *str, const char *list_n
 		 (sp->flags & SP_EXTERNAL_USED) ? 1 : 0,
 		 (sp->flags & SP_USED_BY_ORPHANS) ? 1 : 0,
 		 sp->renewal_read_extend_sec,
+		 sp->renewal_full_scan_sec,
+		 sp->lease_status.renewal_read_hosts,
 		 sp->set_max_sectors_kb,
 		 sp->lease_status.corrupt_result,
 		 sp->lease_status.acquire_last_result,
@@ -2504,6 +2701,41 @@ static int print_state_renewal(struct renewal_history *hi, char *str)
 	return strlen(str) + 1;
 }
 
+static int print_state_device(struct io_device *dev, char *str)
+{
+	memset(str, 0, SANLK_STATE_MAXSTR);
+
+	snprintf(str, SANLK_STATE_MAXSTR-1,
+		 "path=%s "
+		 "lockspaces=%d "
+		 "depth=%d "
+		 "max_depth=%d "
+		 "renewals=%llu "
+		 "delayed=%llu "
+		 "delay_ms=%llu "
+		 "read_count=%llu "
+		 "read_ms=%llu "
+		 "read_ms_max=%d "
+		 "write_count=%llu "
+		 "write_ms=%llu "
+		 "write_ms_max=%d",
+		 dev->path,
+		 dev->spaces,
+		 dev->depth,
+		 dev->max_depth,
+		 (unsigned long long)dev->renewals,
+		 (unsigned long long)dev->delayed,
+		 (unsigned long long)dev->delay_ms,
+		 (unsigned long long)dev->read_count,
+		 (unsigned long long)dev->read_ms,
+		 dev->read_ms_max,
+		 (unsigned long long)dev->write_count,
+		 (unsigned long long)dev->write_ms,
+		 dev->write_ms_max);
+
+	return strlen(str) + 1;
+}
+
 static void send_state_daemon(int fd)
 {
 	struct sanlk_state st;
@@ -2607,6 +2839,31 @@ void send_state_resource(int fd, struct resource *r, const char *list_name,
 	}
 }
 
+void send_state_device(int fd, struct io_device *dev);
+
+void send_state_device(int fd, struct io_device *dev)
+{
+	struct sanlk_state st;
+	char str[SANLK_STATE_MAXSTR];
+	int str_len;
+
+	memset(&st, 0, sizeof(st));
+
+	st.type = SANLK_STATE_DEVICE;
+	st.data32 = dev->depth;
+	st.data64 = dev->renewals;
+	snprintf(st.name, SANLK_NAME_LEN, "%u:%u",
+		 major(dev->dev), minor(dev->dev));
+
+	str_len = print_state_device(dev, str);
+
+	st.str_len = str_len;
+
+	send_all(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	if (str_len)
+		send_all(fd, str, str_len, MSG_NOSIGNAL);
+}
+
 static void send_state_host(int fd, struct host_status *hs, int host_id)
 {
 	struct sanlk_state st;
@@ -2648,6 +2905,189 @@ static void send_state_renewal(int fd, struct renewal_history *hi)
 		send_all(fd, str, str_len, MSG_NOSIGNAL);
 }
 
+/*
+ * sanlock client status with SANLK_STATUS_BIN
+ *
+ * The records are copied into one buffer while the locks are held,
+ * and the buffer is sent after they are released.
+ */
+
+#define STATUS_BUF_SIZE (64 * 1024)
+
+struct status_buf {
+	char *buf;
+	int len;
+	int size;
+	int nomem;
+};
+
+/* returns a zeroed record of len bytes, rounded up to 8 */
+
+static void *status_rec(struct status_buf *sb, uint32_t type, int len)
+{
+	struct sanlk_status_rec *rec;
+	char *buf;
+	int size;
+
+	if (sb->nomem)
+		return NULL;
+
+	len = (len + 7) & ~7;
+
+	if (sb->len + len > sb->size) {
+		size = sb->size ? sb->size : STATUS_BUF_SIZE;
+		while (size < sb->len + len)
+			size *= 2;
+
+		buf = realloc(sb->buf, size);
+		if (!buf) {
+			sb->nomem = 1;
+			return NULL;
+		}
+		sb->buf = buf;
+		sb->size = size;
+	}
+
+	rec = (struct sanlk_status_rec *)(sb->buf + sb->len);
+	memset(rec, 0, len);
+	rec->type = type;
+	rec->len = len;
+	sb->len += len;
+	return rec;
+}
+
+static void status_daemon(struct status_buf *sb)
+{
+	struct sanlk_status_daemon *sd;
+	char str[SANLK_STATE_MAXSTR];
+	int str_len;
+
+	str_len = print_state_daemon(str);
+
+	sd = status_rec(sb, SANLK_STATE_DAEMON, sizeof(*sd) + str_len);
+	if (!sd)
+		return;
+
+	memcpy(sd->name, our_host_name_global,
+	       strnlen(our_host_name_global, SANLK_NAME_LEN));
+	sd->str_len = str_len;
+	memcpy(sd->str, str, str_len);
+}
+
+static void status_client(struct status_buf *sb, struct client *cl, int ci)
+{
+	struct sanlk_status_client *sc;
+
+	sc = status_rec(sb, SANLK_STATE_CLIENT, sizeof(*sc));
+	if (!sc)
+		return;
+
+	memcpy(sc->name, cl->owner_name, strnlen(cl->owner_name, SANLK_NAME_LEN));
+	sc->ci = ci;
+	sc->fd = cl->fd;
+	sc->pid = cl->pid;
+	sc->flags = cl->flags;
+	sc->restricted = cl->restricted;
+	sc->cmd_active = cl->cmd_active;
+	sc->cmd_last = cl->cmd_last;
+	sc->pid_dead = cl->pid_dead;
+	sc->kill_count = cl->kill_count;
+	sc->suspend = cl->suspend;
+	sc->need_free = cl->need_free;
+	sc->kill_last = cl->kill_last;
+}
+
+static void status_lockspace(struct status_buf *sb, struct space *sp, uint32_t list)
+{
+	struct sanlk_status_lockspace *sl;
+
+	sl = status_rec(sb, SANLK_STATE_LOCKSPACE, sizeof(*sl));
+	if (!sl)
+		return;
+
+	sl->list = list;
+	sl->space_id = sp->space_id;
+	sl->io_timeout = sp->io_timeout;
+	sl->sector_size = sp->sector_size;
+	sl->align_size = sp->align_size;
+	sl->renew_fail = sp->renew_fail;
+	sl->space_dead = sp->space_dead;
+	sl->killing_pids = sp->killing_pids;
+	sl->used_retries = sp->used_retries;
+	sl->external_used = (sp->flags & SP_EXTERNAL_USED) ? 1 : 0;
+	sl->used_by_orphans = (sp->flags & SP_USED_BY_ORPHANS) ? 1 : 0;
+	sl->renewal_read_extend_sec = sp->renewal_read_extend_sec;
+	sl->renewal_full_scan_sec = sp->renewal_full_scan_sec;
+	sl->renewal_read_hosts = sp->lease_status.renewal_read_hosts;
+	sl->set_max_sectors_kb = sp->set_max_sectors_kb;
+	sl->corrupt_result = sp->lease_status.corrupt_result;
+	sl->acquire_last_result = sp->lease_status.acquire_last_result;
+	sl->renewal_last_result = sp->lease_status.renewal_last_result;
+	sl->host_generation = sp->host_generation;
+	sl->acquire_last_attempt = sp->lease_status.acquire_last_attempt;
+	sl->acquire_last_success = sp->lease_status.acquire_last_success;
+	sl->renewal_last_attempt = sp->lease_status.renewal_last_attempt;
+	sl->renewal_last_success = sp->lease_status.renewal_last_success;
+
+	memcpy(sl->ls.name, sp->space_name, strnlen(sp->space_name, NAME_ID_SIZE));
+	sl->ls.host_id = sp->host_id;
+	memcpy(&sl->ls.host_id_disk, &sp->host_id_disk, sizeof(struct sanlk_disk));
+}
+
+void status_resource(struct status_buf *sb, struct resource *r, uint32_t list,
+		     int pid, uint32_t token_id);
+
+void status_resource(struct status_buf *sb, struct resource *r, uint32_t list,
+		     int pid, uint32_t token_id)
+{
+	struct sanlk_status_resource *sr;
+	int disks_len = r->r.num_disks * sizeof(struct sanlk_disk);
+
+	sr = status_rec(sb, SANLK_STATE_RESOURCE, sizeof(*sr) + disks_len);
+	if (!sr)
+		return;
+
+	sr->list = list;
+	sr->flags = r->flags;
+	sr->sector_size = r->sector_size;
+	sr->align_size = r->align_size;
+	sr->reused = r->reused;
+	sr->res_id = r->res_id;
+	sr->token_id = token_id;
+	sr->pid = pid;
+	sr->lver = r->leader.lver;
+
+	memcpy(&sr->r, &r->r, sizeof(struct sanlk_resource));
+	memcpy(sr->r.disks, r->r.disks, disks_len);
+}
+
+void status_device(struct status_buf *sb, struct io_device *dev);
+
+void status_device(struct status_buf *sb, struct io_device *dev)
+{
+	struct sanlk_status_device *sd;
+
+	sd = status_rec(sb, SANLK_STATE_DEVICE, sizeof(*sd));
+	if (!sd)
+		return;
+
+	snprintf(sd->name, SANLK_NAME_LEN, "%u:%u",
+		 major(dev->dev), minor(dev->dev));
+	memcpy(sd->path, dev->path, SANLK_PATH_LEN);
+	sd->lockspaces = dev->spaces;
+	sd->depth = dev->depth;
+	sd->max_depth = dev->max_depth;
+	sd->read_ms_max = dev->read_ms_max;
+	sd->write_ms_max = dev->write_ms_max;
+	sd->renewals = dev->renewals;
+	sd->delayed = dev->delayed;
+	sd->delay_ms = dev->delay_ms;
+	sd->read_count = dev->read_count;
+	sd->read_ms = dev->read_ms;
+	sd->write_count = dev->write_count;
+	sd->write_ms = dev->write_ms;
+}
+
 static void cmd_status(int ci, int fd, struct sm_header *h_recv, int client_maxi, uint32_t cmd)
 {
 	struct sm_header h;
@@ -2696,12 +3136,80 @@ static void cmd_status(int ci, int fd, struct sm_header *h_recv, int client_maxi
 	if (h_recv->data == SANLK_STATE_LOCKSPACE)
 		return;
 
+	/* iosched.c will iterate through devices and call back here */
+
+	send_state_devices(fd);
+
 	/* resource.c will iterate through private lists and call
 	   back here for each r */
 
 	send_state_resources(fd);
 }
 
+static void cmd_status_bin(int ci, int fd, struct sm_header *h_recv, int client_maxi, uint32_t cmd)
+{
+	struct sm_header h;
+	struct status_buf sb;
+	struct client *cl;
+	struct space *sp;
+	int ci_iter;
+
+	log_cmd(cmd, "cmd_status_bin %d,%d", ci, fd);
+
+	memset(&sb, 0, sizeof(sb));
+
+	status_daemon(&sb);
+
+	if (h_recv->data == SANLK_STATE_DAEMON)
+		goto send;
+
+	for (ci_iter = 0; ci_iter <= client_maxi; ci_iter++) {
+		cl = &client[ci_iter];
+		if (!cl->used)
+			continue;
+		status_client(&sb, cl, ci_iter);
+	}
+
+	if (h_recv->data == SANLK_STATE_CLIENT)
+		goto send;
+
+	pthread_mutex_lock(&spaces_mutex);
+	list_for_each_entry(sp, &spaces, list)
+		status_lockspace(&sb, sp, SANLK_STATUS_LIST_MAIN);
+	list_for_each_entry(sp, &spaces_add, list)
+		status_lockspace(&sb, sp, SANLK_STATUS_LIST_ADD);
+	list_for_each_entry(sp, &spaces_rem, list)
+		status_lockspace(&sb, sp, SANLK_STATUS_LIST_REM);
+	pthread_mutex_unlock(&spaces_mutex);
+
+	if (h_recv->data == SANLK_STATE_LOCKSPACE)
+		goto send;
+
+	/* iosched.c and resource.c will iterate through their lists
+	   and call back here */
+
+	status_devices(&sb);
+	status_resources(&sb);
+ send:
+	memset(&h, 0, sizeof(h));
+	memcpy(&h, h_recv, sizeof(struct sm_header));
+	h.version = SM_PROTO;
+	h.length = sizeof(h);
+	h.data = 0;
+	h.data2 = SANLK_STATUS_VERSION;
+
+	if (sb.nomem) {
+		log_error("cmd_status_bin no memory");
+		h.data = -ENOMEM;
+		sb.len = 0;
+	}
+
+	send_all(fd, &h, sizeof(h), MSG_NOSIGNAL);
+	if (sb.len)
+		send_all(fd, sb.buf, sb.len, MSG_NOSIGNAL);
+	free(sb.buf);
+}
+
 static void cmd_host_status(int ci, int fd, struct sm_header *h_recv, uint32_t cmd)
 {
 	struct sm_header h;
@@ -2735,8 +3243,11 @@ static void cmd_host_status(int ci, int fd, struct sm_header *h_recv, uint32_t c
 
 	pthread_mutex_lock(&spaces_mutex);
 	sp = find_lockspace(lockspace.name);
-	if (sp)
+	if (sp) {
+		pthread_mutex_lock(&sp->mutex);
 		memcpy(status, &sp->host_status, status_len);
+		pthread_mutex_unlock(&sp->mutex);
+	}
 	pthread_mutex_unlock(&spaces_mutex);
 
 	if (!sp) {
@@ -3090,10 +3601,14 @@ void call_cmd_daemon(int ci, struct sm_header *h_recv, int client_maxi)
 				log_debug("ignore shutdown, lockspace exists");
 			pthread_mutex_unlock(&spaces_mutex);
 		}
+		main_loop_wake();
 		break;
 	case SM_CMD_STATUS:
 		strcpy(client[ci].owner_name, "status");
-		cmd_status(ci, fd, h_recv, client_maxi, cmd);
+		if (h_recv->cmd_flags & SANLK_STATUS_BIN)
+			cmd_status_bin(ci, fd, h_recv, client_maxi, cmd);
+		else
+			cmd_status(ci, fd, h_recv, client_maxi, cmd);
 		break;
 	case SM_CMD_HOST_STATUS:
 		strcpy(client[ci].owner_name, "host_status");
@@ -3110,10 +3625,16 @@ void call_cmd_daemon(int ci, struct sm_header *h_recv, int client_maxi)
 	case SM_CMD_GET_LOCKSPACES:
 		strcpy(client[ci].owner_name, "get_lockspaces");
 		cmd_get_lockspaces(ci, fd, h_recv, cmd);
+		/* keep a persistent connection from libsanlock open */
+		if (h_recv->seq)
+			auto_close = 0;
 		break;
 	case SM_CMD_GET_HOSTS:
 		strcpy(client[ci].owner_name, "get_hosts");
 		cmd_get_hosts(ci, fd, h_recv, cmd);
+		/* keep a persistent connection from libsanlock open */
+		if (h_recv->seq)
+			auto_close = 0;
 		break;
 	case SM_CMD_REG_EVENT:
 		strcpy(client[ci].owner_name, "reg_event");
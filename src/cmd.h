@@ -11,6 +11,7 @@
 
 struct cmd_args {
 	struct list_head list; /* thread_pool data */
+	uint64_t queue_ms;     /* thread_pool stats */
 	int ci_in;
 	int ci_target;
 	int cl_fd;
@@ -91,12 +91,179 @@ static const uint32_t crc32c_table[256] = {
  * crc using table.
  */
 
+/* not exported from the libraries; crc32c_test builds crc32c.c itself */
+#define CRC32C_HIDDEN __attribute__((visibility("hidden")))
+
+CRC32C_HIDDEN uint32_t crc32c_sw(uint32_t crc, uint8_t *data, size_t length);
+CRC32C_HIDDEN uint32_t crc32c_sse42(uint32_t crc, uint8_t *data, size_t length);
+CRC32C_HIDDEN uint32_t crc32c_pclmul(uint32_t crc, uint8_t *data, size_t length);
+CRC32C_HIDDEN int crc32c_hw_level(void);
 uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length);
 
-uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length)
+uint32_t crc32c_sw(uint32_t crc, uint8_t *data, size_t length)
 {
 	while (length--)
 		crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 
 	return crc;
 }
+
+/*
+ * The crc32 instruction in SSE4.2 computes CRC-32C, the same as the table
+ * above (without pre/post inversion), 8 bytes at a time.
+ *
+ * The pclmul version runs the crc32 instruction on three separate blocks
+ * in parallel, which hides the latency of the instruction, and then
+ * combines the three crcs: a crc is moved past the following blocks by
+ * multiplying it by x^(8 * len) mod P, using a carry-less multiply by a
+ * constant and a crc32 of the 64 bit product.
+ *
+ * The implementation used by crc32c() is selected using cpuid on first
+ * use.  crc32c_hw_level() returns which of them the cpu supports (for
+ * tests comparing them.)
+ */
+
+#define CRC32C_LEVEL_SW     0
+#define CRC32C_LEVEL_SSE42  1
+#define CRC32C_LEVEL_PCLMUL 2
+
+#if defined(__x86_64__)
+
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#include <string.h>
+
+/* bytes in each of the three blocks of one pclmul step */
+#define CRC32C_BLOCK 256
+
+/* x^(8 * CRC32C_BLOCK - 33) mod P and x^(8 * 2 * CRC32C_BLOCK - 33) mod P,
+   bit reflected, for moving a crc past one or two blocks */
+#define CRC32C_K1 0xb9e02b86
+#define CRC32C_K2 0xdd7e3b0c
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, uint8_t *data, size_t length)
+{
+	uint64_t crc64 = crc;
+	uint64_t val;
+
+	while (length && ((uintptr_t)data & 7)) {
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+		length--;
+	}
+
+	while (length >= 8) {
+		memcpy(&val, data, 8);
+		crc64 = _mm_crc32_u64(crc64, val);
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+
+	return (uint32_t)crc64;
+}
+
+/* multiply crc by k and reduce: crc * k * x^33 mod P */
+
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t crc32c_clmul(uint32_t crc, uint32_t k)
+{
+	__m128i a = _mm_cvtsi32_si128(crc);
+	__m128i b = _mm_cvtsi32_si128(k);
+
+	return (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(a, b, 0));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_pclmul(uint32_t crc, uint8_t *data, size_t length)
+{
+	uint64_t crc0, crc1, crc2, val0, val1, val2;
+	uint8_t *b0, *b1, *b2;
+	int i;
+
+	while (length >= 3 * CRC32C_BLOCK) {
+		b0 = data;
+		b1 = data + CRC32C_BLOCK;
+		b2 = data + 2 * CRC32C_BLOCK;
+
+		crc0 = crc;
+		crc1 = 0;
+		crc2 = 0;
+
+		for (i = 0; i < CRC32C_BLOCK; i += 8) {
+			memcpy(&val0, b0 + i, 8);
+			memcpy(&val1, b1 + i, 8);
+			memcpy(&val2, b2 + i, 8);
+			crc0 = _mm_crc32_u64(crc0, val0);
+			crc1 = _mm_crc32_u64(crc1, val1);
+			crc2 = _mm_crc32_u64(crc2, val2);
+		}
+
+		val0 = crc32c_clmul((uint32_t)crc0, CRC32C_K2) ^
+		       crc32c_clmul((uint32_t)crc1, CRC32C_K1);
+
+		crc = (uint32_t)_mm_crc32_u64(0, val0) ^ (uint32_t)crc2;
+
+		data += 3 * CRC32C_BLOCK;
+		length -= 3 * CRC32C_BLOCK;
+	}
+
+	return crc32c_sse42(crc, data, length);
+}
+
+int crc32c_hw_level(void)
+{
+	__builtin_cpu_init();
+
+	if (!__builtin_cpu_supports("sse4.2"))
+		return CRC32C_LEVEL_SW;
+	if (!__builtin_cpu_supports("pclmul"))
+		return CRC32C_LEVEL_SSE42;
+	return CRC32C_LEVEL_PCLMUL;
+}
+
+#else
+
+uint32_t crc32c_sse42(uint32_t crc, uint8_t *data, size_t length)
+{
+	return crc32c_sw(crc, data, length);
+}
+
+uint32_t crc32c_pclmul(uint32_t crc, uint8_t *data, size_t length)
+{
+	return crc32c_sw(crc, data, length);
+}
+
+int crc32c_hw_level(void)
+{
+	return CRC32C_LEVEL_SW;
+}
+
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, uint8_t *data, size_t length);
+
+static crc32c_fn crc32c_impl;
+
+uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length)
+{
+	crc32c_fn fn = __atomic_load_n(&crc32c_impl, __ATOMIC_RELAXED);
+
+	if (!fn) {
+		switch (crc32c_hw_level()) {
+		case CRC32C_LEVEL_PCLMUL:
+			fn = crc32c_pclmul;
+			break;
+		case CRC32C_LEVEL_SSE42:
+			fn = crc32c_sse42;
+			break;
+		default:
+			fn = crc32c_sw;
+		}
+		__atomic_store_n(&crc32c_impl, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn(crc, data, length);
+}
@@ -30,6 +30,7 @@
 #include "log.h"
 #include "paxos_lease.h"
 #include "delta_lease.h"
+#include "lockspace.h"
 #include "timeouts.h"
 
 /* Based on "Light-Weight Leases for Storage-Centric Coordination"
@@ -310,6 +311,37 @@ int delta_lease_leader_clobber(struct task *task, int io_timeout,
 	return SANLK_OK;
 }
 
+/*
+ * Wait for delay seconds.  Returns -1 early if the lockspace is being
+ * removed (rem_lockspace wakes the wait) or the daemon is shutting down
+ * (checked each second).
+ */
+
+static int delta_acquire_delay(struct space *sp, int delay)
+{
+	uint64_t end_ms, now_ms;
+	uint32_t gen;
+	int wait_ms;
+
+	end_ms = monotime_ms() + (uint64_t)delay * 1000;
+	gen = host_status_wait(sp->space_id, 0, 0);
+
+	while (1) {
+		if (sp->external_remove || external_shutdown)
+			return -1;
+
+		now_ms = monotime_ms();
+		if (now_ms >= end_ms)
+			return 0;
+
+		wait_ms = end_ms - now_ms;
+		if (wait_ms > 1000)
+			wait_ms = 1000;
+
+		gen = host_status_wait(sp->space_id, gen, wait_ms);
+	}
+}
+
 /*
  * delta_lease_acquire:
  * set the owner of host_id to our_host_name.
@@ -339,7 +371,7 @@ int delta_lease_acquire(struct task *task,
 	uint64_t new_ts;
 	uint32_t checksum;
 	int other_io_timeout, other_host_dead_seconds, other_id_renewal_seconds;
-	int i, error, rv, delay, delta_large_delay;
+	int error, rv, delay, delta_large_delay;
 
 	log_space(sp, "delta_acquire begin %.48s:%llu",
 		  sp->space_name, (unsigned long long)host_id);
@@ -411,13 +443,10 @@ int delta_lease_acquire(struct task *task,
 		/* TODO: we could reread every several seconds to see if
 		   it has changed, so we can abort more quickly if so */
 
-		for (i = 0; i < delay; i++) {
-			if (sp->external_remove || external_shutdown) {
-				log_space(sp, "delta_acquire abort1 remove %d shutdown %d",
-					  sp->external_remove, external_shutdown);
-				return SANLK_ERROR;
-			}
-			sleep(1);
+		if (delta_acquire_delay(sp, delay) < 0) {
+			log_space(sp, "delta_acquire abort1 remove %d shutdown %d",
+				  sp->external_remove, external_shutdown);
+			return SANLK_ERROR;
 		}
 
 		error = delta_lease_leader_read(task, sp->sector_size, sp->io_timeout, disk, space_name, host_id,
@@ -478,13 +507,10 @@ int delta_lease_acquire(struct task *task,
 	delay = 2 * other_io_timeout;
 	log_space(sp, "delta_acquire delta_short_delay %d", delay);
 
-	for (i = 0; i < delay; i++) {
-		if (sp->external_remove || external_shutdown) {
-			log_space(sp, "delta_acquire abort2 remove %d shutdown %d",
-				  sp->external_remove, external_shutdown);
-			return SANLK_ERROR;
-		}
-		sleep(1);
+	if (delta_acquire_delay(sp, delay) < 0) {
+		log_space(sp, "delta_acquire abort2 remove %d shutdown %d",
+			  sp->external_remove, external_shutdown);
+		return SANLK_ERROR;
 	}
 
 	error = delta_lease_leader_read(task, sp->sector_size, sp->io_timeout, disk, space_name, host_id, &leader,
@@ -513,6 +539,68 @@ int delta_lease_acquire(struct task *task,
 	return SANLK_OK;
 }
 
+/*
+ * With renewal_full_scan_sec set, a renewal reads only the leases of
+ * host_ids up to the highest one in use (plus a few extra), and reads
+ * all max_hosts leases every renewal_full_scan_sec to find new hosts.
+ * The tail of task->iobuf beyond the partial read keeps the leases
+ * from the last full read, so a newly allocated iobuf needs a full read.
+ */
+
+static int renew_read_len(struct space *sp, uint64_t host_id, int full)
+{
+	int used;
+
+	if (full || !sp->renewal_full_scan_sec)
+		return sp->align_size;
+
+	if (monotime() - sp->renewal_full_scan_time >= sp->renewal_full_scan_sec)
+		return sp->align_size;
+
+	pthread_mutex_lock(&sp->mutex);
+	used = sp->renewal_used_hosts;
+	pthread_mutex_unlock(&sp->mutex);
+
+	if (used < (int)host_id)
+		used = (int)host_id;
+
+	used += RENEWAL_EXTRA_HOSTS;
+
+	if (used >= sp->max_hosts)
+		return sp->align_size;
+
+	return used * sp->sector_size;
+}
+
+/* find the highest host_id with a lease in use after a full read */
+
+static void renew_full_scan(struct space *sp, char *iobuf)
+{
+	struct leader_record leader_in;
+	struct leader_record *leader_end;
+	int i, used = 0;
+
+	for (i = 0; i < sp->max_hosts; i++) {
+		leader_end = (struct leader_record *)(iobuf + (i * sp->sector_size));
+		leader_record_in(leader_end, &leader_in);
+
+		if (leader_in.magic != DELTA_DISK_MAGIC)
+			continue;
+		if (!leader_in.timestamp)
+			continue;
+		used = i + 1;
+	}
+
+	sp->renewal_full_scan_time = monotime();
+
+	pthread_mutex_lock(&sp->mutex);
+	if (sp->renewal_used_hosts != used)
+		log_space(sp, "delta_renew used hosts %d to %d",
+			  sp->renewal_used_hosts, used);
+	sp->renewal_used_hosts = used;
+	pthread_mutex_unlock(&sp->mutex);
+}
+
 int delta_lease_renew(struct task *task,
 		      struct space *sp,
 		      struct sync_disk *disk,
@@ -535,7 +623,8 @@ int delta_lease_renew(struct task *task,
 	uint32_t checksum;
 	uint32_t reap_timeout_msec;
 	uint64_t host_id, id_offset, new_ts, now;
-	int rv, iobuf_len, sector_size;
+	int rv, iobuf_len, read_len, sector_size;
+	int alloc = 0;
 
 	if (!leader_last) {
 		log_erros(sp, "delta_renew no leader_last");
@@ -591,8 +680,11 @@ int delta_lease_renew(struct task *task,
 
 		clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
 
+		/* the timed out read was sp->renewal_read_len */
+		read_len = sp->renewal_read_len;
+
 		rv = read_iobuf_reap(disk->fd, disk->offset,
-				     task->iobuf, iobuf_len, task, reap_timeout_msec);
+				     task->iobuf, read_len, task, reap_timeout_msec);
 
 		log_space(sp, "delta_renew reap %d", rv);
 
@@ -630,9 +722,8 @@ int delta_lease_renew(struct task *task,
 	}
 
 	/*
-	 * NB. this task->iobuf is also copied by the lockspace thread
-	 * into renewal_read_buf, which is then copied in the main loop
-	 * by check_our_lease and passed to check_other_leases.
+	 * NB. after the renewal, the lockspace thread passes this
+	 * task->iobuf to check_other_leases.
 	 */
 
 	if (!task->iobuf) {
@@ -647,12 +738,18 @@ int delta_lease_renew(struct task *task,
 			log_erros(sp, "dela_renew memalign rv %d", rv);
 			rv = -ENOMEM;
 		}
+		alloc = 1;
 	}
 
+	register_iobuf(task, task->iobuf, iobuf_len);
+
+	read_len = renew_read_len(sp, host_id, alloc);
+	sp->renewal_read_len = read_len;
+
 	if (log_renewal_level != -1)
 		log_level(sp->space_id, 0, NULL, log_renewal_level, "delta_renew begin read");
 
-	rv = read_iobuf(disk->fd, disk->offset, task->iobuf, iobuf_len, task, sp->io_timeout, rd_ms);
+	rv = read_iobuf(disk->fd, disk->offset, task->iobuf, read_len, task, sp->io_timeout, rd_ms);
 	if (rv) {
 		/* the next time delta_lease_renew() is called, prev_result
 		   will be this rv.  If this rv is SANLK_AIO_TIMEOUT, we'll
@@ -669,6 +766,10 @@ int delta_lease_renew(struct task *task,
 
  read_done:
 	*read_result = SANLK_OK;
+
+	if (sp->renewal_full_scan_sec && read_len == iobuf_len)
+		renew_full_scan(sp, task->iobuf);
+
 	memcpy(&leader_end, task->iobuf+id_offset, sizeof(struct leader_record));
 
 	/* N.B. compute checksum before byte swapping */
@@ -59,6 +59,23 @@ int host_info(char *space_name GNUC_UNUSED, uint64_t host_id GNUC_UNUSED, struct
 	return -1;
 }
 
+void host_status_notify(uint32_t space_id GNUC_UNUSED);
+
+void host_status_notify(uint32_t space_id GNUC_UNUSED)
+{
+}
+
+/* no lockspace threads, so just wait */
+
+uint32_t host_status_wait(uint32_t space_id GNUC_UNUSED, uint32_t gen, int wait_ms);
+
+uint32_t host_status_wait(uint32_t space_id GNUC_UNUSED, uint32_t gen, int wait_ms)
+{
+	if (wait_ms > 0)
+		usleep(wait_ms * 1000);
+	return gen;
+}
+
 struct token;
 
 void check_mode_block(struct token *token GNUC_UNUSED, int q GNUC_UNUSED, char *dblock GNUC_UNUSED);
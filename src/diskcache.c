@@ -0,0 +1,399 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sanlock_internal.h"
+#include "diskio.h"
+#include "log.h"
+#include "monotime.h"
+#include "diskcache.h"
+
+/*
+ * Resource leases are read and written with their disks opened for the
+ * duration of each acquire, release, convert or request, so the same few
+ * devices are opened, probed for their sector size and closed again on
+ * every operation.  The daemon instead keeps the opened fds in a cache
+ * keyed by path, along with the sector size.  The fds are shared: each
+ * user takes a ref, and an unused fd stays open until it has been unused
+ * for DISK_CACHE_IDLE_SECONDS, the cache has more than
+ * DISK_CACHE_UNUSED_MAX unused fds, or the lockspace that last used it is
+ * removed, so that an idle device is not kept open.  The lockspace
+ * renewals close the idle fds.
+ *
+ * An fd is dropped from the cache if io through it fails, or if the path
+ * no longer refers to the same device or file when it is looked up.
+ * A dropped fd is closed when its last user is done.
+ */
+
+#define DISK_CACHE_HASH 256
+#define DISK_CACHE_UNUSED_MAX 64
+#define DISK_CACHE_IDLE_SECONDS 30
+
+struct disk_cache_entry {
+	struct list_head list;		/* hash chain, or disk_cache_stale */
+	struct list_head unused;	/* on disk_cache_unused while refs is 0 */
+	char path[SANLK_PATH_LEN];
+	char space_name[NAME_ID_SIZE];
+	dev_t dev;
+	ino_t ino;
+	uint64_t unused_time;		/* monotime when refs became 0 */
+	uint32_t sector_size;
+	int fd;
+	int refs;
+	int stale;
+};
+
+static pthread_mutex_t disk_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head disk_cache_hash[DISK_CACHE_HASH];
+static LIST_HEAD(disk_cache_unused);
+static LIST_HEAD(disk_cache_stale);
+static int disk_cache_init;
+static int disk_cache_entries;
+static int disk_cache_unused_count;
+static uint64_t disk_cache_hits;
+static uint64_t disk_cache_misses;
+static uint64_t disk_cache_dropped;
+
+static struct list_head *path_hash(const char *path)
+{
+	uint32_t h = 5381;
+	int i;
+
+	if (!disk_cache_init) {
+		for (i = 0; i < DISK_CACHE_HASH; i++)
+			INIT_LIST_HEAD(&disk_cache_hash[i]);
+		disk_cache_init = 1;
+	}
+
+	for (i = 0; i < SANLK_PATH_LEN && path[i]; i++)
+		h = h * 33 + (unsigned char)path[i];
+
+	return &disk_cache_hash[h % DISK_CACHE_HASH];
+}
+
+/* the device number for a block device, or the inode for a file */
+
+static void stat_id(struct stat *st, dev_t *dev, ino_t *ino)
+{
+	if (S_ISBLK(st->st_mode)) {
+		*dev = st->st_rdev;
+		*ino = 0;
+	} else {
+		*dev = st->st_dev;
+		*ino = st->st_ino;
+	}
+}
+
+static int disk_error_result(int result)
+{
+	switch (result) {
+	case SANLK_AIO_TIMEOUT:
+	case SANLK_DBLOCK_READ:
+	case SANLK_DBLOCK_WRITE:
+	case SANLK_LEADER_READ:
+	case SANLK_LEADER_WRITE:
+	case SANLK_LEADER_SECTORSIZE:
+	case -EIO:
+	case -ENODEV:
+	case -ENXIO:
+		return 1;
+	}
+	return 0;
+}
+
+/* called with disk_cache_mutex held */
+
+static void free_entry(struct disk_cache_entry *ent)
+{
+	list_del(&ent->list);
+	if (!ent->refs && !ent->stale) {
+		list_del(&ent->unused);
+		disk_cache_unused_count--;
+	}
+	close(ent->fd);
+	disk_cache_entries--;
+	free(ent);
+}
+
+/* called with disk_cache_mutex held */
+
+static void drop_entry(struct disk_cache_entry *ent, const char *reason)
+{
+	log_debug("disk cache drop fd %d %s %s", ent->fd, reason, ent->path);
+
+	disk_cache_dropped++;
+
+	if (!ent->refs) {
+		free_entry(ent);
+		return;
+	}
+
+	ent->stale = 1;
+	list_move(&ent->list, &disk_cache_stale);
+}
+
+static int open_disk_cache(struct sync_disk *disk, const char *space_name, int set_size)
+{
+	struct disk_cache_entry *ent, *safe;
+	struct list_head *head;
+	struct sync_disk tmp;
+	struct stat st;
+	dev_t dev;
+	ino_t ino;
+	int rv;
+
+	/* open_disk reports the error */
+	if (stat(disk->path, &st) < 0)
+		goto open;
+	stat_id(&st, &dev, &ino);
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	head = path_hash(disk->path);
+
+	list_for_each_entry_safe(ent, safe, head, list) {
+		if (strncmp(ent->path, disk->path, SANLK_PATH_LEN))
+			continue;
+
+		if (ent->dev != dev || ent->ino != ino) {
+			drop_entry(ent, "changed");
+			continue;
+		}
+
+		if (!ent->refs) {
+			list_del(&ent->unused);
+			disk_cache_unused_count--;
+		}
+		ent->refs++;
+		memcpy(ent->space_name, space_name, NAME_ID_SIZE);
+		disk_cache_hits++;
+
+		disk->fd = ent->fd;
+		if (set_size)
+			disk->sector_size = ent->sector_size;
+		pthread_mutex_unlock(&disk_cache_mutex);
+		return 0;
+	}
+	disk_cache_misses++;
+	pthread_mutex_unlock(&disk_cache_mutex);
+ open:
+	memcpy(&tmp, disk, sizeof(struct sync_disk));
+	tmp.fd = -1;
+
+	rv = open_disk(&tmp);
+	if (rv < 0)
+		return rv;
+
+	if (fstat(tmp.fd, &st) < 0)
+		goto nocache;
+	stat_id(&st, &dev, &ino);
+
+	ent = malloc(sizeof(struct disk_cache_entry));
+	if (!ent)
+		goto nocache;
+	memset(ent, 0, sizeof(struct disk_cache_entry));
+	memcpy(ent->path, disk->path, SANLK_PATH_LEN);
+	memcpy(ent->space_name, space_name, NAME_ID_SIZE);
+	ent->dev = dev;
+	ent->ino = ino;
+	ent->sector_size = tmp.sector_size;
+	ent->fd = tmp.fd;
+	ent->refs = 1;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	list_add(&ent->list, path_hash(disk->path));
+	disk_cache_entries++;
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+ nocache:
+	/* an fd not found in the cache is closed by close_disks_cache */
+	disk->fd = tmp.fd;
+	if (set_size)
+		disk->sector_size = tmp.sector_size;
+	return 0;
+}
+
+static void close_disk_cache(struct sync_disk *disk, int result)
+{
+	struct disk_cache_entry *ent;
+	struct list_head *head;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	head = path_hash(disk->path);
+
+	list_for_each_entry(ent, head, list) {
+		if (ent->fd == disk->fd)
+			goto found;
+	}
+	list_for_each_entry(ent, &disk_cache_stale, list) {
+		if (ent->fd == disk->fd)
+			goto found;
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	close(disk->fd);
+	disk->fd = -1;
+	return;
+
+ found:
+	disk->fd = -1;
+
+	if (!ent->stale && disk_error_result(result))
+		drop_entry(ent, "error");
+
+	if (--ent->refs)
+		goto out;
+
+	if (ent->stale) {
+		free_entry(ent);
+		goto out;
+	}
+
+	ent->unused_time = monotime();
+	list_add_tail(&ent->unused, &disk_cache_unused);
+	disk_cache_unused_count++;
+
+	if (disk_cache_unused_count > DISK_CACHE_UNUSED_MAX) {
+		ent = list_first_entry(&disk_cache_unused, struct disk_cache_entry, unused);
+		free_entry(ent);
+	}
+ out:
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+void close_disks_cache(struct sync_disk *disks, int num_disks, int result)
+{
+	int d;
+
+	for (d = 0; d < num_disks; d++) {
+		if (disks[d].fd == -1)
+			continue;
+		close_disk_cache(&disks[d], result);
+	}
+}
+
+/* same as open_disks and open_disks_fd in diskio.c */
+
+static int open_disks_cache_size(struct sync_disk *disks, int num_disks,
+				 const char *space_name, int set_size)
+{
+	struct sync_disk *disk;
+	int num_opens = 0;
+	int d, err, rv = -1;
+	uint32_t ss = 0;
+
+	for (d = 0; d < num_disks; d++) {
+		disk = &disks[d];
+
+		if (disk->fd != -1) {
+			log_error("open fd %d exists %s", disk->fd, disk->path);
+			rv = set_size ? -ENOTEMPTY : -1;
+			goto fail;
+		}
+
+		err = open_disk_cache(disk, space_name, set_size);
+		if (err < 0) {
+			rv = err;
+			continue;
+		}
+
+		if (set_size) {
+			if (!ss) {
+				ss = disk->sector_size;
+			} else if (ss != disk->sector_size) {
+				log_error("inconsistent sector sizes %u %u %s",
+					  ss, disk->sector_size, disk->path);
+			}
+		}
+
+		num_opens++;
+	}
+
+	if (!majority_disks(num_disks, num_opens)) {
+		/* rv is from open err */
+		goto fail;
+	}
+
+	return 0;
+
+ fail:
+	close_disks_cache(disks, num_disks, 0);
+	return rv;
+}
+
+int open_disks_cache(struct sync_disk *disks, int num_disks, const char *space_name)
+{
+	return open_disks_cache_size(disks, num_disks, space_name, 1);
+}
+
+int open_disks_fd_cache(struct sync_disk *disks, int num_disks, const char *space_name)
+{
+	return open_disks_cache_size(disks, num_disks, space_name, 0);
+}
+
+void disk_cache_purge(const char *space_name)
+{
+	struct disk_cache_entry *ent, *safe;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	list_for_each_entry_safe(ent, safe, &disk_cache_unused, unused) {
+		if (strncmp(ent->space_name, space_name, NAME_ID_SIZE))
+			continue;
+		free_entry(ent);
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+/* disk_cache_unused is in the order the fds became unused */
+
+void disk_cache_expire(void)
+{
+	struct disk_cache_entry *ent, *safe;
+	uint64_t now = monotime();
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	list_for_each_entry_safe(ent, safe, &disk_cache_unused, unused) {
+		if (now - ent->unused_time < DISK_CACHE_IDLE_SECONDS)
+			break;
+		log_debug("disk cache idle fd %d %s", ent->fd, ent->path);
+		free_entry(ent);
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+int print_state_disk_cache(char *str, int len)
+{
+	int rv;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	rv = snprintf(str, len,
+		      " disk_cache_fds=%d"
+		      " disk_cache_unused=%d"
+		      " disk_cache_hits=%llu"
+		      " disk_cache_misses=%llu"
+		      " disk_cache_dropped=%llu",
+		      disk_cache_entries,
+		      disk_cache_unused_count,
+		      (unsigned long long)disk_cache_hits,
+		      (unsigned long long)disk_cache_misses,
+		      (unsigned long long)disk_cache_dropped);
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	return rv < len ? rv : len;
+}
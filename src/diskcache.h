@@ -0,0 +1,27 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+/* same as open_disks and open_disks_fd, using cached fds */
+int open_disks_cache(struct sync_disk *disks, int num_disks, const char *space_name);
+int open_disks_fd_cache(struct sync_disk *disks, int num_disks, const char *space_name);
+
+/* result of the io done with the disks, io errors drop the cached fds */
+void close_disks_cache(struct sync_disk *disks, int num_disks, int result);
+
+/* close unused fds last used for the lockspace */
+void disk_cache_purge(const char *space_name);
+
+/* close fds that have been unused for a while */
+void disk_cache_expire(void);
+
+int print_state_disk_cache(char *str, int len);
+
+#endif
@@ -31,6 +31,7 @@
 #include "diskio.h"
 #include "direct.h"
 #include "log.h"
+#include "uring.h"
 
 int read_sysfs_uint(char *path, unsigned int *val)
 {
@@ -372,6 +373,52 @@ int open_disks(struct sync_disk *disks, int num_disks)
 	return rv;
 }
 
+/*
+ * With io_uring, add the fds of long-lived disks to the task's fixed file
+ * table so io on them skips the fd lookup.  unregister_disks must be called
+ * before the disks are closed.
+ */
+
+void register_disks(struct task *task, struct sync_disk *disks, int num_disks)
+{
+	int d, rv;
+
+	if (!task || !task->uring)
+		return;
+
+	for (d = 0; d < num_disks; d++) {
+		if (disks[d].fd == -1)
+			continue;
+
+		rv = uring_register_fd(task->uring, disks[d].fd);
+		if (rv < 0)
+			log_taskd(task, "uring register fd %d rv %d %s",
+				  disks[d].fd, rv, disks[d].path);
+	}
+}
+
+void unregister_disks(struct task *task, struct sync_disk *disks, int num_disks)
+{
+	int d;
+
+	if (!task || !task->uring)
+		return;
+
+	for (d = 0; d < num_disks; d++)
+		uring_unregister_fd(task->uring, disks[d].fd);
+}
+
+/* With io_uring, io to a registered iobuf doesn't map its pages each time.
+   A new iobuf can't replace the registered one while io on it is pending. */
+
+void register_iobuf(struct task *task, char *iobuf, int iobuf_len)
+{
+	if (!task || !task->uring || !iobuf)
+		return;
+
+	uring_register_buf(task->uring, iobuf, iobuf_len);
+}
+
 static int do_write(int fd, uint64_t offset, const char *buf, int len, struct task *task, int *wr_ms)
 {
 	off_t ret;
@@ -813,12 +860,66 @@ static int do_read_aio_linux(int fd, uint64_t offset, char *buf, int len,
 	return do_linux_aio(fd, offset, buf, len, task, ioto, IO_CMD_PREAD, rd_ms);
 }
 
+/*
+ * A single io through the io_uring engine, with the same results as
+ * do_linux_aio: SANLK_AIO_TIMEOUT means the io could not be canceled
+ * and the buf is freed when the io completes.  A timed out io that is
+ * canceled returns -ECANCELED and the buf belongs to the caller.
+ */
+
+static int do_uring_io(int fd, uint64_t offset, char *buf, int len,
+		       struct task *task, int ioto, int cmd, int *ms)
+{
+	struct iobuf_req req;
+	struct iobuf_req *reqs[1];
+	struct timespec begin, end, diff;
+	struct aicb *aicb;
+	int rv;
+
+	memset(&req, 0, sizeof(req));
+	req.fd = fd;
+	req.cmd = cmd;
+	req.len = len;
+	req.buf = buf;
+	req.offset = offset;
+	reqs[0] = &req;
+
+	if (ms)
+		clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+
+	submit_iobuf(task, &req, ioto);
+
+	aicb = req.aicb;
+
+	while (reap_iobufs(task, reqs, 1))
+		;
+
+	rv = req.rv;
+
+	if (ms) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+		ts_diff(&begin, &end, &diff);
+		*ms = (diff.tv_sec * 1000) + (diff.tv_nsec / 1000000);
+	}
+
+	if (!rv && com.debug_io_complete)
+		log_taskd(task, "%s %d at %llu done", cmd == IO_CMD_PREAD ? "RD" : "WR",
+			  len, (unsigned long long)offset);
+
+	if (rv == SANLK_AIO_TIMEOUT && cmd == IO_CMD_PREAD)
+		task->read_iobuf_timeout_aicb = aicb;
+
+	return rv;
+}
+
 /* write aligned io buffer */
 
 int write_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 		struct task *task, int ioto, int *wr_ms)
 {
-	if (task && task->use_aio)
+	if (task && task->uring)
+		return do_uring_io(fd, offset, iobuf, iobuf_len, task, ioto, IO_CMD_PWRITE, wr_ms);
+	else if (task && task->use_aio)
 		return do_write_aio_linux(fd, offset, iobuf, iobuf_len, task, ioto, wr_ms);
 	else
 		return do_write(fd, offset, iobuf, iobuf_len, task, wr_ms);
@@ -912,12 +1013,88 @@ int write_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector
 			      iobuf_len, task, ioto, blktype);
 }
 
+/*
+ * write the same sector to each of the disks, with the writes to all disks
+ * in flight together.  results[d] is the result of the write to disks[d].
+ * Returns the number of disks written successfully.
+ */
+
+int write_sector_disks(const struct sync_disk *disks, int num_disks,
+		       int sector_size, uint64_t sector_nr,
+		       const char *data, int data_len,
+		       struct task *task, int ioto,
+		       const char *blktype, int *results)
+{
+	struct iobuf_req req[SANLK_MAX_DISKS];
+	struct iobuf_req *reqs[SANLK_MAX_DISKS];
+	int num_writes = 0;
+	int d, n = 0;
+
+	if ((sector_size != 4096) && (sector_size != 512)) {
+		log_error("write_sector_disks bad sector_size %d", sector_size);
+		return 0;
+	}
+
+	if ((num_disks > SANLK_MAX_DISKS) || (data_len > sector_size)) {
+		log_error("write_sector_disks %s num_disks %d data_len %d",
+			  blktype, num_disks, data_len);
+		return 0;
+	}
+
+	memset(req, 0, sizeof(req));
+
+	for (d = 0; d < num_disks; d++) {
+		results[d] = 0;
+
+		if (posix_memalign((void *)&req[d].buf, getpagesize(), sector_size)) {
+			req[d].buf = NULL;
+			results[d] = -ENOMEM;
+			continue;
+		}
+
+		memset(req[d].buf, 0, sector_size);
+		memcpy(req[d].buf, data, data_len);
+
+		req[d].fd = disks[d].fd;
+		req[d].cmd = IO_CMD_PWRITE;
+		req[d].len = sector_size;
+		req[d].offset = disks[d].offset + (sector_nr * sector_size);
+		reqs[n++] = &req[d];
+	}
+
+	submit_iobufs(task, reqs, n, ioto);
+
+	while (reap_iobufs(task, reqs, n))
+		;
+
+	for (d = 0; d < num_disks; d++) {
+		if (!req[d].buf)
+			continue;
+
+		results[d] = req[d].rv;
+
+		if (req[d].rv < 0)
+			log_error("write_sector_disks %s offset %llu rv %d %s",
+				  blktype, (unsigned long long)req[d].offset,
+				  req[d].rv, disks[d].path);
+		else
+			num_writes++;
+
+		if (req[d].rv != SANLK_AIO_TIMEOUT)
+			free(req[d].buf);
+	}
+
+	return num_writes;
+}
+
 /* read aligned io buffer */
 
 int read_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	       struct task *task, int ioto, int *rd_ms)
 {
-	if (task && task->use_aio)
+	if (task && task->uring)
+		return do_uring_io(fd, offset, iobuf, iobuf_len, task, ioto, IO_CMD_PREAD, rd_ms);
+	else if (task && task->use_aio)
 		return do_read_aio_linux(fd, offset, iobuf, iobuf_len, task, ioto, rd_ms);
 	else
 		return do_read(fd, offset, iobuf, iobuf_len, task, rd_ms);
@@ -973,6 +1150,8 @@ int read_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_
 	return rv;
 }
 
+static int read_iobuf_reap_uring(struct task *task, struct aicb *aicb, uint32_t ioto_msec);
+
 /* Try to reap the event of a previously timed out read_iobuf.
    The aicb used in a task's last timed out read_iobuf is
    task->read_iobuf_timeout_aicb . */
@@ -1002,6 +1181,9 @@ int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	if (iocb->aio_lio_opcode != IO_CMD_PREAD)
 		return -EINVAL;
 
+	if (task->uring)
+		return read_iobuf_reap_uring(task, aicb, ioto_msec);
+
 	memset(&ts, 0, sizeof(struct timespec));
 	ts.tv_sec = ioto_msec / 1000;
 	ts.tv_nsec = (ioto_msec % 1000) * 1000000;
@@ -1064,3 +1246,431 @@ int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	return rv;
 }
 
+
+/*
+ * submit_iobufs/reap_iobufs let a task have io outstanding to several disks
+ * at once, e.g. the replicas of a paxos lease, instead of waiting for each
+ * io to complete before starting the next.  A set of requests is submitted
+ * with one io_submit, completions are collected in batches, and each request
+ * has its own deadline.  When a request times out and cannot be canceled, it is treated
+ * like a do_linux_aio timeout: the buf becomes owned by the aicb and is freed
+ * when the event is eventually reaped, so the caller must not free it.
+ * Without aio, submit_iobufs does the io synchronously and the requests are
+ * done when it returns.
+ */
+
+static uint64_t iobuf_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static const char *iobuf_op_str(int cmd)
+{
+	if (cmd == IO_CMD_PREAD)
+		return "RD";
+	if (cmd == IO_CMD_PWRITE)
+		return "WR";
+	return "UK";
+}
+
+/* an event was reaped; complete the request it belongs to, or free
+   the buf of an io that was previously given up on */
+
+static void collect_iobuf_event(struct task *task, struct io_event *event)
+{
+	struct iocb *ev_iocb = event->obj;
+	struct aicb *ev_aicb = container_of(ev_iocb, struct aicb, iocb);
+	struct iobuf_req *req = ev_aicb->req;
+
+	ev_aicb->used = 0;
+
+	if (!req) {
+		log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld other free",
+			  iobuf_op_str(ev_iocb->aio_lio_opcode),
+			  ev_aicb, ev_iocb, ev_aicb->buf, event->res, event->res2);
+		if (task->uring)
+			uring_unregister_buf(task->uring, ev_aicb->buf);
+		free(ev_aicb->buf);
+		ev_aicb->buf = NULL;
+		return;
+	}
+
+	ev_aicb->req = NULL;
+	ev_aicb->buf = NULL;
+	req->aicb = NULL;
+	req->state = IOBUF_DONE;
+
+	if ((int)event->res < 0) {
+		log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld match res",
+			  iobuf_op_str(req->cmd), ev_aicb, ev_iocb, req->buf, event->res, event->res2);
+		req->rv = event->res;
+	} else if (event->res != req->len) {
+		log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld match len %d",
+			  iobuf_op_str(req->cmd), ev_aicb, ev_iocb, req->buf, event->res, event->res2, req->len);
+		req->rv = -EMSGSIZE;
+	} else {
+		req->rv = 0;
+	}
+}
+
+/* wait up to wait_ms for at least one event, and collect all the events
+   that are ready; returns the number of events collected */
+
+static int get_iobuf_events(struct task *task, uint64_t wait_ms)
+{
+	struct timespec ts;
+	struct io_event events[IOBUF_EVENTS_MAX];
+	int nr = task->cb_size < IOBUF_EVENTS_MAX ? task->cb_size : IOBUF_EVENTS_MAX;
+	int rv, i;
+
+	memset(&ts, 0, sizeof(struct timespec));
+	ts.tv_sec = wait_ms / 1000;
+	ts.tv_nsec = (wait_ms % 1000) * 1000000;
+ retry:
+	memset(events, 0, sizeof(events));
+
+	if (task->uring)
+		rv = uring_getevents(task->uring, events, nr, wait_ms);
+	else
+		rv = io_getevents(task->aio_ctx, 1, nr, events, &ts);
+	if (rv == -EINTR)
+		goto retry;
+	if (rv < 0) {
+		log_taske(task, "aio getevents rv %d", rv);
+		return rv;
+	}
+
+	for (i = 0; i < rv; i++)
+		collect_iobuf_event(task, &events[i]);
+
+	return rv;
+}
+
+static void submit_iobuf_sync(struct task *task, struct iobuf_req *req)
+{
+	if (req->cmd == IO_CMD_PWRITE)
+		req->rv = do_write(req->fd, req->offset, req->buf, req->len, task, NULL);
+	else
+		req->rv = do_read(req->fd, req->offset, req->buf, req->len, task, NULL);
+	req->aicb = NULL;
+	req->state = IOBUF_DONE;
+}
+
+static struct aicb *get_free_aicb(struct task *task)
+{
+	int i;
+
+	for (i = 0; i < task->cb_size; i++) {
+		if (!task->callbacks[i].used)
+			return &task->callbacks[i];
+	}
+	return NULL;
+}
+
+/*
+ * Submit count requests, using a single io_submit for as many as the task
+ * has free callback slots.  Each request times out after its own req->ioto
+ * seconds, or the ioto arg if req->ioto is zero.  A request that cannot be
+ * submitted is returned as done with the error in req->rv.  Returns the
+ * number of requests submitted.
+ */
+
+int submit_iobufs(struct task *task, struct iobuf_req **reqs, int count, int ioto)
+{
+	struct iocb *iocbs[IOBUF_EVENTS_MAX];
+	struct iobuf_req *req;
+	struct aicb *aicb;
+	struct iocb *iocb;
+	uint64_t now, deadline_ms = 0;
+	int req_ioto, num = 0;
+	int rv, i, j, c;
+
+	if (!task || !task->use_aio) {
+		for (i = 0; i < count; i++)
+			submit_iobuf_sync(task, reqs[i]);
+		return count;
+	}
+
+	now = iobuf_now_ms();
+
+	for (i = 0; i < count; i++) {
+		req = reqs[i];
+		req->aicb = NULL;
+		req->rv = 0;
+		req->state = IOBUF_IDLE;
+
+		req_ioto = req->ioto ? req->ioto : ioto;
+		if (!req_ioto) {
+			log_taske(task, "aio %d zero io timeout", req->cmd);
+			req->rv = -EINVAL;
+			req->state = IOBUF_DONE;
+			continue;
+		}
+
+		req->deadline_ms = now + (req_ioto * 1000);
+		if (!deadline_ms || req->deadline_ms < deadline_ms)
+			deadline_ms = req->deadline_ms;
+	}
+
+	i = 0;
+
+	while (i < count) {
+		c = 0;
+
+		for (; i < count && c < IOBUF_EVENTS_MAX; i++) {
+			req = reqs[i];
+			if (req->state == IOBUF_DONE)
+				continue;
+
+			aicb = get_free_aicb(task);
+			if (!aicb)
+				break;
+
+			iocb = &aicb->iocb;
+
+			memset(iocb, 0, sizeof(struct iocb));
+			iocb->aio_fildes = req->fd;
+			iocb->aio_lio_opcode = req->cmd;
+			iocb->u.c.buf = req->buf;
+			iocb->u.c.nbytes = req->len;
+			iocb->u.c.offset = req->offset;
+
+			if (com.debug_io_submit)
+				log_taskd(task, "%s %d at %llu submit", iobuf_op_str(req->cmd),
+					  req->len, (unsigned long long)req->offset);
+
+			if (task->uring && uring_prep_iocb(task->uring, iocb) < 0)
+				break;
+
+			/* don't reuse aicb->iocb or free the buf until we reap the event */
+			aicb->used = 1;
+			aicb->buf = req->buf;
+			aicb->req = req;
+			req->aicb = aicb;
+			req->state = IOBUF_PENDING;
+			iocbs[c++] = iocb;
+		}
+
+		if (c) {
+			if (task->uring)
+				rv = uring_submit(task->uring);
+			else
+				rv = io_submit(task->aio_ctx, c, iocbs);
+			if (rv < 0) {
+				log_taske(task, "aio submit %d rv %d", c, rv);
+			} else {
+				task->io_count += rv;
+				num += rv;
+			}
+
+			/* release the slots of any that were not submitted */
+			for (j = (rv < 0) ? 0 : rv; j < c; j++) {
+				aicb = container_of(iocbs[j], struct aicb, iocb);
+				req = aicb->req;
+				aicb->used = 0;
+				aicb->buf = NULL;
+				aicb->req = NULL;
+				req->aicb = NULL;
+				req->rv = (rv < 0) ? rv : -EAGAIN;
+				req->state = IOBUF_DONE;
+			}
+			continue;
+		}
+
+		/* all callback slots are held by the task's other ios,
+		   wait for some of them to complete */
+
+		now = iobuf_now_ms();
+		if (now >= deadline_ms)
+			rv = -ENOENT;
+		else
+			rv = get_iobuf_events(task, deadline_ms - now);
+		if (rv < 0) {
+			for (; i < count; i++) {
+				req = reqs[i];
+				if (req->state != IOBUF_IDLE)
+					continue;
+				req->rv = rv;
+				req->state = IOBUF_DONE;
+			}
+		}
+	}
+
+	return num;
+}
+
+int submit_iobuf(struct task *task, struct iobuf_req *req, int ioto)
+{
+	submit_iobufs(task, &req, 1, ioto);
+
+	return (req->state == IOBUF_DONE) ? req->rv : 0;
+}
+
+/*
+ * Give up on a pending request: the io remains in flight, and its buf is
+ * freed when the event is reaped.  The caller must not use or free buf.
+ */
+
+void abandon_iobuf(struct task *task, struct iobuf_req *req)
+{
+	struct io_event event;
+	struct aicb *aicb = req->aicb;
+
+	if (req->state != IOBUF_PENDING)
+		return;
+
+	if (task->uring) {
+		/* an io that can be canceled completes (with -ECANCELED) by the
+		   time uring_cancel returns, giving the buf back to the caller */
+		if (!uring_cancel(task->uring, &aicb->iocb))
+			get_iobuf_events(task, 0);
+		if (req->state == IOBUF_DONE)
+			return;
+		req->rv = SANLK_AIO_TIMEOUT;
+		goto out;
+	}
+
+	if (!io_cancel(task->aio_ctx, &aicb->iocb, &event)) {
+		/* the buf is still the caller's to free */
+		aicb->used = 0;
+		aicb->buf = NULL;
+		req->rv = -ECANCELED;
+	} else {
+		req->rv = SANLK_AIO_TIMEOUT;
+	}
+ out:
+	aicb->req = NULL;
+	req->aicb = NULL;
+	req->state = IOBUF_DONE;
+}
+
+/*
+ * Wait until at least one of the pending requests completes or reaches its
+ * deadline.  A request that times out is abandoned with rv SANLK_AIO_TIMEOUT
+ * (or -ECANCELED if it could be canceled).  Returns the number of requests
+ * still pending.
+ */
+
+int reap_iobufs(struct task *task, struct iobuf_req **reqs, int count)
+{
+	struct iobuf_req *req;
+	uint64_t now, next_ms;
+	int pending, expired, i, rv = 0;
+
+	while (1) {
+		pending = 0;
+		next_ms = 0;
+
+		for (i = 0; i < count; i++) {
+			req = reqs[i];
+			if (!req || req->state != IOBUF_PENDING)
+				continue;
+			if (!next_ms || req->deadline_ms < next_ms)
+				next_ms = req->deadline_ms;
+			pending++;
+		}
+
+		if (!pending)
+			return 0;
+
+		now = iobuf_now_ms();
+
+		if (now < next_ms) {
+			rv = get_iobuf_events(task, next_ms - now);
+			if (rv < 0)
+				break;
+			if (!rv)
+				continue;
+
+			/* the event may have been for an old abandoned io */
+			for (i = 0; i < count; i++) {
+				if (reqs[i] && reqs[i]->state == IOBUF_DONE)
+					goto out;
+			}
+			continue;
+		}
+
+		/* one or more requests have timed out */
+
+		expired = 0;
+
+		for (i = 0; i < count; i++) {
+			req = reqs[i];
+			if (!req || req->state != IOBUF_PENDING)
+				continue;
+			if (req->deadline_ms > now)
+				continue;
+
+			task->to_count++;
+
+			log_taskw(task, "aio timeout %s %p:%p:%p to_count %d",
+				  iobuf_op_str(req->cmd), req->aicb, &req->aicb->iocb,
+				  req->buf, task->to_count);
+
+			abandon_iobuf(task, req);
+			expired++;
+		}
+
+		if (expired)
+			break;
+	}
+
+	/* getevents failed, nothing more can be collected */
+	if (rv < 0) {
+		for (i = 0; i < count; i++) {
+			if (reqs[i])
+				abandon_iobuf(task, reqs[i]);
+		}
+	}
+ out:
+	pending = 0;
+	for (i = 0; i < count; i++) {
+		if (reqs[i] && reqs[i]->state == IOBUF_PENDING)
+			pending++;
+	}
+	return pending;
+}
+
+/* Give the buf of a timed out read back to the caller (instead of freeing
+   it) if the read completes within ioto_msec. */
+
+static int read_iobuf_reap_uring(struct task *task, struct aicb *aicb, uint32_t ioto_msec)
+{
+	struct iobuf_req req;
+	uint64_t now, end;
+	int rv;
+
+	memset(&req, 0, sizeof(req));
+	req.fd = aicb->iocb.aio_fildes;
+	req.cmd = IO_CMD_PREAD;
+	req.len = aicb->iocb.u.c.nbytes;
+	req.buf = aicb->buf;
+	req.offset = aicb->iocb.u.c.offset;
+	req.state = IOBUF_PENDING;
+	req.aicb = aicb;
+	aicb->req = &req;
+
+	end = iobuf_now_ms() + ioto_msec;
+
+	while (req.state == IOBUF_PENDING) {
+		now = iobuf_now_ms();
+		if (now >= end)
+			break;
+
+		rv = get_iobuf_events(task, end - now);
+		if (rv < 0)
+			break;
+	}
+
+	if (req.state == IOBUF_PENDING) {
+		/* timed out again */
+		aicb->req = NULL;
+		return SANLK_AIO_TIMEOUT;
+	}
+
+	return req.rv;
+}
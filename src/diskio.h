@@ -16,6 +16,9 @@ int open_disk(struct sync_disk *disks);
 int open_disks(struct sync_disk *disks, int num_disks);
 int open_disks_fd(struct sync_disk *disks, int num_disks);
 int majority_disks(int num_disks, int num);
+void register_disks(struct task *task, struct sync_disk *disks, int num_disks);
+void unregister_disks(struct task *task, struct sync_disk *disks, int num_disks);
+void register_iobuf(struct task *task, char *iobuf, int iobuf_len);
 
 int read_sysfs_size(const char *path, const char *name, unsigned int *val);
 int set_max_sectors_kb(struct sync_disk *disk, uint32_t max_sectors_kb);
@@ -37,6 +40,21 @@ int read_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 		    struct task *task, uint32_t ioto_msec);
 
+/*
+ * submit_iobufs starts a set of ios described by iobuf_reqs, in any mix of
+ * fds, offsets, reads and writes, with one io_submit and without waiting for
+ * them, reap_iobufs waits for one or more of them to complete or time out,
+ * abandon_iobuf gives up on one that is still pending.
+ */
+
+int submit_iobufs(struct task *task, struct iobuf_req **reqs, int count, int ioto);
+
+int submit_iobuf(struct task *task, struct iobuf_req *req, int ioto);
+
+int reap_iobufs(struct task *task, struct iobuf_req **reqs, int count);
+
+void abandon_iobuf(struct task *task, struct iobuf_req *req);
+
 /*
  * sector functions allocate an iobuf themselves, copy into it for read, use it
  * for io, copy out of it for write, and free it
@@ -52,6 +70,12 @@ int write_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector
 		  struct task *task, int ioto,
 		  const char *blktype);
 
+int write_sector_disks(const struct sync_disk *disks, int num_disks,
+		       int sector_size, uint64_t sector_nr,
+		       const char *data, int data_len,
+		       struct task *task, int ioto,
+		       const char *blktype, int *results);
+
 int read_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_nr,
 	 	 uint32_t sector_count, char *data, int data_len,
 		 struct task *task, int ioto,
@@ -34,6 +34,7 @@
 /* only need sysfs functions */
 struct sync_disk;
 struct task;
+struct iobuf_req;
 #include "diskio.h"
 
 #define MAX_AV_COUNT 8
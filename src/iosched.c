@@ -0,0 +1,205 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "sanlock_internal.h"
+#include "log.h"
+#include "iosched.h"
+
+/*
+ * Each lockspace renews its delta lease on its own schedule, so
+ * lockspaces that are added together on one device all read and write
+ * the device at the same moment every renewal interval.  The renewal
+ * of each lockspace is timed from its previous renewal, so spacing out
+ * their start times once keeps them spread out: each renewal waits
+ * until id_renewal_seconds/N after the previous renewal started on the
+ * same device, where N is the number of lockspaces on the device.  A
+ * renewal is never delayed by more than io_timeout seconds, which is
+ * small compared to id_renewal_fail_seconds.
+ */
+
+static pthread_mutex_t io_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(io_devices);
+
+void send_state_device(int fd, struct io_device *dev);
+void status_device(struct status_buf *sb, struct io_device *dev);
+
+void iosched_add(struct space *sp)
+{
+	struct io_device *dev;
+	struct stat st;
+	uint64_t devno;
+
+	if (sp->host_id_disk.fd < 0)
+		return;
+
+	if (fstat(sp->host_id_disk.fd, &st) < 0) {
+		log_erros(sp, "iosched fstat error %d %s", errno, sp->host_id_disk.path);
+		return;
+	}
+
+	if (S_ISBLK(st.st_mode))
+		devno = st.st_rdev;
+	else
+		devno = st.st_dev;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	list_for_each_entry(dev, &io_devices, list) {
+		if (dev->dev == devno)
+			goto found;
+	}
+
+	dev = malloc(sizeof(struct io_device));
+	if (!dev) {
+		pthread_mutex_unlock(&io_devices_mutex);
+		return;
+	}
+	memset(dev, 0, sizeof(struct io_device));
+	dev->dev = devno;
+	memcpy(dev->path, sp->host_id_disk.path, SANLK_PATH_LEN);
+	list_add_tail(&dev->list, &io_devices);
+ found:
+	dev->spaces++;
+	sp->io_device = dev;
+
+	log_space(sp, "iosched device %u:%u lockspaces %d",
+		  major(devno), minor(devno), dev->spaces);
+	pthread_mutex_unlock(&io_devices_mutex);
+}
+
+void iosched_remove(struct space *sp)
+{
+	struct io_device *dev = sp->io_device;
+
+	if (!dev)
+		return;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	sp->io_device = NULL;
+	if (!--dev->spaces) {
+		list_del(&dev->list);
+		free(dev);
+	}
+	pthread_mutex_unlock(&io_devices_mutex);
+}
+
+/*
+ * Called for a lockspace when its renewal is due, returns the time the
+ * renewal should start.  A retry after a failed renewal is not delayed.
+ */
+
+uint64_t iosched_renew_start(struct space *sp, int id_renewal_seconds, int retry)
+{
+	struct io_device *dev = sp->io_device;
+	uint64_t now, start, gap;
+
+	now = monotime_ms();
+
+	if (!dev)
+		return now;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	start = now;
+
+	if (!retry && dev->spaces > 1 && id_renewal_seconds > 0) {
+		gap = (id_renewal_seconds * 1000) / dev->spaces;
+
+		if (dev->next_start_ms > now &&
+		    dev->next_start_ms - now <= sp->io_timeout * 1000)
+			start = dev->next_start_ms;
+
+		dev->next_start_ms = start + gap;
+	}
+
+	if (start > now) {
+		dev->delayed++;
+		dev->delay_ms += start - now;
+	}
+	pthread_mutex_unlock(&io_devices_mutex);
+
+	return start;
+}
+
+/* called at the start time returned by iosched_renew_start */
+
+void iosched_renew_begin(struct space *sp)
+{
+	struct io_device *dev = sp->io_device;
+
+	if (!dev)
+		return;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	dev->renewals++;
+	dev->depth++;
+	if (dev->depth > dev->max_depth)
+		dev->max_depth = dev->depth;
+	pthread_mutex_unlock(&io_devices_mutex);
+}
+
+/* rd_ms and wr_ms are -1 if the renewal did not get to the read or write */
+
+void iosched_renew_done(struct space *sp, int rd_ms, int wr_ms)
+{
+	struct io_device *dev = sp->io_device;
+
+	if (!dev)
+		return;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	dev->depth--;
+
+	if (rd_ms >= 0) {
+		dev->read_count++;
+		dev->read_ms += rd_ms;
+		if (rd_ms > dev->read_ms_max)
+			dev->read_ms_max = rd_ms;
+	}
+
+	if (wr_ms >= 0) {
+		dev->write_count++;
+		dev->write_ms += wr_ms;
+		if (wr_ms > dev->write_ms_max)
+			dev->write_ms_max = wr_ms;
+	}
+	pthread_mutex_unlock(&io_devices_mutex);
+}
+
+void send_state_devices(int fd)
+{
+	struct io_device *dev;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	list_for_each_entry(dev, &io_devices, list)
+		send_state_device(fd, dev);
+	pthread_mutex_unlock(&io_devices_mutex);
+}
+
+void status_devices(struct status_buf *sb)
+{
+	struct io_device *dev;
+
+	pthread_mutex_lock(&io_devices_mutex);
+	list_for_each_entry(dev, &io_devices, list)
+		status_device(sb, dev);
+	pthread_mutex_unlock(&io_devices_mutex);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __IOSCHED_H__
+#define __IOSCHED_H__
+
+/* track the device holding the lockspace's delta leases */
+void iosched_add(struct space *sp);
+void iosched_remove(struct space *sp);
+
+/* space out renewals of lockspaces on the same device */
+uint64_t iosched_renew_start(struct space *sp, int id_renewal_seconds, int retry);
+void iosched_renew_begin(struct space *sp);
+void iosched_renew_done(struct space *sp, int rd_ms, int wr_ms);
+
+void send_state_devices(int fd);
+
+struct status_buf;
+void status_devices(struct status_buf *sb);
+
+#endif
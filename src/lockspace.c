@@ -40,9 +40,33 @@
 #include "timeouts.h"
 #include "direct.h"
 #include "helper.h"
+#include "iosched.h"
+#include "renew.h"
+#include "diskcache.h"
+#include "shmstatus.h"
+
+/* from main.c */
+void main_loop_wake(void);
 
 static uint32_t space_id_counter = 1;
 
+/*
+ * A thread waiting to see a change in another host's delta lease
+ * (paxos_lease_acquire waiting on the owner of a lease) or waiting
+ * out the delay in delta_lease_acquire, waits on host_status_cond
+ * rather than sleeping a second at a time.  The generation of a
+ * lockspace is advanced each time its lockspace thread has checked
+ * the other hosts' leases, and when the lockspace is being removed.
+ * Lockspaces whose space_ids hash together share a generation, which
+ * only causes extra wakeups.
+ */
+
+#define HOST_STATUS_GENS 64
+
+static pthread_mutex_t host_status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_status_cond;
+static uint32_t host_status_gens[HOST_STATUS_GENS];
+
 /*
  * When the sanlock daemon is not root, set_max_sectors_kb() needs to use the
  * root helper process to write to sysfs.
@@ -158,6 +182,79 @@ struct space *find_lockspace(const char *name)
 	return _search_space(name, NULL, 0, &spaces, &spaces_rem, &spaces_add, NULL);
 }
 
+/*
+ * Every struct space on the spaces list is also in space_hash, keyed by
+ * lockspace name.  space_hash is changed with both spaces_mutex and the
+ * space_hash_lock write lock held, so it can be searched with either
+ * spaces_mutex or the read lock held.  The lookups made while acquiring
+ * leases (lockspace_info, lockspace_disk, host_info, host_status_set_bit)
+ * take only the read lock, so they do not wait behind main_loop, or add
+ * and rem lockspace, holding spaces_mutex.  A struct space is removed from
+ * space_hash before it is moved to spaces_rem, so it is not freed while
+ * the read lock is held.  The lock prefers writers, so a steady stream of
+ * lookups cannot keep main_loop waiting for the write lock while it holds
+ * spaces_mutex.
+ */
+
+#define SPACE_HASH_SIZE 256 /* power of 2 */
+
+static struct list_head space_hash[SPACE_HASH_SIZE];
+static pthread_rwlock_t space_hash_lock;
+
+static struct list_head *space_hash_head(const char *space_name)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < NAME_ID_SIZE && space_name[i]; i++)
+		h = (h ^ (uint8_t)space_name[i]) * 16777619U;
+
+	return &space_hash[h & (SPACE_HASH_SIZE - 1)];
+}
+
+/* called with spaces_mutex or space_hash_lock held */
+
+static struct space *space_hash_find(const char *space_name)
+{
+	struct space *sp;
+
+	list_for_each_entry(sp, space_hash_head(space_name), hash_list) {
+		if (!strncmp(sp->space_name, space_name, NAME_ID_SIZE))
+			return sp;
+	}
+	return NULL;
+}
+
+/* called with spaces_mutex held */
+
+static void space_hash_add(struct space *sp)
+{
+	pthread_rwlock_wrlock(&space_hash_lock);
+	list_add(&sp->hash_list, space_hash_head(sp->space_name));
+	pthread_rwlock_unlock(&space_hash_lock);
+}
+
+void space_hash_del(struct space *sp)
+{
+	pthread_rwlock_wrlock(&space_hash_lock);
+	list_del(&sp->hash_list);
+	pthread_rwlock_unlock(&space_hash_lock);
+}
+
+void setup_lockspaces(void)
+{
+	pthread_rwlockattr_t attr;
+	int i;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&space_hash_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i = 0; i < SPACE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&space_hash[i]);
+}
+
 static struct space *find_lockspace_id(uint32_t space_id)
 {
 	struct space *sp;
@@ -181,27 +278,64 @@ static void _set_space_info(struct space *sp, struct space_info *spi)
 	spi->killing_pids = sp->killing_pids;
 }
 
-int _lockspace_info(const char *space_name, struct space_info *spi)
+/*
+ * sp->clients lists each client that has acquired tokens in the lockspace,
+ * so that kill_pids and all_pids_dead look at only those clients.  A
+ * client is added when it acquires tokens, and is dropped by main_loop
+ * once it is found to no longer be using the lockspace, so the list may
+ * include clients that have since released their tokens or exited.
+ * Called with spaces_mutex held.
+ */
+
+int space_add_client(const char *space_name, int ci)
 {
 	struct space *sp;
+	int *clients;
+	int i, size;
 
-	list_for_each_entry(sp, &spaces, list) {
-		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
-			continue;
+	sp = space_hash_find(space_name);
+	if (!sp)
+		return -ENOENT;
 
-		_set_space_info(sp, spi);
-		return 0;
+	for (i = 0; i < sp->clients_count; i++) {
+		if (sp->clients[i] == ci)
+			return 0;
+	}
+
+	if (sp->clients_count == sp->clients_size) {
+		size = sp->clients_size ? sp->clients_size * 2 : 16;
+		clients = realloc(sp->clients, size * sizeof(int));
+		if (!clients) {
+			log_erros(sp, "space_add_client no mem %d", size);
+			return -ENOMEM;
+		}
+		sp->clients = clients;
+		sp->clients_size = size;
 	}
-	return -1;
+
+	sp->clients[sp->clients_count++] = ci;
+	return 0;
+}
+
+int _lockspace_info(const char *space_name, struct space_info *spi)
+{
+	struct space *sp;
+
+	sp = space_hash_find(space_name);
+	if (!sp)
+		return -1;
+
+	_set_space_info(sp, spi);
+	return 0;
 }
 
 int lockspace_info(const char *space_name, struct space_info *spi)
 {
 	int rv;
 
-	pthread_mutex_lock(&spaces_mutex);
+	pthread_rwlock_rdlock(&space_hash_lock);
 	rv = _lockspace_info(space_name, spi);
-	pthread_mutex_unlock(&spaces_mutex);
+	pthread_rwlock_unlock(&space_hash_lock);
 
 	return rv;
 }
@@ -211,17 +345,15 @@ int lockspace_disk(char *space_name, struct sync_disk *disk, int *sector_size)
 	struct space *sp;
 	int rv = -1;
 
-	pthread_mutex_lock(&spaces_mutex);
-	list_for_each_entry(sp, &spaces, list) {
-		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
-			continue;
-
+	pthread_rwlock_rdlock(&space_hash_lock);
+	sp = space_hash_find(space_name);
+	if (sp) {
 		memcpy(disk, &sp->host_id_disk, sizeof(struct sync_disk));
 		*sector_size = sp->sector_size;
 		disk->fd = -1;
 		rv = 0;
 	}
-	pthread_mutex_unlock(&spaces_mutex);
+	pthread_rwlock_unlock(&space_hash_lock);
 
 	return rv;
 }
@@ -266,66 +398,120 @@ int test_id_bit(int host_id, char *bitmap)
 int host_status_set_bit(char *space_name, uint64_t host_id)
 {
 	struct space *sp;
-	int found = 0;
+	int rv = 0;
 
 	if (!host_id || host_id > DEFAULT_MAX_HOSTS)
 		return -EINVAL;
 
-	pthread_mutex_lock(&spaces_mutex);
-	list_for_each_entry(sp, &spaces, list) {
-		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
-			continue;
-		found = 1;
-		break;
+	pthread_rwlock_rdlock(&space_hash_lock);
+	sp = space_hash_find(space_name);
+	if (!sp) {
+		rv = -ENOSPC;
+	} else if (host_id > sp->max_hosts) {
+		rv = -EINVAL;
+	} else {
+		pthread_mutex_lock(&sp->mutex);
+		sp->host_status[host_id-1].set_bit_time = monotime();
+		pthread_mutex_unlock(&sp->mutex);
 	}
-	pthread_mutex_unlock(&spaces_mutex);
+	pthread_rwlock_unlock(&space_hash_lock);
+
+	return rv;
+}
 
-	if (!found)
-		return -ENOSPC;
+int host_info(char *space_name, uint64_t host_id, struct host_status *hs_out)
+{
+	struct space *sp;
+	int rv;
 
-	if (host_id > sp->max_hosts)
+	if (!host_id || host_id > DEFAULT_MAX_HOSTS)
 		return -EINVAL;
 
+	pthread_rwlock_rdlock(&space_hash_lock);
+	sp = space_hash_find(space_name);
+	if (!sp) {
+		rv = -ENOSPC;
+		goto out;
+	}
+	if (host_id > sp->max_hosts) {
+		rv = -EINVAL;
+		goto out;
+	}
+
 	pthread_mutex_lock(&sp->mutex);
-	sp->host_status[host_id-1].set_bit_time = monotime();
+	memcpy(hs_out, &sp->host_status[host_id-1], sizeof(struct host_status));
+
+	/*
+	 * The last renewal did not read this host's lease, so the
+	 * status is not current.  Clearing last_check means the
+	 * caller assumes nothing, and the next renewal includes it.
+	 */
+	if (host_id > (uint64_t)sp->check_hosts) {
+		hs_out->last_check = 0;
+		if (sp->renewal_used_hosts < (int)host_id)
+			sp->renewal_used_hosts = (int)host_id;
+	}
 	pthread_mutex_unlock(&sp->mutex);
-	return 0;
+
+	if (!hs_out->io_timeout) {
+		log_erros(sp, "host_info %llu use own io_timeout %d",
+			  (unsigned long long)host_id, sp->io_timeout);
+		hs_out->io_timeout = sp->io_timeout;
+	}
+	rv = 0;
+ out:
+	pthread_rwlock_unlock(&space_hash_lock);
+	return rv;
 }
 
-int host_info(char *space_name, uint64_t host_id, struct host_status *hs_out)
+void setup_host_status_wait(void)
 {
-	struct space *sp;
-	int found = 0;
-	int toobig = 0;
+	pthread_condattr_t attr;
 
-	if (!host_id || host_id > DEFAULT_MAX_HOSTS)
-		return -EINVAL;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&host_status_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
 
-	pthread_mutex_lock(&spaces_mutex);
-	list_for_each_entry(sp, &spaces, list) {
-		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
-			continue;
-		if (host_id > sp->max_hosts) {
-			toobig = 1;
-			break;
-		}
-		memcpy(hs_out, &sp->host_status[host_id-1], sizeof(struct host_status));
-		found = 1;
+void host_status_notify(uint32_t space_id)
+{
+	pthread_mutex_lock(&host_status_mutex);
+	host_status_gens[space_id % HOST_STATUS_GENS]++;
+	pthread_cond_broadcast(&host_status_cond);
+	pthread_mutex_unlock(&host_status_mutex);
+}
 
-		if (!hs_out->io_timeout) {
-			log_erros(sp, "host_info %llu use own io_timeout %d",
-				  (unsigned long long)host_id, sp->io_timeout);
-			hs_out->io_timeout = sp->io_timeout;
-		}
-		break;
+/*
+ * Returns the current generation for the lockspace once it differs
+ * from gen, or after wait_ms.  Use wait_ms 0 to get the current
+ * generation before looking at host_status.
+ */
+
+uint32_t host_status_wait(uint32_t space_id, uint32_t gen, int wait_ms)
+{
+	struct timespec ts;
+	uint32_t *cur = &host_status_gens[space_id % HOST_STATUS_GENS];
+	int rv;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += wait_ms / 1000;
+	ts.tv_nsec += (wait_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 	}
-	pthread_mutex_unlock(&spaces_mutex);
 
-	if (toobig)
-		return -EINVAL;
-	if (!found)
-		return -ENOSPC;
-	return 0;
+	pthread_mutex_lock(&host_status_mutex);
+	while (wait_ms > 0 && *cur == gen) {
+		rv = pthread_cond_timedwait(&host_status_cond, &host_status_mutex, &ts);
+		if (rv == ETIMEDOUT)
+			break;
+	}
+	gen = *cur;
+	pthread_mutex_unlock(&host_status_mutex);
+
+	return gen;
 }
 
 static void create_bitmap_and_extra(struct space *sp, char *bitmap, struct delta_extra *extra)
@@ -359,29 +545,36 @@ static void create_bitmap_and_extra(struct space *sp, char *bitmap, struct delta
 	pthread_mutex_unlock(&sp->mutex);
 }
 
-/* 
- * Called from main thread to look through the lease data collected in
- * the last renewal.  Records liveness history about other hosts in the
- * lockspace, checks if another host is notifying us (through their bitmap)
- * to look at resource requests or an event they've written.
+/*
+ * Called from the lockspace thread after each renewal to look through
+ * the delta leases that were read, directly from the task iobuf before
+ * the next renewal reuses it.  Records liveness history about other
+ * hosts in the lockspace, checks if another host is notifying us
+ * (through their bitmap) to look at resource requests or an event
+ * they've written.
+ *
+ * host_status is updated under sp->mutex, which readers of host_status
+ * also hold.  sp->mutex is dropped to pass an event to the resource
+ * thread.
  *
- * NB. the way that this gets the copy of all leases to look at is
- * unfortunately very subtle and convoluted.
+ * When the renewal read only the leases of the lower host_ids
+ * (renewal_full_scan_sec), only those check_hosts are examined;
+ * the status of higher hosts is left as of the last full read.
  *
- * The lockspace thread makes a copy of task iobuf, which holds all
- * delta leases that were read in the last renewal, into
- * sp->lease_status.renewal_read_buf.  Then check_our_lease() called
- * by the main loop makes a copy of sp->lease_status.renewal_read_buf
- * to pass to this function.
+ * Host status is not reported before the lockspace has been added,
+ * so a renewal that completes first is left unchecked (returns 1)
+ * and the lockspace thread checks it again while waiting for the
+ * next renewal.
  */
 
-void check_other_leases(struct space *sp, char *buf)
+int check_other_leases(struct space *sp, char *buf, int check_hosts)
 {
 	struct leader_record leader_in;
 	struct leader_record *leader_end;
 	struct leader_record *leader;
 	struct host_status *hs;
 	struct sanlk_host_event he;
+	uint64_t owner_id, owner_generation;
 	char *bitmap;
 	uint64_t now;
 	int i, new;
@@ -389,7 +582,22 @@ void check_other_leases(struct space *sp, char *buf)
 	now = monotime();
 	new = 0;
 
-	for (i = 0; i < sp->max_hosts; i++) {
+	pthread_mutex_lock(&sp->mutex);
+
+	if (!sp->added) {
+		pthread_mutex_unlock(&sp->mutex);
+		return 1;
+	}
+
+	/* main_loop has begun removing the lockspace */
+	if (sp->space_dead || sp->thread_stop) {
+		pthread_mutex_unlock(&sp->mutex);
+		return 0;
+	}
+
+	sp->check_hosts = check_hosts;
+
+	for (i = 0; i < check_hosts; i++) {
 		hs = &sp->host_status[i];
 		hs->last_check = now;
 
@@ -501,13 +709,12 @@ void check_other_leases(struct space *sp, char *buf)
 		 * the main thread to be delayed with that.)
 		 */
 		if (he.event) {
-			/*
-			 * lock order: spaces_mutex (main_loop), then
-			 * resource_mutex (add_host_event).
-			 */
 			log_space(sp, "host event from host_id %d", i+1);
-			add_host_event(sp->space_id, &he,
-				       hs->owner_id, hs->owner_generation);
+			owner_id = hs->owner_id;
+			owner_generation = hs->owner_generation;
+			pthread_mutex_unlock(&sp->mutex);
+			add_host_event(sp->space_id, &he, owner_id, owner_generation);
+			pthread_mutex_lock(&sp->mutex);
 		}
 
 		/* this host has made a resource request for us, we won't take a new
@@ -520,6 +727,8 @@ void check_other_leases(struct space *sp, char *buf)
 		hs->last_req = now;
 		new = 1;
 	}
+	shm_status_update_hosts(sp);
+	pthread_mutex_unlock(&sp->mutex);
 
 	/*
 	 * Have the resource_thread check the request records of resources
@@ -527,13 +736,16 @@ void check_other_leases(struct space *sp, char *buf)
 	 */
 	if (new)
 		set_resource_examine(sp->space_name, NULL);
+
+	host_status_notify(sp->space_id);
+	return 0;
 }
 
 /*
  * check if our_host_id_thread has renewed within timeout
  */
 
-int check_our_lease(struct space *sp, int *check_all, char *check_buf)
+int check_our_lease(struct space *sp, uint64_t *check_ms)
 {
 	int id_renewal_fail_seconds, id_renewal_warn_seconds;
 	uint64_t last_success;
@@ -543,17 +755,6 @@ int check_our_lease(struct space *sp, int *check_all, char *check_buf)
 	pthread_mutex_lock(&sp->mutex);
 	last_success = sp->lease_status.renewal_last_success;
 	corrupt_result = sp->lease_status.corrupt_result;
-
-	if (sp->lease_status.renewal_read_count > sp->lease_status.renewal_read_check) {
-		/*
-		 * NB. it's unfortunate how subtle this is.
-		 * main loop will pass this buf to check_other_leases next
-		 */
-		sp->lease_status.renewal_read_check = sp->lease_status.renewal_read_count;
-		*check_all = 1;
-		if (check_buf)
-			memcpy(check_buf, sp->lease_status.renewal_read_buf, sp->align_size);
-	}
 	pthread_mutex_unlock(&sp->mutex);
 
 	if (corrupt_result) {
@@ -571,9 +772,17 @@ int check_our_lease(struct space *sp, int *check_all, char *check_buf)
 		return -1;
 	}
 
+	/*
+	 * Nothing changes until the warning time is reached without another
+	 * renewal, then check each second until the lease is renewed or fails.
+	 */
+
 	if (gap >= id_renewal_warn_seconds) {
 		log_erros(sp, "check_our_lease warning %d last_success %llu",
 			  gap, (unsigned long long)last_success);
+		*check_ms = monotime_ms() + 1000;
+	} else {
+		*check_ms = (last_success + id_renewal_warn_seconds) * 1000;
 	}
 
 	if (com.debug_renew > 1) {
@@ -739,44 +948,92 @@ static void set_lockspace_max_sectors_kb(struct space *sp, int sector_size, int
 }
 
 /*
- * This thread must not be stopped unless all pids that may be using any
- * resources in it are dead/gone.  (The USED flag in the lockspace represents
- * pids using resources in the lockspace, when those pids are not using actual
- * sanlock resources.  So the USED flag must also prevent this thread from
- * stopping.)
+ * State kept between the steps of the renewal engine for a lockspace.
+ * The task holds the lockspace's own aio context and iobuf: a renewal
+ * whose read timed out reaps that read at the start of the next
+ * renewal, and a partial renewal read relies on the tail of the iobuf
+ * from the last full read.
  */
 
-static void *lockspace_thread(void *arg_in)
-{
-	char bitmap[HOSTID_BITMAP_SIZE];
-	struct delta_extra extra;
+struct renew_state {
 	struct task task;
-	struct space *sp;
 	struct leader_record leader;
-	uint64_t delta_begin, last_success = 0;
+	uint64_t last_success;
+	uint64_t renew_ms;	/* time of the next renewal */
+	uint64_t io_start_ms;	/* start time given by iosched */
+	int id_renewal_seconds;
+	int id_renewal_fail_seconds;
+	int log_renewal_level;
+	int delta_result;
+	int renewal_interval;
+	int read_hosts;
+	int read_unchecked;
+	int opened;
+};
+
+static void lockspace_finish(struct space *sp)
+{
+	struct renew_state *rs = sp->renew;
+
+	if (rs->delta_result == SANLK_OK)
+		delta_lease_release(&rs->task, sp, &sp->host_id_disk,
+				    sp->space_name, &rs->leader, &rs->leader);
+
+	if (rs->opened) {
+		iosched_remove(sp);
+		unregister_disks(&rs->task, &sp->host_id_disk, 1);
+		close(sp->host_id_disk.fd);
+	}
+
+	/*
+	 * TODO: are there cases where struct resources for this lockspace
+	 * still exist on resource_held/resource_add/resource_rem?  Is that ok?
+	 * Should we purge all of them here?  When a lockspace is removed and
+	 * pids are killed, their resources go through release_token_async,
+	 * which will see token->space_dead, and those resources are freed
+	 * directly.  resources that may have already been on resources_rem and
+	 * the resource_thread may be in the middle of releasing one of them.
+	 * For any further async releases, resource_thread will see that the
+	 * lockspace is going away and will just free the resource.
+	 */
+
+	purge_resource_orphans(sp->space_name);
+	purge_resource_free(sp->space_name);
+	disk_cache_purge(sp->space_name);
+
+	close_event_fds(sp);
+
+	close_task_aio(&rs->task);
+}
+
+/*
+ * The lockspace thread opens the lockspace and acquires the host_id
+ * lease, then hands the lockspace to the renewal engine and exits.
+ * The renewal engine calls lockspace_renew() for each later step.
+ */
+
+static void *lockspace_thread(void *arg_in)
+{
+	struct space *sp = (struct space *)arg_in;
+	struct renew_state *rs = sp->renew;
+	struct task *task = &rs->task;
+	struct leader_record *leader = &rs->leader;
+	uint64_t delta_begin;
 	int sector_size = 0;
 	int align_size = 0;
 	int max_hosts = 0;
-	int log_renewal_level = -1;
-	int rv, delta_length, renewal_interval = 0;
-	int id_renewal_seconds, id_renewal_fail_seconds;
-	int acquire_result, delta_result, read_result;
-	int rd_ms, wr_ms;
-	int opened = 0;
-	int stop = 0;
+	int rv, acquire_result, delta_result;
 	int wd_con;
 
+	rs->log_renewal_level = -1;
 	if (com.debug_renew)
-		log_renewal_level = LOG_DEBUG;
+		rs->log_renewal_level = LOG_DEBUG;
 
-	sp = (struct space *)arg_in;
+	setup_task_aio(task, main_task.use_aio, HOSTID_AIO_CB_SIZE);
+	memcpy(task->name, sp->space_name, NAME_ID_SIZE);
 
-	memset(&task, 0, sizeof(struct task));
-	setup_task_aio(&task, main_task.use_aio, HOSTID_AIO_CB_SIZE);
-	memcpy(task.name, sp->space_name, NAME_ID_SIZE);
-
-	id_renewal_seconds = calc_id_renewal_seconds(sp->io_timeout);
-	id_renewal_fail_seconds = calc_id_renewal_fail_seconds(sp->io_timeout);
+	rs->id_renewal_seconds = calc_id_renewal_seconds(sp->io_timeout);
+	rs->id_renewal_fail_seconds = calc_id_renewal_fail_seconds(sp->io_timeout);
 
 	delta_begin = monotime();
 
@@ -787,9 +1044,12 @@ static void *lockspace_thread(void *arg_in)
 		delta_result = -1;
 		goto set_status;
 	}
-	opened = 1;
+	rs->opened = 1;
 
-	rv = delta_read_lockspace_sizes(&task, &sp->host_id_disk, sp->io_timeout, &sector_size, &align_size);
+	register_disks(task, &sp->host_id_disk, 1);
+	iosched_add(sp);
+
+	rv = delta_read_lockspace_sizes(task, &sp->host_id_disk, sp->io_timeout, &sector_size, &align_size);
 	if (rv < 0) {
 		log_erros(sp, "failed to read device to find sector size error %d %s", rv, sp->host_id_disk.path);
 		acquire_result = rv;
@@ -825,13 +1085,6 @@ static void *lockspace_thread(void *arg_in)
 
 	set_lockspace_max_sectors_kb(sp, sector_size, align_size);
 
-	sp->lease_status.renewal_read_buf = malloc(sp->align_size);
-	if (!sp->lease_status.renewal_read_buf) {
-		acquire_result = -ENOMEM;
-		delta_result = -1;
-		goto set_status;
-	}
-
 	/* Connect first so we can fail quickly if wdmd is not running. */
 	wd_con = connect_watchdog(sp);
 	if (wd_con < 0) {
@@ -868,13 +1121,12 @@ static void *lockspace_thread(void *arg_in)
 
 	delta_begin = monotime();
 
-	delta_result = delta_lease_acquire(&task, sp, &sp->host_id_disk,
+	delta_result = delta_lease_acquire(task, sp, &sp->host_id_disk,
 					   sp->space_name, our_host_name_global,
-					   sp->host_id, &leader);
-	delta_length = monotime() - delta_begin;
+					   sp->host_id, leader);
 
 	if (delta_result == SANLK_OK)
-		last_success = leader.timestamp;
+		rs->last_success = leader->timestamp;
 
 	acquire_result = delta_result;
 
@@ -882,7 +1134,7 @@ static void *lockspace_thread(void *arg_in)
 	   before we allow any pid's to begin running */
 
 	if (delta_result == SANLK_OK) {
-		rv = activate_watchdog(sp, last_success, id_renewal_fail_seconds, wd_con);
+		rv = activate_watchdog(sp, rs->last_success, rs->id_renewal_fail_seconds, wd_con);
 		if (rv < 0) {
 			log_erros(sp, "activate_watchdog failed %d", rv);
 			acquire_result = SANLK_WD_ERROR;
@@ -893,159 +1145,212 @@ static void *lockspace_thread(void *arg_in)
 	}
 
  set_status:
+	rs->delta_result = delta_result;
+
 	pthread_mutex_lock(&sp->mutex);
 	sp->lease_status.acquire_last_result = acquire_result;
 	sp->lease_status.acquire_last_attempt = delta_begin;
 	if (delta_result == SANLK_OK)
-		sp->lease_status.acquire_last_success = last_success;
+		sp->lease_status.acquire_last_success = rs->last_success;
 	sp->lease_status.renewal_last_result = acquire_result;
 	sp->lease_status.renewal_last_attempt = delta_begin;
 	if (delta_result == SANLK_OK)
-		sp->lease_status.renewal_last_success = last_success;
+		sp->lease_status.renewal_last_success = rs->last_success;
 	/* First renewal entry shows the acquire time with 0 latencies. */
-	save_renewal_history(sp, delta_result, last_success, 0, 0);
+	save_renewal_history(sp, delta_result, rs->last_success, 0, 0);
 	pthread_mutex_unlock(&sp->mutex);
 
-	if (acquire_result < 0)
-		goto out;
+	if (acquire_result < 0) {
+		lockspace_finish(sp);
+		return NULL;
+	}
 
-	sp->host_generation = leader.owner_generation;
+	sp->host_generation = leader->owner_generation;
 
-	while (1) {
-		pthread_mutex_lock(&sp->mutex);
-		stop = sp->thread_stop;
-		pthread_mutex_unlock(&sp->mutex);
-		if (stop)
-			break;
+	rs->renew_ms = (rs->last_success + rs->id_renewal_seconds) * 1000 + 500;
+	renew_engine_add(sp, rs->renew_ms);
+	return NULL;
+}
 
-		/*
-		 * wait between each renewal
-		 */
+/*
+ * Called by the renewal engine when the next step for the lockspace is
+ * due, or when thread_stop may have been set.  Renews the host_id lease
+ * when the renewal is due, and returns 1 with the time of the next step,
+ * or releases the host_id lease and returns 0 once thread_stop is set.
+ *
+ * thread_stop must not be set unless all pids that may be using any
+ * resources in the lockspace are dead/gone.  (The USED flag in the
+ * lockspace represents pids using resources in the lockspace, when those
+ * pids are not using actual sanlock resources.  So the USED flag must
+ * also prevent the lockspace from stopping.)
+ */
 
-		if (monotime() - last_success < id_renewal_seconds) {
-			sleep(1);
-			continue;
-		} else {
-			/* don't spin too quickly if renew is failing
-			   immediately and repeatedly */
-			usleep(500000);
-		}
+int lockspace_renew(struct space *sp, uint64_t *due_ms)
+{
+	struct renew_state *rs = sp->renew;
+	struct task *task = &rs->task;
+	char bitmap[HOSTID_BITMAP_SIZE];
+	struct delta_extra extra;
+	uint64_t delta_begin, now;
+	int delta_length, delta_result, read_result;
+	int rd_ms, wr_ms;
+	int corrupt = 0;
+	int stop;
 
+	pthread_mutex_lock(&sp->mutex);
+	stop = sp->thread_stop;
+	pthread_mutex_unlock(&sp->mutex);
 
-		/*
-		 * do a renewal, measuring length of time spent in renewal,
-		 * and the length of time between successful renewals
-		 */
+	if (stop) {
+		/* watchdog unlink was done in main_loop when thread_stop was set, to
+		   get it done as quickly as possible in case the wd is about to fire. */
 
-		memset(bitmap, 0, sizeof(bitmap));
-		memset(&extra, 0, sizeof(extra));
-		create_bitmap_and_extra(sp, bitmap, &extra);
+		disconnect_watchdog(sp);
+		lockspace_finish(sp);
+		return 0;
+	}
 
-		delta_begin = monotime();
+	/* task->iobuf still holds the last read until the next renewal */
 
-		delta_result = delta_lease_renew(&task, sp, &sp->host_id_disk,
-						 sp->space_name, bitmap, &extra,
-						 delta_result, &read_result,
-						 log_renewal_level,
-						 &leader, &leader,
-						 &rd_ms, &wr_ms);
-		delta_length = monotime() - delta_begin;
+	if (rs->read_unchecked)
+		rs->read_unchecked = check_other_leases(sp, task->iobuf, rs->read_hosts);
 
-		if (delta_result == SANLK_OK) {
-			renewal_interval = leader.timestamp - last_success;
-			last_success = leader.timestamp;
-		}
+	now = monotime_ms();
+	if (now < rs->renew_ms)
+		goto next;
 
+	/* space out the renewals of lockspaces on the same device */
 
-		/*
-		 * publish the results
-		 */
+	if (!rs->io_start_ms)
+		rs->io_start_ms = iosched_renew_start(sp, rs->id_renewal_seconds,
+						      rs->delta_result != SANLK_OK);
+	if (now < rs->io_start_ms)
+		goto next;
+	rs->io_start_ms = 0;
 
-		pthread_mutex_lock(&sp->mutex);
-		sp->lease_status.renewal_last_result = delta_result;
-		sp->lease_status.renewal_last_attempt = delta_begin;
+	/*
+	 * do a renewal, measuring length of time spent in renewal,
+	 * and the length of time between successful renewals
+	 */
 
-		if (delta_result == SANLK_OK)
-			sp->lease_status.renewal_last_success = last_success;
+	iosched_renew_begin(sp);
 
-		if (delta_result != SANLK_OK && !sp->lease_status.corrupt_result)
-			sp->lease_status.corrupt_result = corrupt_result(delta_result);
+	memset(bitmap, 0, sizeof(bitmap));
+	memset(&extra, 0, sizeof(extra));
+	create_bitmap_and_extra(sp, bitmap, &extra);
 
-		if (read_result == SANLK_OK && task.iobuf) {
-			/* NB. be careful with how this iobuf escapes */
-			memcpy(sp->lease_status.renewal_read_buf, task.iobuf, sp->align_size);
-			sp->lease_status.renewal_read_count++;
-		}
+	delta_begin = monotime();
 
-		/*
-		 * pet the watchdog
-		 * (don't update on thread_stop because it's probably unlinked)
-		 */
+	delta_result = delta_lease_renew(task, sp, &sp->host_id_disk,
+					 sp->space_name, bitmap, &extra,
+					 rs->delta_result, &read_result,
+					 rs->log_renewal_level,
+					 &rs->leader, &rs->leader,
+					 &rd_ms, &wr_ms);
+	delta_length = monotime() - delta_begin;
+	rs->delta_result = delta_result;
 
-		if (delta_result == SANLK_OK && !sp->thread_stop)
-			update_watchdog(sp, last_success, id_renewal_fail_seconds);
+	iosched_renew_done(sp, rd_ms, wr_ms);
 
-		save_renewal_history(sp, delta_result, last_success, rd_ms, wr_ms);
-		pthread_mutex_unlock(&sp->mutex);
+	if (delta_result == SANLK_OK) {
+		rs->renewal_interval = rs->leader.timestamp - rs->last_success;
+		rs->last_success = rs->leader.timestamp;
+	}
 
 
-		/*
-		 * log the results
-		 */
+	/*
+	 * publish the results
+	 */
 
-		if (delta_result != SANLK_OK) {
-			log_erros(sp, "renewal error %d delta_length %d last_success %llu",
-				  delta_result, delta_length, (unsigned long long)last_success);
-		} else if (delta_length > id_renewal_seconds) {
-			log_erros(sp, "renewed %llu delta_length %d too long",
-				  (unsigned long long)last_success, delta_length);
-		} else {
-			if (com.debug_renew) {
-				log_space(sp, "renewed %llu delta_length %d interval %d",
-					  (unsigned long long)last_success, delta_length, renewal_interval);
-			}
-		}
+	pthread_mutex_lock(&sp->mutex);
+	sp->lease_status.renewal_last_result = delta_result;
+	sp->lease_status.renewal_last_attempt = delta_begin;
+
+	if (delta_result == SANLK_OK)
+		sp->lease_status.renewal_last_success = rs->last_success;
+
+	if (delta_result != SANLK_OK && !sp->lease_status.corrupt_result) {
+		sp->lease_status.corrupt_result = corrupt_result(delta_result);
+		corrupt = sp->lease_status.corrupt_result;
 	}
 
-	/* watchdog unlink was done in main_loop when thread_stop was set, to
-	   get it done as quickly as possible in case the wd is about to fire. */
+	if (read_result == SANLK_OK && task->iobuf) {
+		rs->read_hosts = sp->renewal_read_len / sp->sector_size;
+		if (rs->read_hosts > sp->max_hosts)
+			rs->read_hosts = sp->max_hosts;
+		sp->lease_status.renewal_read_hosts = rs->read_hosts;
+	}
 
-	disconnect_watchdog(sp);
- out:
-	if (delta_result == SANLK_OK)
-		delta_lease_release(&task, sp, &sp->host_id_disk,
-				    sp->space_name, &leader, &leader);
+	/*
+	 * pet the watchdog
+	 * (don't update on thread_stop because it's probably unlinked)
+	 */
+
+	if (delta_result == SANLK_OK && !sp->thread_stop)
+		update_watchdog(sp, rs->last_success, rs->id_renewal_fail_seconds);
+
+	save_renewal_history(sp, delta_result, rs->last_success, rd_ms, wr_ms);
+	pthread_mutex_unlock(&sp->mutex);
+
+	/* main_loop only checks our lease at its next deadline otherwise */
+	if (corrupt)
+		main_loop_wake();
+
+	/* NB. task->iobuf is only valid until the next renewal */
+
+	rs->read_unchecked = 0;
+	if (read_result == SANLK_OK && task->iobuf)
+		rs->read_unchecked = check_other_leases(sp, task->iobuf, rs->read_hosts);
 
-	if (opened)
-		close(sp->host_id_disk.fd);
 
 	/*
-	 * TODO: are there cases where struct resources for this lockspace
-	 * still exist on resource_held/resource_add/resource_rem?  Is that ok?
-	 * Should we purge all of them here?  When a lockspace is removed and
-	 * pids are killed, their resources go through release_token_async,
-	 * which will see token->space_dead, and those resources are freed
-	 * directly.  resources that may have already been on resources_rem and
-	 * the resource_thread may be in the middle of releasing one of them.
-	 * For any further async releases, resource_thread will see that the
-	 * lockspace is going away and will just free the resource.
+	 * log the results
 	 */
 
-	purge_resource_orphans(sp->space_name);
-	purge_resource_free(sp->space_name);
+	if (delta_result != SANLK_OK) {
+		log_erros(sp, "renewal error %d delta_length %d last_success %llu",
+			  delta_result, delta_length, (unsigned long long)rs->last_success);
+	} else if (delta_length > rs->id_renewal_seconds) {
+		log_erros(sp, "renewed %llu delta_length %d too long",
+			  (unsigned long long)rs->last_success, delta_length);
+	} else {
+		if (com.debug_renew) {
+			log_space(sp, "renewed %llu delta_length %d interval %d",
+				  (unsigned long long)rs->last_success, delta_length,
+				  rs->renewal_interval);
+		}
+	}
 
-	close_event_fds(sp);
+	/* close the resource disk fds left idle in the cache */
+	disk_cache_expire();
 
-	close_task_aio(&task);
-	return NULL;
+	/* don't spin too quickly if renew is failing immediately and repeatedly */
+
+	if (delta_result == SANLK_OK)
+		rs->renew_ms = (rs->last_success + rs->id_renewal_seconds) * 1000 + 500;
+	else
+		rs->renew_ms = monotime_ms() + 500;
+	now = monotime_ms();
+
+ next:
+	*due_ms = rs->io_start_ms ? rs->io_start_ms : rs->renew_ms;
+
+	/* the check of other leases is retried until add_lockspace is done */
+
+	if (rs->read_unchecked && now + 1000 < *due_ms)
+		*due_ms = now + 1000;
+	return 1;
 }
 
 static void free_sp(struct space *sp)
 {
-	if (sp->lease_status.renewal_read_buf)
-		free(sp->lease_status.renewal_read_buf);
+	shm_status_rem_space(sp);
+	if (sp->clients)
+		free(sp->clients);
 	if (sp->renewal_history)
 		free(sp->renewal_history);
+	if (sp->renew)
+		free(sp->renew);
 	free(sp);
 }
 
@@ -1068,6 +1373,13 @@ int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct
 		return -ENOMEM;
 	memset(sp, 0, sizeof(struct space));
 
+	sp->renew = malloc(sizeof(struct renew_state));
+	if (!sp->renew) {
+		free(sp);
+		return -ENOMEM;
+	}
+	memset(sp->renew, 0, sizeof(struct renew_state));
+
 	memcpy(sp->space_name, ls->name, NAME_ID_SIZE);
 	memcpy(&sp->host_id_disk, &ls->host_id_disk, sizeof(struct sanlk_disk));
 	sp->host_id_disk.sector_size = 0;
@@ -1082,6 +1394,8 @@ int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct
 	else
 		sp->renewal_read_extend_sec = io_timeout;
 
+	sp->renewal_full_scan_sec = com.renewal_full_scan_sec;
+
 	for (i = 0; i < MAX_EVENT_FDS; i++)
 		sp->event_fds[i] = -1;
 
@@ -1167,6 +1481,8 @@ int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct
 	list_add(&sp->list, &spaces_add);
 	pthread_mutex_unlock(&spaces_mutex);
 
+	shm_status_add_space(sp);
+
 	/* save a record of what this space_id is for later debugging */
 	log_warns(sp, "lockspace %.48s:%llu:%.256s:%llu",
 		  sp->space_name,
@@ -1206,9 +1522,12 @@ int add_lockspace_wait(struct space *sp)
 		sleep(1);
 	}
 
+	/* the thread exits once it has acquired the host_id lease and
+	   handed the lockspace to the renewal engine, or right away if
+	   acquire fails */
+	pthread_join(sp->thread, NULL);
+
 	if (result != SANLK_OK) {
-		/* the thread exits right away if acquire fails */
-		pthread_join(sp->thread, NULL);
 		rv = result;
 		log_erros(sp, "add_lockspace fail result %d", result);
 		goto fail_del;
@@ -1236,14 +1555,21 @@ int add_lockspace_wait(struct space *sp)
 		sp->thread_stop = 1;
 		deactivate_watchdog(sp);
 		pthread_mutex_unlock(&sp->mutex);
-		pthread_join(sp->thread, NULL);
+		renew_engine_wait(sp);
 		rv = -1;
 		log_space(sp, "add_lockspace undo complete");
 		goto fail_del;
 	} else {
 		list_move(&sp->list, &spaces);
+		space_hash_add(sp);
+		pthread_mutex_lock(&sp->mutex);
+		sp->added = 1;
+		pthread_mutex_unlock(&sp->mutex);
+		shm_status_set_flags(sp, 0);
 		log_space(sp, "add_lockspace done");
 		pthread_mutex_unlock(&spaces_mutex);
+		/* main_loop sets the first deadline for checking our lease */
+		main_loop_wake();
 		return 0;
 	}
 
@@ -1307,6 +1633,7 @@ int rem_lockspace_start(struct sanlk_lockspace *ls, unsigned int *space_id)
 		sp->external_remove = 1;
 		id = sp->space_id;
 		pthread_mutex_unlock(&spaces_mutex);
+		host_status_notify(id);
 		*space_id = id;
 		rv = 0;
 		goto out;
@@ -1343,6 +1670,8 @@ int rem_lockspace_start(struct sanlk_lockspace *ls, unsigned int *space_id)
 	sp->external_remove = 1;
 	id = sp->space_id;
 	pthread_mutex_unlock(&spaces_mutex);
+	host_status_notify(id);
+	main_loop_wake();
 	*space_id = id;
 	rv = 0;
  out:
@@ -1544,7 +1873,7 @@ int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int m
 	host = (struct sanlk_host *)buf;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(ls->name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(ls->name);
 	if (!sp) {
 		rv = -ENOENT;
 		goto out;
@@ -1556,7 +1885,9 @@ int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int m
 	 * any data on other hosts, so return this error
 	 * to indicate this to the caller.
 	 */
+	pthread_mutex_lock(&sp->mutex);
 	if (!sp->host_status[0].last_check) {
+		pthread_mutex_unlock(&sp->mutex);
 		rv = -EAGAIN;
 		goto out;
 	}
@@ -1587,6 +1918,7 @@ int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int m
 
 		host++;
 	}
+	pthread_mutex_unlock(&sp->mutex);
  out:
 	pthread_mutex_unlock(&spaces_mutex);
 
@@ -1601,7 +1933,7 @@ int lockspace_set_config(struct sanlk_lockspace *ls, GNUC_UNUSED uint32_t flags,
 	int rv;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(ls->name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(ls->name);
 	if (!sp) {
 		pthread_mutex_unlock(&spaces_mutex);
 		rv = -ENOENT;
@@ -1653,7 +1985,7 @@ int lockspace_begin_rindex_op(char *space_name, int rindex_op, struct space_info
 	int rv = 0;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(space_name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(space_name);
 	if (!sp) {
 		rv = -ENOENT;
 		goto out;
@@ -1686,7 +2018,7 @@ int lockspace_clear_rindex_op(char *space_name)
 	int rv = 0;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(space_name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(space_name);
 	if (!sp)
 		rv = -ENOENT;
 	else
@@ -1747,7 +2079,7 @@ int lockspace_end_event(struct sanlk_lockspace *ls)
 		return -EINVAL;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(ls->name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(ls->name);
 	pthread_mutex_unlock(&spaces_mutex);
 	if (!sp)
 		return -ENOENT;
@@ -1768,7 +2100,7 @@ int lockspace_reg_event(struct sanlk_lockspace *ls, int fd, GNUC_UNUSED uint32_t
 		return -EINVAL;
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(ls->name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(ls->name);
 	if (!sp) {
 		pthread_mutex_unlock(&spaces_mutex);
 		log_error("lockspace_reg_event %.48s not found", ls->name);
@@ -1816,7 +2148,7 @@ int lockspace_set_event(struct sanlk_lockspace *ls, struct sanlk_host_event *he,
 	}
 
 	pthread_mutex_lock(&spaces_mutex);
-	sp = _search_space(ls->name, NULL, 0, &spaces, NULL, NULL, NULL);
+	sp = space_hash_find(ls->name);
 	if (!sp) {
 		pthread_mutex_unlock(&spaces_mutex);
 		return -ENOENT;
@@ -1829,15 +2161,15 @@ int lockspace_set_event(struct sanlk_lockspace *ls, struct sanlk_host_event *he,
 		return -EINVAL;
 	}
 
+	now = monotime();
+
+	pthread_mutex_lock(&sp->mutex);
+
 	if (!he->generation && (flags & SANLK_SETEV_CUR_GENERATION)) {
 		hs = &(sp->host_status[he->host_id-1]);
 		he->generation = hs->owner_generation;
 	}
 
-	now = monotime();
-
-	pthread_mutex_lock(&sp->mutex);
-
 	if (flags & SANLK_SETEV_CLEAR_EVENT) {
 		memset(&sp->host_event, 0, sizeof(struct sanlk_host_event));
 		sp->set_event_time = now;
@@ -1961,11 +2293,14 @@ static int stop_lockspace_thread(struct space *sp, int wait)
 		return -EINVAL;
 	}
 
-	if (wait)
-		rv = pthread_join(sp->thread, NULL);
-	else
-		rv = pthread_tryjoin_np(sp->thread, NULL);
+	if (wait) {
+		renew_engine_wait(sp);
+		return 0;
+	}
 
+	renew_engine_wake(sp);
+
+	rv = renew_engine_done(sp) ? 0 : -EBUSY;
 	return rv;
 }
 
@@ -1980,7 +2315,8 @@ static int stop_lockspace_thread(struct space *sp, int wait)
  * spaces, spaces_add, spaces_rem lists are protected by spaces_mutex
  *
  * sp->mutex protects info that is exchanged between the lockspace thread
- * (for the sp) and the main thread.  This is primarily sp->thread_stop,
+ * (for the sp, or the renewal engine thread running lockspace_renew for
+ * the sp) and the main thread.  This is primarily sp->thread_stop,
  * and sp->lease_status (although it seems a couple other bits of info
  * have been added over time that are communicated between the lockspace
  * thread and the main thread).
@@ -1991,7 +2327,8 @@ static int stop_lockspace_thread(struct space *sp, int wait)
  *
  * lockspace_thread never has to worry about sp going away and can access
  * sp directly any time.  The sp will not be freed until lockspace_thread
- * has exited.
+ * has exited, and lockspace_renew (from the renewal engine that
+ * lockspace_thread hands sp to) has returned 0 after thread_stop.
  *
  * The main thread never has to worry about sp going away, because the
  * main thread is the only context in which sp structs are freed
@@ -2022,8 +2359,6 @@ static int stop_lockspace_thread(struct space *sp, int wait)
  *   (reg_event and end_event are ok since they are called from
  *   the main thread)
  *
- * . worker_thread host_status_set_bit() 
- *
  * . resource_thread send_event_callbacks() does the same.
  *
  * I'm not sure what the best solution would be: lock sp->mutex before
@@ -2036,9 +2371,9 @@ static int stop_lockspace_thread(struct space *sp, int wait)
  * Then the main thread, which owns the sp structs, sees sp->external_remove,
  * kills any pids using the sp, and when the sp is no longer used, it sets
  * sp->thread_stop, and moves sp from spaces list to spaces_rem list.
- * The main thread then runs free_lockspaces() which stops the lockspace_thread
- * for sp's on spaces_rem.  When the lockspace_thread exits, the main thread
- * then removes sp from spaces_rem and frees sp.
+ * The main thread then runs free_lockspaces() which wakes the renewal engine
+ * for sp's on spaces_rem.  When lockspace_renew has released the host_id
+ * lease, the main thread then removes sp from spaces_rem and frees sp.
  */
 
 void free_lockspaces(int wait)
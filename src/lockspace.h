@@ -11,24 +11,44 @@
 
 /* See resource.h for lock ordering between spaces_mutex and resource_mutex. */
 
+/* space_hash_lock is taken after spaces_mutex and before sp->mutex. */
+
+/* no locks */
+void setup_lockspaces(void);
+
+/* locks space_hash_lock, called with spaces_mutex held */
+void space_hash_del(struct space *sp);
+
 /* no locks */
 struct space *find_lockspace(const char *name);
 
+/* no locks, called with spaces_mutex held */
+int space_add_client(const char *space_name, int ci);
+
 /* no locks */
 int _lockspace_info(const char *space_name, struct space_info *spi);
 
-/* locks spaces_mutex */
+/* locks space_hash_lock */
 int lockspace_info(const char *space_name, struct space_info *spi);
 
-/* locks spaces_mutex */
+/* locks space_hash_lock */
 int lockspace_disk(char *space_name, struct sync_disk *disk, int *sector_size);
 
-/* locks spaces_mutex */
+/* locks space_hash_lock, locks sp */
 int host_info(char *space_name, uint64_t host_id, struct host_status *hs_out);
 
-/* locks spaces_mutex, locks sp */
+/* locks space_hash_lock, locks sp */
 int host_status_set_bit(char *space_name, uint64_t host_id);
 
+/* no locks */
+void setup_host_status_wait(void);
+
+/* locks host_status_mutex */
+void host_status_notify(uint32_t space_id);
+
+/* locks host_status_mutex */
+uint32_t host_status_wait(uint32_t space_id, uint32_t gen, int wait_ms);
+
 /* no locks */
 int test_id_bit(int host_id, char *bitmap);
 
@@ -36,10 +56,13 @@ int test_id_bit(int host_id, char *bitmap);
 void set_id_bit(int host_id, char *bitmap, char *c);
 
 /* locks sp */
-int check_our_lease(struct space *sp, int *check_all, char *check_buf);
+int check_our_lease(struct space *sp, uint64_t *check_ms);
+
+/* locks sp, locks resource_mutex (add_host_event, set_resource_examine), locks host_status_mutex */
+int check_other_leases(struct space *sp, char *buf, int check_hosts);
 
-/* locks resource_mutex (add_host_event), locks resource_mutex (set_resource_examine) */
-void check_other_leases(struct space *sp, char *buf);
+/* locks sp, locks resource_mutex, locks host_status_mutex */
+int lockspace_renew(struct space *sp, uint64_t *due_ms);
 
 /* locks spaces_mutex */
 int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct space **sp_out);
@@ -29,30 +29,62 @@
 #include "log.h"
 
 #define LOG_STR_LEN 512
-static char log_str[LOG_STR_LEN];
 
 static pthread_t thread_handle;
 
+/*
+ * log_mutex/log_cond are only used for the log thread to sleep when the
+ * ring is empty, and for close_logging to stop it.  log_consumed_cond is
+ * used with log_mutex for copy_log_dump to wait for the log thread.
+ * log_dump_mutex protects log_dump, which is written by the log thread
+ * (or by log_level itself when there is no log thread) and copied by
+ * copy_log_dump.
+ */
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_consumed_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t log_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static char log_dump[LOG_DUMP_SIZE];
 static unsigned int log_point;
 static unsigned int log_wrap;
 
+/*
+ * log_ents is a bounded multi-producer, single-consumer ring.  A thread
+ * calling log_level claims the slot at log_head_ent with a compare and
+ * swap, fills it in, and publishes it by setting seq to pos + 1.  The log
+ * thread consumes the slot at log_tail_ent once its seq shows it's been
+ * published, and gives it back to producers by setting seq to
+ * pos + log_num_ents.  Producers never wait for each other or for the log
+ * thread; when the ring is full the message is dropped and counted.  The
+ * last LOG_RESERVED_ENTRIES slots are only used by warnings and errors,
+ * so a burst of debug messages cannot crowd them out.
+ *
+ * The caller formats the message itself (the args may not outlive the
+ * call), but the time stamp prefix is formatted by the log thread from the
+ * time values saved in the entry.
+ */
+
 struct entry {
+	unsigned int seq;
 	int level;
-	char str[LOG_STR_LEN];
+	pid_t tid;
+	uint64_t mono;
+	struct timeval time;
+	char str[LOG_STR_LEN];          /* name and message */
 };
 
-#define LOG_DEFAULT_ENTRIES 4096
+#define LOG_DEFAULT_ENTRIES 4096        /* power of 2 */
+#define LOG_RESERVED_ENTRIES 512
 static struct entry *log_ents;
 static unsigned int log_num_ents = LOG_DEFAULT_ENTRIES;
-static unsigned int log_head_ent; /* add at head */
-static unsigned int log_tail_ent; /* remove from tail */
+static unsigned int log_head_ent;       /* next slot to claim, producers */
+static unsigned int log_tail_ent;       /* next slot to consume, log thread */
 static unsigned int log_dropped;
-static unsigned int log_pending_ents;
+static unsigned int log_thread_sleeping;
+static unsigned int log_dump_waiting;
 static unsigned int log_thread_done;
+static int log_thread_running;
 
 static char logfile_path[PATH_MAX];
 static FILE *logfile_fp;
@@ -62,12 +94,12 @@ extern int log_logfile_use_utc;
 extern int log_syslog_priority;
 extern int log_stderr_priority;
 
-static void _log_save_dump(int level GNUC_UNUSED, int len)
+static void _log_save_dump(const char *str, int len)
 {
 	int i;
 
 	if (len < LOG_DUMP_SIZE - log_point) {
-		memcpy(log_dump+log_point, log_str, len);
+		memcpy(log_dump+log_point, str, len);
 		log_point += len;
 
 		if (log_point == LOG_DUMP_SIZE) {
@@ -78,7 +110,7 @@ static void _log_save_dump(int level GNUC_UNUSED, int len)
 	}
 
 	for (i = 0; i < len; i++) {
-		log_dump[log_point++] = log_str[i];
+		log_dump[log_point++] = str[i];
 
 		if (log_point == LOG_DUMP_SIZE) {
 			log_point = 0;
@@ -87,32 +119,100 @@ static void _log_save_dump(int level GNUC_UNUSED, int len)
 	}
 }
 
-static void _log_save_ent(int level, int len)
+/* returns the length of the line in buf, not including the \0 */
+
+static int format_line(char *buf, struct timeval *cur_time, uint64_t mono,
+		       pid_t tid, const char *str)
+{
+	struct tm time_info;
+	int ret, pos = 0;
+	int len = LOG_STR_LEN - 2; /* leave room for \n\0 */
+
+	if (log_logfile_use_utc)
+		gmtime_r(&cur_time->tv_sec, &time_info);
+	else
+		localtime_r(&cur_time->tv_sec, &time_info);
+
+	ret = strftime(buf + pos, len - pos, "%Y-%m-%d %H:%M:%S ", &time_info);
+	pos += ret;
+
+	ret = snprintf(buf + pos, len - pos, "%llu [%u]: %s",
+		       (unsigned long long)mono, tid, str);
+
+	if (ret >= len - pos)
+		pos = len - 1;
+	else
+		pos += ret;
+
+	buf[pos++] = '\n';
+	buf[pos] = '\0';
+	return pos;
+}
+
+static int _log_save_ent(int level, struct timeval *cur_time, uint64_t mono,
+			 pid_t tid, const char *str, int len)
 {
 	struct entry *e;
+	unsigned int pos, seq, tail;
+	int diff;
 
-	if (!log_ents)
-		return;
+	pos = __atomic_load_n(&log_head_ent, __ATOMIC_RELAXED);
 
-	if (log_pending_ents == log_num_ents) {
-		log_dropped++;
-		return;
-	}
+	while (1) {
+		e = &log_ents[pos & (log_num_ents - 1)];
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+
+		if (!diff && level > LOG_WARNING) {
+			tail = __atomic_load_n(&log_tail_ent, __ATOMIC_ACQUIRE);
+			if (pos - tail >= log_num_ents - LOG_RESERVED_ENTRIES) {
+				__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+				return -1;
+			}
+		}
 
-	e = &log_ents[log_head_ent++];
-	log_head_ent = log_head_ent % log_num_ents;
-	log_pending_ents++;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&log_head_ent, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* full, the log thread hasn't consumed this slot */
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&log_head_ent, __ATOMIC_RELAXED);
+		}
+	}
 
 	e->level = level;
-	memcpy(e->str, log_str, len);
+	e->tid = tid;
+	e->mono = mono;
+	e->time = *cur_time;
+	memcpy(e->str, str, len + 1);
+
+	/* seq_cst for both of these, paired with the log thread setting
+	   log_thread_sleeping then checking seq */
+
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&log_thread_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log_mutex);
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+	}
+	return 0;
 }
 
 /*
  * This log function:
- * 1. formats the log message in the log_str buffer
- * 2. copies log_str into the log_dump circular buffer
- * 3. copies log_str into the log_ents circular array to be written to
- *    logfile and/or syslog (so callers don't block writing messages to files)
+ * 1. formats the name and message in a local buffer
+ * 2. adds it, with the time and thread id, to the log_ents ring, from which
+ *    the log thread copies it into the log_dump circular buffer that can be
+ *    sent over the unix socket, and writes it to logfile, syslog and stderr
+ *    (so callers don't block on each other or on writing messages to files)
+ *
+ * Before the log thread is started (and after it stops), the message is
+ * saved in log_dump and written to stderr directly.
  *
  * N.B. level as "int" instead of "uint32_t" is needed because
  * of comparison with int log_stderr_priority which can be -1.
@@ -122,10 +222,12 @@ void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, con
 {
 	va_list ap;
 	char name[NAME_ID_SIZE + 1];
+	char str[LOG_STR_LEN];
+	char line[LOG_STR_LEN];
 	int ret, pos = 0;
-	int len = LOG_STR_LEN - 2; /* leave room for \n\0 */
+	int len = LOG_STR_LEN - 2;
 	struct timeval cur_time;
-	struct tm time_info;
+	uint64_t mono;
 	pid_t tid;
 
 	if (is_helper)
@@ -168,57 +270,36 @@ void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, con
 			snprintf(name, NAME_ID_SIZE, "%.8s ", name_in);
 	}
 
-	pthread_mutex_lock(&log_mutex);
-
 	gettimeofday(&cur_time, NULL);
-
-	if (log_logfile_use_utc)
-		gmtime_r(&cur_time.tv_sec, &time_info);
-	else
-		localtime_r(&cur_time.tv_sec, &time_info);
-
-	ret = strftime(log_str + pos, len - pos,
-		       "%Y-%m-%d %H:%M:%S ", &time_info);
-	pos += ret;
-
+	mono = monotime();
 	tid = syscall(SYS_gettid);
 
-	ret = snprintf(log_str + pos, len - pos, "%llu [%u]: %s",
-		       (unsigned long long) monotime(), tid, name);
+	ret = snprintf(str, len, "%s", name);
 	pos += ret;
 
 	va_start(ap, fmt);
-	ret = vsnprintf(log_str + pos, len - pos, fmt, ap);
+	ret = vsnprintf(str + pos, len - pos, fmt, ap);
 	va_end(ap);
 
 	if (ret >= len - pos)
 		pos = len - 1;
 	else
 		pos += ret;
+	str[pos] = '\0';
 
-	log_str[pos++] = '\n';
-	log_str[pos++] = '\0';
-
-	/*
-	 * save all messages in circular buffer "log_dump" that can be
-	 * sent over unix socket
-	 */
-
-	_log_save_dump(level, pos - 1);
+	if (__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE)) {
+		_log_save_ent(level, &cur_time, mono, tid, str, pos);
+		return;
+	}
 
-	/*
-	 * save some messages in circular array "log_ents" that a thread
-	 * writes to logfile/syslog
-	 */
+	len = format_line(line, &cur_time, mono, tid, str);
 
-	if (level <= log_logfile_priority || level <= log_syslog_priority)
-		_log_save_ent(level, pos);
+	pthread_mutex_lock(&log_dump_mutex);
+	_log_save_dump(line, len);
+	pthread_mutex_unlock(&log_dump_mutex);
 
 	if (level <= log_stderr_priority)
-		fprintf(stderr, "%s", log_str);
-
-	pthread_cond_signal(&log_cond);
-	pthread_mutex_unlock(&log_mutex);
+		fprintf(stderr, "%s", line);
 }
 
 static void write_entry(int level, char *str)
@@ -238,11 +319,51 @@ static void write_dropped(int level, int num)
 	write_entry(level, str);
 }
 
+static int log_ent_ready(void)
+{
+	struct entry *e = &log_ents[log_tail_ent & (log_num_ents - 1)];
+
+	return __atomic_load_n(&e->seq, __ATOMIC_SEQ_CST) == log_tail_ent + 1;
+}
+
+/*
+ * Wait for the log thread to save the messages that were logged before
+ * this was called, so a dump includes recent messages.  The wait is
+ * limited in case the log thread is stuck writing to the logfile or
+ * syslog.
+ */
+
+static void wait_log_consumed(void)
+{
+	unsigned int head = __atomic_load_n(&log_head_ent, __ATOMIC_ACQUIRE);
+	struct timespec ts;
+
+	if (!__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE))
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+
+	pthread_mutex_lock(&log_mutex);
+	__atomic_add_fetch(&log_dump_waiting, 1, __ATOMIC_SEQ_CST);
+
+	while ((int)(__atomic_load_n(&log_tail_ent, __ATOMIC_SEQ_CST) - head) < 0 &&
+	       !log_thread_done) {
+		if (pthread_cond_timedwait(&log_consumed_cond, &log_mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	__atomic_sub_fetch(&log_dump_waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&log_mutex);
+}
+
 void copy_log_dump(char *buf, int *len)
 {
 	int tail_len;
 
-	pthread_mutex_lock(&log_mutex);
+	wait_log_consumed();
+
+	pthread_mutex_lock(&log_dump_mutex);
 
 	if (!log_wrap && !log_point) {
 		*len = 0;
@@ -256,35 +377,66 @@ void copy_log_dump(char *buf, int *len)
 		memcpy(buf, log_dump, log_point-1);
 		*len = log_point-1;
 	}
-	pthread_mutex_unlock(&log_mutex);
+	pthread_mutex_unlock(&log_dump_mutex);
 }
 
 static void *log_thread_fn(void *arg GNUC_UNUSED)
 {
 	char str[LOG_STR_LEN];
 	struct entry *e;
-	int level, prev_dropped = 0;
+	int level, len, prev_dropped = 0;
 
 	while (1) {
-		pthread_mutex_lock(&log_mutex);
-		while (log_head_ent == log_tail_ent) {
-			if (log_thread_done) {
-				pthread_mutex_unlock(&log_mutex);
-				goto out;
+		if (!log_ent_ready()) {
+			pthread_mutex_lock(&log_mutex);
+			__atomic_store_n(&log_thread_sleeping, 1, __ATOMIC_SEQ_CST);
+			while (!log_ent_ready()) {
+				if (log_thread_done) {
+					pthread_mutex_unlock(&log_mutex);
+					goto out;
+				}
+				pthread_cond_wait(&log_cond, &log_mutex);
 			}
-			pthread_cond_wait(&log_cond, &log_mutex);
+			__atomic_store_n(&log_thread_sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&log_mutex);
 		}
 
-		e = &log_ents[log_tail_ent++];
-		log_tail_ent = log_tail_ent % log_num_ents;
-		log_pending_ents--;
+		e = &log_ents[log_tail_ent & (log_num_ents - 1)];
 
-		memcpy(str, e->str, LOG_STR_LEN);
+		len = format_line(str, &e->time, e->mono, e->tid, e->str);
 		level = e->level;
 
-		prev_dropped = log_dropped;
-		log_dropped = 0;
-		pthread_mutex_unlock(&log_mutex);
+		/* give the slot back to producers */
+		__atomic_store_n(&e->seq, log_tail_ent + log_num_ents, __ATOMIC_RELEASE);
+
+		/*
+		 * save all messages in circular buffer "log_dump" that can be
+		 * sent over unix socket
+		 */
+
+		pthread_mutex_lock(&log_dump_mutex);
+		_log_save_dump(str, len);
+		pthread_mutex_unlock(&log_dump_mutex);
+
+		/* after log_dump, for wait_log_consumed; seq_cst paired with
+		   wait_log_consumed setting log_dump_waiting then checking
+		   log_tail_ent */
+
+		__atomic_store_n(&log_tail_ent, log_tail_ent + 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&log_dump_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&log_mutex);
+			pthread_cond_broadcast(&log_consumed_cond);
+			pthread_mutex_unlock(&log_mutex);
+		}
+
+		if (level <= log_stderr_priority)
+			fprintf(stderr, "%s", str);
+
+		if (level > log_logfile_priority && level > log_syslog_priority)
+			continue;
+
+		prev_dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
 
 		if (prev_dropped) {
 			write_dropped(level, prev_dropped);
@@ -299,6 +451,7 @@ static void *log_thread_fn(void *arg GNUC_UNUSED)
 
 int setup_logging(void)
 {
+	unsigned int i;
 	int fd, rv;
 
 	snprintf(logfile_path, PATH_MAX, "%s/%s", SANLK_LOG_DIR,
@@ -318,23 +471,32 @@ int setup_logging(void)
 	}
 	memset(log_ents, 0, log_num_ents * sizeof(struct entry));
 
+	for (i = 0; i < log_num_ents; i++)
+		log_ents[i].seq = i;
+
 	openlog(DAEMON_NAME, LOG_CONS | LOG_PID, LOG_DAEMON);
 
 	rv = pthread_create(&thread_handle, NULL, log_thread_fn, NULL);
 	if (rv)
 		return -1;
 
+	__atomic_store_n(&log_thread_running, 1, __ATOMIC_RELEASE);
+
 	return 0;
 }
 
 void close_logging(void)
 {
+	/* the log thread writes any remaining entries before exiting */
+
 	pthread_mutex_lock(&log_mutex);
 	log_thread_done = 1;
 	pthread_cond_signal(&log_cond);
 	pthread_mutex_unlock(&log_mutex);
 	pthread_join(thread_handle, NULL);
 
+	__atomic_store_n(&log_thread_running, 0, __ATOMIC_RELEASE);
+
 	pthread_mutex_lock(&log_mutex);
 	closelog();
 	if (logfile_fp) {
@@ -344,4 +506,3 @@ void close_logging(void)
 
 	pthread_mutex_unlock(&log_mutex);
 }
-
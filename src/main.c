@@ -19,7 +19,6 @@
 #include <time.h>
 #include <syslog.h>
 #include <pthread.h>
-#include <poll.h>
 #include <sched.h>
 #include <pwd.h>
 #include <grp.h>
@@ -37,6 +36,8 @@
 #include <sys/resource.h>
 #include <uuid/uuid.h>
 #include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #define EXTERN
 #include "sanlock_internal.h"
@@ -57,17 +58,43 @@
 #include "timeouts.h"
 #include "paxos_lease.h"
 #include "env.h"
+#include "renew.h"
+#include "shmstatus.h"
 
 #define SIGRUNPATH 100 /* anything that's not SIGTERM/SIGKILL */
 
-struct thread_pool {
+/*
+ * Commands that can wait on other hosts or on lease timeouts run in the
+ * slow lane, and all others in the fast lane.  Each lane has its own
+ * workers, so quick commands like inquire, get_lvb and read_resource do
+ * not queue behind acquires waiting for an owner's lease to time out.
+ * An idle slow lane worker takes work from the fast lane when the fast
+ * lane has no free worker, but fast lane workers never take slow work.
+ */
+
+#define POOL_LANE_SLOW 0
+#define POOL_LANE_FAST 1
+#define POOL_LANES 2
+
+struct pool_lane {
 	int num_workers;
 	int max_workers;
 	int free_workers;
-	int quit;
 	struct list_head work_data;
-	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	unsigned int queued;		/* stats */
+	unsigned int queued_max;
+	uint64_t count;
+	uint64_t stolen;
+	uint64_t wait_ms;
+	uint64_t wait_ms_max;
+};
+
+struct thread_pool {
+	int num_workers;
+	int quit;
+	struct pool_lane lanes[POOL_LANES];
+	pthread_mutex_t mutex;
 	pthread_cond_t quit_wait;
 };
 
@@ -80,7 +107,8 @@ int log_stderr_priority = -1; /* -D sets this to LOG_DEBUG */
 #define CLIENT_NALLOC 1024
 static int client_maxi;
 static int client_size = 0;
-static struct pollfd *pollfd;
+static int epoll_fd = -1;
+static uint32_t *client_gen; /* incremented each time a client slot is reused */
 static char command[COMMAND_MAX];
 static int cmd_argc;
 static char **cmd_argv;
@@ -90,14 +118,42 @@ static pthread_mutex_t rand_mutex = PTHREAD_MUTEX_INITIALIZER;
 static const char *run_dir = NULL;
 static int privileged = 1;
 
+/*
+ * Connections are registered with epoll while main_loop should process
+ * them.  The event data holds the ci and the generation of the slot, so an
+ * event that was returned before the slot was freed and reused is ignored.
+ * epoll_ctl takes effect in an epoll_wait that is already running, so
+ * other threads can watch a connection without waking main_loop.
+ */
+
+static void client_watch(int ci, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)client_gen[ci] << 32) | (uint32_t)ci;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+		log_error("client_watch ci %d fd %d error %d", ci, fd, errno);
+}
+
+static void client_ignore(int ci, int fd)
+{
+	if (fd < 0)
+		return;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT)
+		log_error("client_ignore ci %d fd %d error %d", ci, fd, errno);
+}
+
 static void close_helper(void)
 {
+	client_ignore(helper_ci, helper_status_fd);
 	close(helper_kill_fd);
 	close(helper_status_fd);
 	helper_kill_fd = -1;
 	helper_status_fd = -1;
-	pollfd[helper_ci].fd = -1;
-	pollfd[helper_ci].events = 0;
 	helper_ci = -1;
 
 	/* don't set helper_pid = -1 until we've tried waitpid */
@@ -193,31 +249,45 @@ static int client_alloc(void)
 {
 	int i;
 
-	/* pollfd is one element longer as we use an additional element for the
-	 * eventfd notification mechanism */
 	client = malloc(CLIENT_NALLOC * sizeof(struct client));
-	pollfd = malloc((CLIENT_NALLOC+1) * sizeof(struct pollfd));
+	client_gen = malloc(CLIENT_NALLOC * sizeof(uint32_t));
 
-	if (!client || !pollfd) {
-		log_error("can't alloc for client or pollfd array");
+	if (!client || !client_gen) {
+		log_error("can't alloc for client array");
 		return -ENOMEM;
 	}
 
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		log_error("can't create epoll fd %d", errno);
+		return -errno;
+	}
+
 	for (i = 0; i < CLIENT_NALLOC; i++) {
 		memset(&client[i], 0, sizeof(struct client));
-		memset(&pollfd[i], 0, sizeof(struct pollfd));
 
 		pthread_mutex_init(&client[i].mutex, NULL);
 		client[i].fd = -1;
 		client[i].pid = -1;
-
-		pollfd[i].fd = -1;
-		pollfd[i].events = 0;
+		client_gen[i] = 0;
 	}
 	client_size = CLIENT_NALLOC;
+	client_maxi = 0;
 	return 0;
 }
 
+/*
+ * client_add uses the lowest free slot, so after the highest slots are
+ * freed, the loops over the client array can stop at a lower client_maxi.
+ * Only main_loop changes client_maxi.
+ */
+
+static void client_maxi_shrink(void)
+{
+	while (client_maxi > 0 && !client[client_maxi].used)
+		client_maxi--;
+}
+
 static void _client_free(int ci)
 {
 	struct client *cl = &client[ci];
@@ -255,8 +325,11 @@ static void _client_free(int ci)
 		goto out;
 	}
 
-	if (cl->fd != -1)
+	if (cl->fd != -1) {
+		/* make main_loop ignore this connection */
+		client_ignore(ci, cl->fd);
 		close(cl->fd);
+	}
 
 	cl->used = 0;
 	cl->fd = -1;
@@ -279,11 +352,6 @@ static void _client_free(int ci)
 		free(cl->tokens);
 	cl->tokens = NULL;
 	cl->tokens_slots = 0;
-
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
-	pollfd[ci].revents = 0;
  out:
 	return;
 }
@@ -333,9 +401,8 @@ static int client_suspend(int ci)
 
 	cl->suspend = 1;
 
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
+	/* make main_loop ignore this connection */
+	client_ignore(ci, cl->fd);
  out:
 	pthread_mutex_unlock(&cl->mutex);
 
@@ -375,12 +442,8 @@ void client_resume(int ci)
 		log_debug("client_resume ci %d need_free", ci);
 		_client_free(ci);
 	} else {
-		/* make poll() watch this connection */
-		pollfd[ci].fd = cl->fd;
-		pollfd[ci].events = POLLIN;
-
-		/* interrupt any poll() that might already be running */
-		eventfd_write(efd, 1);
+		/* make main_loop watch this connection */
+		client_watch(ci, cl->fd);
 	}
  out:
 	pthread_mutex_unlock(&cl->mutex);
@@ -399,10 +462,10 @@ static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			cl->fd = fd;
 			cl->workfn = workfn;
 			cl->deadfn = deadfn ? deadfn : client_free;
+			client_gen[i]++;
 
-			/* make poll() watch this connection */
-			pollfd[i].fd = fd;
-			pollfd[i].events = POLLIN;
+			/* make main_loop watch this connection */
+			client_watch(i, fd);
 
 			if (i > client_maxi)
 				client_maxi = i;
@@ -520,9 +583,8 @@ void client_pid_dead(int ci)
 	   cl->mutex to set cl->cmd_active to 0, it will see cl->pid_dead is 1
 	   and know they need to release cl->tokens and call client_free */
 
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
+	/* make main_loop ignore this connection */
+	client_ignore(ci, cl->fd);
 
 	pthread_mutex_unlock(&cl->mutex);
 
@@ -542,23 +604,21 @@ void client_pid_dead(int ci)
 	   want to block doing disk lease i/o */
 
 	pthread_mutex_lock(&cl->mutex);
+	release_tokens_async(cl->tokens, cl->tokens_slots);
 	for (i = 0; i < cl->tokens_slots; i++) {
-		if (cl->tokens[i]) {
-			release_token_async(cl->tokens[i]);
+		if (cl->tokens[i])
 			free(cl->tokens[i]);
-		}
 	}
 
 	_client_free(ci);
 	pthread_mutex_unlock(&cl->mutex);
 }
 
-/* At some point we may want to keep a record of each pid using a lockspace
-   in the sp struct to avoid walking through each client's cl->tokens to see if
-   it's using the lockspace.  It should be the uncommon situation where a
-   lockspace renewal fails and we need to walk through all client tokens like
-   this.  i.e. we'd probably not want to optimize for this case at the expense
-   of the more common case where a pid exits, but we do want it to be robust.
+/* Each sp records in sp->clients the clients that have acquired tokens in it
+   (see space_add_client), so that when a lockspace fails, kill_pids and
+   all_pids_dead look at only those clients rather than every client.  An
+   entry is dropped here once the client is found to no longer be using the
+   lockspace; a client that acquires tokens in it again is added again.
 
    The locking is also made a bit ugly by these three routines that need to
    correlate which clients are using which lockspaces.  (client_using_space,
@@ -593,12 +653,19 @@ static int client_using_space(struct client *cl, struct space *sp)
 	return rv;
 }
 
+/* called with spaces_mutex and cl->mutex held */
+
+static void space_drop_client(struct space *sp, int i)
+{
+	sp->clients[i] = sp->clients[--sp->clients_count];
+}
+
 static void kill_pids(struct space *sp)
 {
 	struct client *cl;
 	uint64_t now, last_success;
 	int id_renewal_fail_seconds;
-	int ci, sig;
+	int i, ci, sig;
 	int do_kill, in_grace;
 
 	/*
@@ -623,20 +690,20 @@ static void kill_pids(struct space *sp)
 
 	now = monotime();
 
-	for (ci = 0; ci <= client_maxi; ci++) {
+	for (i = 0; i < sp->clients_count; i++) {
 		do_kill = 0;
 
+		ci = sp->clients[i];
 		cl = &client[ci];
 		pthread_mutex_lock(&cl->mutex);
 
-		if (!cl->used)
-			goto unlock;
-
-		if (cl->pid <= 0)
+		if (!cl->used || cl->pid <= 0) {
+			space_drop_client(sp, i--);
 			goto unlock;
+		}
 
 		/* NB this cl may not be using sp, but trying to
-		   avoid the expensive client_using_space check */
+		   avoid the client_using_space check */
 
 		if (cl->kill_count >= kill_count_max)
 			goto unlock;
@@ -644,8 +711,10 @@ static void kill_pids(struct space *sp)
 		if (cl->kill_count && (now - cl->kill_last < 1))
 			goto unlock;
 
-		if (!client_using_space(cl, sp))
+		if (!client_using_space(cl, sp)) {
+			space_drop_client(sp, i--);
 			goto unlock;
+		}
 
 		cl->kill_last = now;
 		cl->kill_count++;
@@ -696,18 +765,16 @@ static int all_pids_dead(struct space *sp)
 {
 	struct client *cl;
 	int stuck = 0, check = 0;
-	int ci;
+	int i;
 
-	for (ci = 0; ci <= client_maxi; ci++) {
-		cl = &client[ci];
+	for (i = 0; i < sp->clients_count; i++) {
+		cl = &client[sp->clients[i]];
 		pthread_mutex_lock(&cl->mutex);
 
-		if (!cl->used)
-			goto unlock;
-		if (cl->pid <= 0)
-			goto unlock;
-		if (!client_using_space(cl, sp))
+		if (!cl->used || cl->pid <= 0 || !client_using_space(cl, sp)) {
+			space_drop_client(sp, i--);
 			goto unlock;
+		}
 
 		if (cl->kill_count >= kill_count_max)
 			stuck++;
@@ -755,93 +822,138 @@ static int all_pids_dead(struct space *sp)
 	return 1;
 }
 
-static unsigned int time_diff(struct timeval *begin, struct timeval *end)
-{
-	struct timeval result;
-	timersub(end, begin, &result);
-	return (result.tv_sec * 1000) + (result.tv_usec / 1000);
-}
+/*
+ * main_loop checks a lockspace when the deadline in sp->check_ms is
+ * reached, which is when its lease renewal would reach the warning time
+ * (see check_our_lease), or RECOVERY_CHECK_INTERVAL while its pids are
+ * being killed.  The timerfd is set to the earliest deadline.  Anything
+ * else that main_loop needs to act on (a lockspace added or removed, a
+ * corrupted lease, a shutdown) calls main_loop_wake, which causes all
+ * lockspaces to be checked.
+ */
 
 #define STANDARD_CHECK_INTERVAL 1000 /* milliseconds */
 #define RECOVERY_CHECK_INTERVAL  200 /* milliseconds */
 
+#define MAIN_LOOP_EVENTS 64
+#define EFD_EVENT_DATA UINT64_MAX   /* epoll data for efd, not a client */
+#define TFD_EVENT_DATA (UINT64_MAX - 1) /* epoll data for timer_fd */
+
+static int timer_fd = -1;
+
+/* may be called from a signal handler */
+
+void main_loop_wake(void);
+void main_loop_wake(void)
+{
+	if (efd > 0)
+		eventfd_write(efd, 1);
+}
+
+static void set_main_loop_timer(uint64_t due_ms)
+{
+	struct itimerspec its;
+
+	/* a deadline that has passed fires immediately, 0 disarms */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due_ms / 1000;
+	its.it_value.tv_nsec = (due_ms % 1000) * 1000000;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		log_error("main_loop timerfd_settime error %d", errno);
+}
+
 static int main_loop(void)
 {
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
 	struct space *sp, *safe;
-	struct timeval now, last_check;
-	int poll_timeout, check_interval;
-	unsigned int ms;
-	int i, rv, empty, check_all;
-	char *check_buf = NULL;
-	int check_buf_len = 0;
+	struct epoll_event events[MAIN_LOOP_EVENTS];
+	struct epoll_event ev;
+	uint64_t now, next_check, timer_set;
+	uint32_t gen;
+	int i, ci, rv, empty, check_all;
 	uint64_t ebuf;
 
-	gettimeofday(&last_check, NULL);
-	poll_timeout = STANDARD_CHECK_INTERVAL;
-	check_interval = STANDARD_CHECK_INTERVAL;
+	/* as well as the clients, watch the eventfd and timerfd */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = EFD_EVENT_DATA;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, efd, &ev) < 0)
+		log_error("main_loop epoll efd error %d", errno);
 
-	while (1) {
-		/* as well as the clients, check the eventfd */
-		pollfd[client_maxi+1].fd = efd;
-		pollfd[client_maxi+1].events = POLLIN;
+	ev.data.u64 = TFD_EVENT_DATA;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+		log_error("main_loop epoll timer_fd error %d", errno);
 
-		rv = poll(pollfd, client_maxi + 2, poll_timeout);
-		if (rv == -1 && errno == EINTR)
-			continue;
-		if (rv < 0) {
-			/* not sure */
-			log_client(0, 0, "poll err %d", rv);
+	check_all = 1;
+	next_check = 0;
+	timer_set = 0;
+
+	while (1) {
+		if (!check_all) {
+			rv = epoll_wait(epoll_fd, events, MAIN_LOOP_EVENTS, -1);
+			if (rv == -1 && errno == EINTR)
+				continue;
+			if (rv < 0) {
+				/* not sure */
+				log_client(0, 0, "epoll err %d", errno);
+				rv = 0;
+			}
+		} else {
+			rv = 0;
 		}
-		for (i = 0; i <= client_maxi + 1; i++) {
+
+		for (i = 0; i < rv; i++) {
 			/*
-			 * This index for efd has no client array entry.  Its
-			 * only purpose is to wake up this poll loop in which
-			 * case we just clear any data and continue looking
-			 * for other client entries that need processing.
+			 * efd and timer_fd have no client array entry.  They
+			 * wake up this loop to check all lockspaces or the
+			 * ones with an expired deadline.
 			 */
-			if (pollfd[i].fd == efd) {
-				if (pollfd[i].revents & POLLIN) {
-					log_client(i, efd, "efd wake"); /* N.B. i is not a ci */
-					eventfd_read(efd, &ebuf);
-				}
+			if (events[i].data.u64 == EFD_EVENT_DATA) {
+				log_client(-1, efd, "efd wake");
+				eventfd_read(efd, &ebuf);
+				check_all = 1;
 				continue;
 			}
 
-			/*
-			 * FIXME? client_maxi is never reduced so over time we
-			 * end up checking and skipping some number of unused
-			 * client entries here which seems inefficient.
-			 */
-			if (client[i].fd < 0)
+			if (events[i].data.u64 == TFD_EVENT_DATA) {
+				if (read(timer_fd, &ebuf, sizeof(ebuf)) < 0 && errno != EAGAIN)
+					log_error("main_loop timer_fd read error %d", errno);
+				timer_set = 0;
+				continue;
+			}
+
+			ci = (int)(events[i].data.u64 & 0xFFFFFFFF);
+			gen = (uint32_t)(events[i].data.u64 >> 32);
+
+			/* the client was freed (and possibly reused) by the
+			   handling of an earlier event */
+			if (client[ci].fd < 0 || client_gen[ci] != gen)
 				continue;
 
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
+			if (events[i].events & EPOLLIN) {
+				workfn = client[ci].workfn;
 				if (workfn)
-					workfn(i);
+					workfn(ci);
 			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				log_client(i, client[i].fd, "poll dead");
-				deadfn = client[i].deadfn;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				log_client(ci, client[ci].fd, "poll dead");
+				deadfn = client[ci].deadfn;
 				if (deadfn)
-					deadfn(i);
+					deadfn(ci);
 			}
 		}
 
-
-		gettimeofday(&now, NULL);
-		ms = time_diff(&last_check, &now);
-		if (ms < check_interval) {
-			poll_timeout = check_interval - ms;
+		now = monotime_ms();
+		if (!check_all && (!next_check || now < next_check))
 			continue;
-		}
-		last_check = now;
-		check_interval = STANDARD_CHECK_INTERVAL;
+		next_check = 0;
+
+		client_maxi_shrink();
 
 		/*
-		 * check the condition of each lockspace,
+		 * check the condition of each lockspace that is due,
 		 * if pids are being killed, have pids all exited?
 		 * is its host_id being renewed?, if not kill pids
 		 */
@@ -849,6 +961,9 @@ static int main_loop(void)
 		pthread_mutex_lock(&spaces_mutex);
 		list_for_each_entry_safe(sp, safe, &spaces, list) {
 
+			if (!check_all && now < sp->check_ms)
+				goto next;
+
 			if (sp->killing_pids && all_pids_dead(sp)) {
 				/*
 				 * move sp to spaces_rem so main_loop
@@ -859,7 +974,9 @@ static int main_loop(void)
 				sp->thread_stop = 1;
 				deactivate_watchdog(sp);
 				pthread_mutex_unlock(&sp->mutex);
+				space_hash_del(sp);
 				list_move(&sp->list, &spaces_rem);
+				shm_status_set_flags(sp, SANLK_LSF_REM);
 				continue;
 			}
 
@@ -869,26 +986,16 @@ static int main_loop(void)
 				 * levels of severity until they all exit
 				 */
 				kill_pids(sp);
-				check_interval = RECOVERY_CHECK_INTERVAL;
-				continue;
+				sp->check_ms = now + RECOVERY_CHECK_INTERVAL;
+				goto next;
 			}
 
 			/*
-			 * check host_id lease renewal
+			 * check host_id lease renewal, the lockspace thread
+			 * checks the other hosts' leases after each renewal
 			 */
 
-			if (sp->align_size > check_buf_len) {
-				if (check_buf)
-					free(check_buf);
-				check_buf_len = sp->align_size;
-				check_buf = malloc(check_buf_len);
-			}
-			if (check_buf)
-				memset(check_buf, 0, check_buf_len);
-
-			check_all = 0;
-
-			rv = check_our_lease(sp, &check_all, check_buf);
+			rv = check_our_lease(sp, &sp->check_ms);
 			if (rv)
 				sp->renew_fail = 1;
 
@@ -898,13 +1005,21 @@ static int main_loop(void)
 				sp->space_dead = 1;
 				sp->killing_pids = 1;
 				kill_pids(sp);
-				check_interval = RECOVERY_CHECK_INTERVAL;
-
-			} else if (check_all) {
-				check_other_leases(sp, check_buf);
+				sp->check_ms = now + RECOVERY_CHECK_INTERVAL;
+				/* acquires waiting on an owner see shutdown */
+				host_status_notify(sp->space_id);
 			}
+ next:
+			if (!next_check || sp->check_ms < next_check)
+				next_check = sp->check_ms;
 		}
 		empty = list_empty(&spaces);
+		check_all = 0;
+
+		/* free_lockspaces retries until the lockspace is released */
+		if (!list_empty(&spaces_rem) &&
+		    (!next_check || now + RECOVERY_CHECK_INTERVAL < next_check))
+			next_check = now + RECOVERY_CHECK_INTERVAL;
 		pthread_mutex_unlock(&spaces_mutex);
 
 		if (external_shutdown && empty)
@@ -916,14 +1031,15 @@ static int main_loop(void)
 		}
 
 		free_lockspaces(0);
-		rem_resources();
 
-		gettimeofday(&now, NULL);
-		ms = time_diff(&last_check, &now);
-		if (ms < check_interval)
-			poll_timeout = check_interval - ms;
-		else
-			poll_timeout = 1;
+		if (rem_resources() &&
+		    (!next_check || now + STANDARD_CHECK_INTERVAL < next_check))
+			next_check = now + STANDARD_CHECK_INTERVAL;
+
+		if (next_check != timer_set) {
+			set_main_loop_timer(next_check);
+			timer_set = next_check;
+		}
 	}
 
 	free_lockspaces(1);
@@ -933,39 +1049,98 @@ static int main_loop(void)
 	return 0;
 }
 
+static int thread_pool_lane(uint32_t cmd)
+{
+	switch (cmd) {
+	case SM_CMD_ACQUIRE:
+	case SM_CMD_CONVERT:
+	case SM_CMD_ADD_LOCKSPACE:
+	case SM_CMD_REM_LOCKSPACE:
+	case SM_CMD_SHUTDOWN_WAIT:
+	case SM_CMD_ALIGN:
+	case SM_CMD_WRITE_LOCKSPACE:
+	case SM_CMD_WRITE_RESOURCE:
+	case SM_CMD_FORMAT_RINDEX:
+	case SM_CMD_REBUILD_RINDEX:
+	case SM_CMD_UPDATE_RINDEX:
+	case SM_CMD_CREATE_RESOURCE:
+	case SM_CMD_DELETE_RESOURCE:
+		return POOL_LANE_SLOW;
+	default:
+		return POOL_LANE_FAST;
+	};
+}
+
+/* called with pool.mutex held */
+
+static struct cmd_args *thread_pool_get_work(int lane_num)
+{
+	struct pool_lane *lane = &pool.lanes[lane_num];
+	struct cmd_args *ca;
+	uint64_t wait_ms;
+
+	if (list_empty(&lane->work_data)) {
+		if (lane_num != POOL_LANE_SLOW)
+			return NULL;
+		lane = &pool.lanes[POOL_LANE_FAST];
+		if (list_empty(&lane->work_data))
+			return NULL;
+		lane->stolen++;
+	}
+
+	ca = list_first_entry(&lane->work_data, struct cmd_args, list);
+	list_del(&ca->list);
+
+	wait_ms = monotime_ms() - ca->queue_ms;
+	lane->queued--;
+	lane->count++;
+	lane->wait_ms += wait_ms;
+	if (wait_ms > lane->wait_ms_max)
+		lane->wait_ms_max = wait_ms;
+
+	return ca;
+}
+
+#define POOL_WORKER_ARG(lane_num, i) ((void *)(long)(((lane_num) << 16) | (i)))
+
 static void *thread_pool_worker(void *data)
 {
 	struct task task;
 	struct cmd_args *ca;
+	struct pool_lane *lane;
+	int lane_num = (long)data >> 16;
 
 	memset(&task, 0, sizeof(struct task));
 	setup_task_aio(&task, main_task.use_aio, WORKER_AIO_CB_SIZE);
-	snprintf(task.name, NAME_ID_SIZE, "worker%ld", (long)data);
+	snprintf(task.name, NAME_ID_SIZE, "%s%ld",
+		 lane_num == POOL_LANE_SLOW ? "worker" : "fworker",
+		 (long)data & 0xffff);
+
+	lane = &pool.lanes[lane_num];
 
 	pthread_mutex_lock(&pool.mutex);
 
 	while (1) {
-		while (!pool.quit && list_empty(&pool.work_data)) {
-			pool.free_workers++;
-			pthread_cond_wait(&pool.cond, &pool.mutex);
-			pool.free_workers--;
-		}
-
-		while (!list_empty(&pool.work_data)) {
-			ca = list_first_entry(&pool.work_data, struct cmd_args, list);
-			list_del(&ca->list);
+		ca = thread_pool_get_work(lane_num);
+		if (ca) {
 			pthread_mutex_unlock(&pool.mutex);
 
 			call_cmd_thread(&task, ca);
 			free(ca);
 
 			pthread_mutex_lock(&pool.mutex);
+			continue;
 		}
 
 		if (pool.quit)
 			break;
+
+		lane->free_workers++;
+		pthread_cond_wait(&lane->cond, &pool.mutex);
+		lane->free_workers--;
 	}
 
+	lane->num_workers--;
 	pool.num_workers--;
 	if (!pool.num_workers)
 		pthread_cond_signal(&pool.quit_wait);
@@ -977,41 +1152,61 @@ static void *thread_pool_worker(void *data)
 
 static int thread_pool_add_work(struct cmd_args *ca)
 {
+	struct pool_lane *lane;
 	pthread_t th;
+	int lane_num;
 	int rv;
 
+	lane_num = thread_pool_lane(ca->header.cmd);
+	lane = &pool.lanes[lane_num];
+
 	pthread_mutex_lock(&pool.mutex);
 	if (pool.quit) {
 		pthread_mutex_unlock(&pool.mutex);
 		return -1;
 	}
 
-	list_add_tail(&ca->list, &pool.work_data);
+	ca->queue_ms = monotime_ms();
+	list_add_tail(&ca->list, &lane->work_data);
+	lane->queued++;
+	if (lane->queued > lane->queued_max)
+		lane->queued_max = lane->queued;
 
-	if (!pool.free_workers && pool.num_workers < pool.max_workers) {
+	if (!lane->free_workers && lane->num_workers < lane->max_workers) {
 		rv = pthread_create(&th, NULL, thread_pool_worker,
-				    (void *)(long)pool.num_workers);
+				    POOL_WORKER_ARG(lane_num, lane->num_workers));
 		if (rv) {
 			log_error("thread_pool_add_work ci %d error %d", ca->ci_in, rv);
 			list_del(&ca->list);
+			lane->queued--;
 			pthread_mutex_unlock(&pool.mutex);
 			rv = -1;
 			return rv;
 		}
+		lane->num_workers++;
 		pool.num_workers++;
 	}
 
-	pthread_cond_signal(&pool.cond);
+	if (lane->free_workers)
+		pthread_cond_signal(&lane->cond);
+	else if (lane_num == POOL_LANE_FAST &&
+		 lane->num_workers >= lane->max_workers &&
+		 pool.lanes[POOL_LANE_SLOW].free_workers)
+		pthread_cond_signal(&pool.lanes[POOL_LANE_SLOW].cond);
+
 	pthread_mutex_unlock(&pool.mutex);
 	return 0;
 }
 
 static void thread_pool_free(void)
 {
+	int i;
+
 	pthread_mutex_lock(&pool.mutex);
 	pool.quit = 1;
 	if (pool.num_workers > 0) {
-		pthread_cond_broadcast(&pool.cond);
+		for (i = 0; i < POOL_LANES; i++)
+			pthread_cond_broadcast(&pool.lanes[i].cond);
 		pthread_cond_wait(&pool.quit_wait, &pool.mutex);
 	}
 	pthread_mutex_unlock(&pool.mutex);
@@ -1019,26 +1214,38 @@ static void thread_pool_free(void)
 
 static int thread_pool_create(int min_workers, int max_workers)
 {
+	struct pool_lane *lane;
 	pthread_t th;
-	int i, rv = 0;
+	int i, n, rv = 0;
 
 	memset(&pool, 0, sizeof(pool));
-	INIT_LIST_HEAD(&pool.work_data);
 	pthread_mutex_init(&pool.mutex, NULL);
-	pthread_cond_init(&pool.cond, NULL);
 	pthread_cond_init(&pool.quit_wait, NULL);
-	pool.max_workers = max_workers;
 
-	for (i = 0; i < min_workers; i++) {
-		rv = pthread_create(&th, NULL, thread_pool_worker,
-				    (void *)(long)i);
-		if (rv) {
-			log_error("thread_pool_create failed %d", rv);
-			rv = -1;
-			break;
+	for (n = 0; n < POOL_LANES; n++) {
+		lane = &pool.lanes[n];
+		INIT_LIST_HEAD(&lane->work_data);
+		pthread_cond_init(&lane->cond, NULL);
+		lane->max_workers = max_workers;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	for (n = 0; n < POOL_LANES && !rv; n++) {
+		lane = &pool.lanes[n];
+
+		for (i = 0; i < min_workers; i++) {
+			rv = pthread_create(&th, NULL, thread_pool_worker,
+					    POOL_WORKER_ARG(n, i));
+			if (rv) {
+				log_error("thread_pool_create failed %d", rv);
+				rv = -1;
+				break;
+			}
+			lane->num_workers++;
+			pool.num_workers++;
 		}
-		pool.num_workers++;
 	}
+	pthread_mutex_unlock(&pool.mutex);
 
 	if (rv < 0)
 		thread_pool_free();
@@ -1046,6 +1253,40 @@ static int thread_pool_create(int min_workers, int max_workers)
 	return rv;
 }
 
+int print_state_pool(char *str, int len);
+
+int print_state_pool(char *str, int len)
+{
+	static const char *lane_name[POOL_LANES] = { "slow", "fast" };
+	struct pool_lane *lane;
+	int i, pos = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	for (i = 0; i < POOL_LANES && pos < len; i++) {
+		lane = &pool.lanes[i];
+		pos += snprintf(str + pos, len - pos,
+				" pool_%s_workers=%d"
+				" pool_%s_free=%d"
+				" pool_%s_queued=%u"
+				" pool_%s_queued_max=%u"
+				" pool_%s_count=%llu"
+				" pool_%s_stolen=%llu"
+				" pool_%s_wait_ms=%llu"
+				" pool_%s_wait_ms_max=%llu",
+				lane_name[i], lane->num_workers,
+				lane_name[i], lane->free_workers,
+				lane_name[i], lane->queued,
+				lane_name[i], lane->queued_max,
+				lane_name[i], (unsigned long long)lane->count,
+				lane_name[i], (unsigned long long)lane->stolen,
+				lane_name[i], (unsigned long long)lane->wait_ms,
+				lane_name[i], (unsigned long long)lane->wait_ms_max);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+
+	return pos < len ? pos : len;
+}
+
 /*
  * cmd comes from a transient client/fd set up just to pass the cmd,
  * and is not being done on behalf of another registered client/fd.
@@ -1112,7 +1353,7 @@ static void process_cmd_thread_registered(int ci_in, struct sm_header *h_recv)
 		/* lease for another registered client with pid specified by data2 */
 		ci_target = -1;
 
-		for (i = 0; i < client_size; i++) {
+		for (i = 0; i <= client_maxi; i++) {
 			cl = &client[i];
 			pthread_mutex_lock(&cl->mutex);
 			if (cl->pid != h_recv->data2) {
@@ -1422,6 +1663,7 @@ static void sigterm_handler(int sig GNUC_UNUSED,
 			    void *ctx GNUC_UNUSED)
 {
 	external_shutdown = 1;
+	main_loop_wake();
 }
 
 static void setup_priority(void)
@@ -1779,6 +2021,9 @@ static int do_daemon(void)
 
 	setup_uid_gid();
 
+	/* readers fall back to asking the daemon without the status segment */
+	setup_shm_status(run_dir);
+
 	uname(&nodename);
 
 	if (com.io_timeout != DEFAULT_IO_TIMEOUT || com.watchdog_fire_timeout != DEFAULT_WATCHDOG_FIRE_TIMEOUT)
@@ -1798,19 +2043,34 @@ static int do_daemon(void)
 	if (rv < 0)
 		goto out_threads;
 
-	setup_token_manager();
+	rv = setup_token_manager(com.release_threads);
 	if (rv < 0)
 		goto out_threads;
 
-	/* initialize global eventfd for client_resume notification */
+	setup_lockspaces();
+	setup_host_status_wait();
+
+	rv = setup_renew_engine(com.renewal_threads);
+	if (rv < 0)
+		goto out_threads;
+
+	/* initialize global eventfd for main_loop_wake */
 	if ((efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
 		log_error("couldn't create eventfd");
 		goto out_threads;
 	}
 
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer_fd < 0) {
+		log_error("couldn't create timerfd");
+		goto out_threads;
+	}
+
 	main_loop();
 
 	close_token_manager();
+	close_renew_engine();
+	close_shm_status();
 
  out_threads:
 	thread_pool_free();
@@ -2114,7 +2374,7 @@ static void print_usage(void)
 	printf("                (use -1 for none)\n");
 	printf("  -U <uid>      user id\n");
 	printf("  -G <gid>      group id\n");
-	printf("  -t <num>      max worker threads (%d)\n", DEFAULT_MAX_WORKER_THREADS);
+	printf("  -t <num>      max worker threads per lane (%d)\n", DEFAULT_MAX_WORKER_THREADS);
 	printf("  -g <sec>      seconds for graceful recovery (%d)\n", DEFAULT_GRACE_SEC);
 	printf("  -o <sec>      io timeout (%d)\n", DEFAULT_IO_TIMEOUT);
 	printf("  -w 0|1        use watchdog through wdmd (%d)\n", DEFAULT_USE_WATCHDOG);
@@ -2124,6 +2384,7 @@ static void print_usage(void)
 	printf("                (default: 6 * io_timeout)\n");
 	printf("  -e <str>      local host name used in delta leases\n");
 	printf("                (default: generate new uuid)\n");
+	printf("  -a 1|2        disk io with libaio (1) or io_uring (2) (%d)\n", DEFAULT_USE_AIO);
 	printf("\n");
 	printf("sanlock client <action> [options]\n");
 	printf("sanlock client status [-D] [-o p|s]\n");
@@ -2153,7 +2414,7 @@ static void print_usage(void)
 	printf("sanlock client update -x RINDEX -e <resource_name>[:<offset>] [-z 0|1]\n");
 	printf("sanlock client rebuild -x RINDEX\n");
 	printf("\n");
-	printf("sanlock direct <action> [-a 0|1] [-o 0|1] [-Z 512|4096 -A 1M|2M|4M|8M]\n");
+	printf("sanlock direct <action> [-a 0|1|2] [-o 0|1] [-Z 512|4096 -A 1M|2M|4M|8M]\n");
 	printf("sanlock direct init -s LOCKSPACE | -r RESOURCE [-Z 512|4096 -A 1M|2M|4M|8M]\n");
 	printf("sanlock direct read_leader -s LOCKSPACE | -r RESOURCE\n");
 	printf("sanlock direct dump <path>[:<offset>[:<size>]]\n");
@@ -2414,8 +2675,8 @@ static int read_command_line(int argc, char *argv[])
 		case 'a':
 			com.all = atoi(optionarg);
 			com.aio_arg = atoi(optionarg);
-			if (com.aio_arg && com.aio_arg != 1)
-				com.aio_arg = 1;
+			if (com.aio_arg < USE_AIO_SYNC || com.aio_arg > USE_AIO_URING)
+				com.aio_arg = USE_AIO_LINUX;
 			break;
 		case 't':
 			com.max_worker_threads = atoi(optionarg);
@@ -2867,6 +3128,11 @@ static void read_config_file(void)
 			com.renewal_read_extend_sec_set = 1;
 			com.renewal_read_extend_sec = val;
 
+		} else if (!strcmp(str, "renewal_full_scan_sec")) {
+			get_val_int(line, &val);
+			if (val >= 0)
+				com.renewal_full_scan_sec = val;
+
 		} else if (!strcmp(str, "write_init_io_timeout")) {
 			get_val_int(line, &val);
 			if (val > 0)
@@ -2936,6 +3202,18 @@ static void read_config_file(void)
 				val = DEFAULT_MIN_WORKER_THREADS;
 			com.max_worker_threads = val;
 
+		} else if (!strcmp(str, "renewal_threads")) {
+			get_val_int(line, &val);
+			if (val < 1)
+				val = 1;
+			com.renewal_threads = val;
+
+		} else if (!strcmp(str, "release_threads")) {
+			get_val_int(line, &val);
+			if (val < 1)
+				val = 1;
+			com.release_threads = val;
+
 		}
 	}
 
@@ -3920,6 +4198,8 @@ int main(int argc, char *argv[])
 	com.mlock_level = DEFAULT_MLOCK_LEVEL;
 	com.names_log_priority = LOG_WARNING;
 	com.max_worker_threads = DEFAULT_MAX_WORKER_THREADS;
+	com.renewal_threads = DEFAULT_RENEWAL_THREADS;
+	com.release_threads = DEFAULT_RELEASE_THREADS;
 	com.io_timeout = DEFAULT_IO_TIMEOUT;
 	com.write_init_io_timeout = DEFAULT_WRITE_INIT_IO_TIMEOUT;
 	com.aio_arg = DEFAULT_USE_AIO;
@@ -3928,6 +4208,7 @@ int main(int argc, char *argv[])
 	com.quiet_fail = DEFAULT_QUIET_FAIL;
 	com.renewal_read_extend_sec_set = 0;
 	com.renewal_read_extend_sec = 0;
+	com.renewal_full_scan_sec = DEFAULT_RENEWAL_FULL_SCAN_SEC;
 	com.renewal_history_size = DEFAULT_RENEWAL_HISTORY_SIZE;
 	com.paxos_debug_all = 0;
 	com.max_sectors_kb_ignore = DEFAULT_MAX_SECTORS_KB_IGNORE;
@@ -109,81 +109,28 @@ int paxos_lease_request_write(struct task *task, struct token *token,
 	return SANLK_OK;
 }
 
-static int write_dblock(struct task *task,
-		        struct token *token,
-			struct sync_disk *disk,
-			uint64_t host_id,
-			struct paxos_dblock *pd);
-
-int paxos_erase_dblock(struct task *task,
-		       struct token *token,
-		       uint64_t host_id)
-{
-	struct paxos_dblock dblock_end;
-	int num_disks = token->r.num_disks;
-	int num_writes = 0;
-	int d, rv, error = -1;
-
-	memset(&dblock_end, 0, sizeof(struct paxos_dblock));
-
-	for (d = 0; d < num_disks; d++) {
-		rv = write_dblock(task, token, &token->disks[d], host_id, &dblock_end);
-		if (rv < 0) {
-			error = rv;
-			continue;
-		}
-		num_writes++;
-	}
-
-	if (!majority_disks(num_disks, num_writes))
-		return error;
-	return SANLK_OK;
-}
-
 /*
- * Write a combined dblock and mblock.  This is an odd case that doesn't fit
- * well with the way the code has been written.  It's used when we want to
- * convert sh to ex, which requires acquiring the lease owner, but we don't
- * want to clobber our SHARED mblock by writing a plain dblock in the process
- * in case there's a problem with the acquiring, we don't want to loose our
- * shared mode lease.
+ * Copy a dblock in ondisk format into a zeroed buffer that is large enough
+ * to hold the dblock and the mode block that follows it.
+ *
+ * T_WRITE_DBLOCK_MBLOCK_SH is an odd case that doesn't fit well with the way
+ * the code has been written.  It's used when we want to convert sh to ex,
+ * which requires acquiring the lease owner, but we don't want to clobber our
+ * SHARED mblock by writing a plain dblock in the process in case there's a
+ * problem with the acquiring, we don't want to loose our shared mode lease.
+ * So a combined dblock and mblock is written.
  *
  * NB. this assumes the only mblock flag we want is MBLOCK_SHARED and that
  * the generation we want is token->host_generation.  This is currently
  * the case, but could change in the future.
  */
 
-static int write_dblock_mblock_sh(struct task *task,
-			          struct token *token,
-			          struct sync_disk *disk,
-			          uint64_t host_id,
-			          struct paxos_dblock *pd)
+static void dblock_to_iobuf(struct token *token, struct paxos_dblock *pd, char *iobuf)
 {
 	struct paxos_dblock pd_end;
 	struct mode_block mb;
 	struct mode_block mb_end;
-	char *iobuf, **p_iobuf;
-	uint64_t offset;
 	uint32_t checksum;
-	int iobuf_len, rv, sector_size;
-
-	memset(&mb, 0, sizeof(mb));
-	mb.flags = MBLOCK_SHARED;
-	mb.generation = token->host_generation;
-
-	sector_size = token->sector_size;
-
-	iobuf_len = sector_size;
-	if (!iobuf_len)
-		return -EINVAL;
-
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
-	if (rv)
-		return -ENOMEM;
-
-	offset = disk->offset + ((2 + host_id - 1) * sector_size);
 
 	paxos_dblock_out(pd, &pd_end);
 
@@ -194,78 +141,48 @@ static int write_dblock_mblock_sh(struct task *task,
 	pd->checksum = checksum;
 	pd_end.checksum = cpu_to_le32(checksum);
 
-	mode_block_out(&mb, &mb_end);
-
 	memcpy(iobuf, (char *)&pd_end, sizeof(struct paxos_dblock));
-	memcpy(iobuf + MBLOCK_OFFSET, (char *)&mb_end, sizeof(struct mode_block));
 
-	rv = write_iobuf(disk->fd, offset, iobuf, iobuf_len, task, token->io_timeout, NULL);
+	if (!(token->flags & T_WRITE_DBLOCK_MBLOCK_SH))
+		return;
 
-	if (rv < 0) {
-		log_errot(token, "write_dblock_mblock_sh host_id %llu gen %llu rv %d",
-			  (unsigned long long)host_id,
-			  (unsigned long long)token->host_generation,
-			  rv);
-	}
+	memset(&mb, 0, sizeof(mb));
+	mb.flags = MBLOCK_SHARED;
+	mb.generation = token->host_generation;
 
-	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
-	return rv;
+	mode_block_out(&mb, &mb_end);
+
+	memcpy(iobuf + MBLOCK_OFFSET, (char *)&mb_end, sizeof(struct mode_block));
 }
 
-static int write_dblock(struct task *task,
-		        struct token *token,
-			struct sync_disk *disk,
-			uint64_t host_id,
-			struct paxos_dblock *pd)
+int paxos_erase_dblock(struct task *task,
+		       struct token *token,
+		       uint64_t host_id)
 {
-	struct paxos_dblock pd_end;
-	uint32_t checksum;
-	int rv;
-
-	if (token->flags & T_WRITE_DBLOCK_MBLOCK_SH) {
-		/* special case to preserve our SH mode block within the dblock */
-		return write_dblock_mblock_sh(task, token, disk, host_id, pd);
-	}
-
-	/* 1 leader block + 1 request block;
-	   host_id N is block offset N-1 */
-
-	paxos_dblock_out(pd, &pd_end);
-
-	/*
-	 * N.B. must compute checksum after the data has been byte swapped.
-	 */
-	checksum = dblock_checksum(&pd_end);
-	pd->checksum = checksum;
-	pd_end.checksum = cpu_to_le32(checksum);
+	struct paxos_dblock dblock;
+	char data[MBLOCK_OFFSET + sizeof(struct mode_block)];
+	int results[SANLK_MAX_DISKS];
+	int num_disks = token->r.num_disks;
+	int num_writes;
+	int d, error = -1;
 
-	rv = write_sector(disk, token->sector_size, 2 + host_id - 1, (char *)&pd_end, sizeof(struct paxos_dblock),
-			  task, token->io_timeout, "dblock");
-	return rv;
-}
+	memset(&dblock, 0, sizeof(struct paxos_dblock));
+	memset(data, 0, sizeof(data));
 
-static int write_leader(struct task *task,
-		        struct token *token,
-			struct sync_disk *disk,
-			struct leader_record *lr)
-{
-	struct leader_record lr_end;
-	uint32_t checksum;
-	int rv;
+	dblock_to_iobuf(token, &dblock, data);
 
-	leader_record_out(lr, &lr_end);
+	num_writes = write_sector_disks(token->disks, num_disks, token->sector_size,
+					2 + host_id - 1, data, sizeof(data),
+					task, token->io_timeout, "dblock", results);
 
-	/*
-	 * N.B. must compute checksum after the data has been byte swapped.
-	 */
-	checksum = leader_checksum(&lr_end);
-	lr->checksum = checksum;
-	lr_end.checksum = cpu_to_le32(checksum);
+	for (d = 0; d < num_disks; d++) {
+		if (results[d] < 0)
+			error = results[d];
+	}
 
-	rv = write_sector(disk, token->sector_size, 0, (char *)&lr_end, sizeof(struct leader_record),
-			  task, token->io_timeout, "leader");
-	return rv;
+	if (!majority_disks(num_disks, num_writes))
+		return error;
+	return SANLK_OK;
 }
 
 /*
@@ -450,224 +367,409 @@ static int verify_dblock(struct token *token, struct paxos_dblock *pd, uint32_t
  *                                           host1 fail
  */
 
-static int run_ballot(struct task *task, struct token *token, uint32_t flags,
-		      int num_hosts, uint64_t next_lver, uint64_t our_mbal,
-		      struct paxos_dblock *dblock_out)
-{
+/*
+ * Check the dblocks read from one disk during a ballot phase.  Returns
+ * SANLK_DBLOCK_LVER or SANLK_DBLOCK_MBAL if the ballot must be aborted.
+ * In phase 1, bs->bk_max is updated with the dblock having the largest bal.
+ */
+
+struct ballot_state {
 	char bk_debug[BK_DEBUG_SIZE];
-	char bk_str[BK_STR_SIZE];
 	int bk_debug_count;
-	struct paxos_dblock dblock;
-	struct paxos_dblock bk_in;
 	struct paxos_dblock bk_max;
+	int q_max;
+};
+
+static int check_ballot_disk(struct token *token, uint32_t flags, int phase,
+			     int num_hosts, uint64_t next_lver, char *iobuf,
+			     struct paxos_dblock *dblock, struct ballot_state *bs)
+{
+	char bk_str[BK_STR_SIZE];
+	struct paxos_dblock bk_in;
 	struct paxos_dblock *bk_end;
 	struct paxos_dblock *bk;
-	struct sync_disk *disk;
-	char *iobuf[SANLK_MAX_DISKS];
-	char **p_iobuf[SANLK_MAX_DISKS];
 	uint32_t checksum;
-	int num_disks = token->r.num_disks;
-	int num_writes, num_reads;
 	int sector_size = token->sector_size;
-	int sector_count;
-	int iobuf_len;
-	int phase2 = 0;
-	int d, q, rv = 0;
-	int q_max = -1;
-	int error;
+	int q, rv;
 
-	sector_count = roundup_power_of_two(num_hosts + 2);
+	for (q = 0; q < num_hosts; q++) {
+		bk_end = (struct paxos_dblock *)(iobuf + ((2 + q)*sector_size));
 
-	iobuf_len = sector_count * sector_size;
+		checksum = dblock_checksum(bk_end);
 
-	if (!iobuf_len)
-		return -EINVAL;
+		paxos_dblock_in(bk_end, &bk_in);
+		bk = &bk_in;
 
-	for (d = 0; d < num_disks; d++) {
-		p_iobuf[d] = &iobuf[d];
+		if (bk->mbal && ((flags & PAXOS_ACQUIRE_DEBUG_ALL) || (bk->lver >= dblock->lver))) {
+			if (bs->bk_debug_count >= BK_DEBUG_COUNT) {
+				log_token(token, "ballot %llu phase%d read %s",
+					  (unsigned long long)next_lver, phase, bs->bk_debug);
+				memset(bs->bk_debug, 0, sizeof(bs->bk_debug));
+				bs->bk_debug_count = 0;
+			}
 
-		rv = posix_memalign((void *)p_iobuf[d], getpagesize(), iobuf_len);
-		if (rv)
-			return rv;
-	}
+			memset(bk_str, 0, sizeof(bk_str));
+			snprintf(bk_str, BK_STR_SIZE, "%d:%llu:%llu:%llu:%llu:%llu:%llu:%x,", q,
+				 (unsigned long long)bk->mbal,
+				 (unsigned long long)bk->bal,
+				 (unsigned long long)bk->inp,
+				 (unsigned long long)bk->inp2,
+				 (unsigned long long)bk->inp3,
+				 (unsigned long long)bk->lver,
+				 bk->flags);
+			bk_str[BK_STR_SIZE-1] = '\0';
+			strncat(bs->bk_debug, bk_str, BK_STR_SIZE-1);
+			bs->bk_debug_count++;
+		}
 
+		rv = verify_dblock(token, bk, checksum);
+		if (rv < 0)
+			continue;
 
-	/*
-	 * phase 1
-	 *
-	 * "For each disk d, it tries first to write dblock[p] to disk[d][p]
-	 * and then to read disk[d][q] for all other processors q.  It aborts
-	 * the ballot if, for any d and q, it finds disk[d][q].mbal >
-	 * dblock[p].mbal. The phase completes when p has written and read a
-	 * majority of the disks, without reading any block whose mbal
-	 * component is greater than dblock[p].mbal."
-	 */
+		if (phase == 1)
+			check_mode_block(token, next_lver, q, (char *)bk_end);
 
-	log_token(token, "ballot %llu phase1 write mbal %llu",
-		  (unsigned long long)next_lver,
-		  (unsigned long long)our_mbal);
+		if (bk->lver < dblock->lver)
+			continue;
 
-	memset(&dblock, 0, sizeof(struct paxos_dblock));
-	dblock.mbal = our_mbal;
-	dblock.lver = next_lver;
-	dblock.checksum = 0; /* set after paxos_dblock_out */
+		if (bk->lver > dblock->lver) {
+			/*
+			 * In phase 2, this happens when we choose another host's bk,
+			 * that host acquires the lease itself, releases it, and
+			 * reacquires it with a new lver, all before we get here, at
+			 * which point we see the larger lver.  I believe case this
+			 * would always also be caught the the bk->mbal > dblock.mbal
+			 * condition below.
+			 */
+			log_warnt(token, "ballot %llu abort%d larger lver in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
+				  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
+				  (unsigned long long)next_lver, phase, q,
+				  (unsigned long long)bk->mbal,
+				  (unsigned long long)bk->bal,
+				  (unsigned long long)bk->inp,
+				  (unsigned long long)bk->inp2,
+				  (unsigned long long)bk->inp3,
+				  (unsigned long long)bk->lver,
+				  (unsigned long long)dblock->mbal,
+				  (unsigned long long)dblock->bal,
+				  (unsigned long long)dblock->inp,
+				  (unsigned long long)dblock->inp2,
+				  (unsigned long long)dblock->inp3,
+				  (unsigned long long)dblock->lver);
+
+			log_token(token, "ballot %llu phase%d read %s",
+				  (unsigned long long)next_lver, phase, bs->bk_debug);
+
+			return SANLK_DBLOCK_LVER;
+		}
 
-	memset(&bk_max, 0, sizeof(struct paxos_dblock));
+		/* see "It aborts the ballot" in comment above */
+
+		if (bk->mbal > dblock->mbal) {
+			log_warnt(token, "ballot %llu abort%d larger mbal in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
+				  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
+				  (unsigned long long)next_lver, phase, q,
+				  (unsigned long long)bk->mbal,
+				  (unsigned long long)bk->bal,
+				  (unsigned long long)bk->inp,
+				  (unsigned long long)bk->inp2,
+				  (unsigned long long)bk->inp3,
+				  (unsigned long long)bk->lver,
+				  (unsigned long long)dblock->mbal,
+				  (unsigned long long)dblock->bal,
+				  (unsigned long long)dblock->inp,
+				  (unsigned long long)dblock->inp2,
+				  (unsigned long long)dblock->inp3,
+				  (unsigned long long)dblock->lver);
+
+			log_token(token, "ballot %llu phase%d read %s",
+				  (unsigned long long)next_lver, phase, bs->bk_debug);
+
+			return SANLK_DBLOCK_MBAL;
+		}
 
-	num_writes = 0;
+		if (phase != 1)
+			continue;
 
-	for (d = 0; d < num_disks; d++) {
-		/* acquire io: write 1 */
-		rv = write_dblock(task, token, &token->disks[d], token->host_id, &dblock);
-		if (rv < 0)
+		/* see choosing inp for phase 2 in comment below */
+
+		if (!bk->inp)
 			continue;
-		num_writes++;
-	}
 
-	if (!majority_disks(num_disks, num_writes)) {
-		log_errot(token, "ballot %llu dblock write error %d",
-			  (unsigned long long)next_lver, rv);
-		error = SANLK_DBLOCK_WRITE;
-		goto out;
+		if (!bk->bal) {
+			log_errot(token, "ballot %llu zero bal inp[%d] %llu",
+				  (unsigned long long)next_lver, q,
+				  (unsigned long long)bk->inp);
+			continue;
+		}
+
+		if (bk->bal > bs->bk_max.bal) {
+			bs->bk_max = *bk;
+			bs->q_max = q;
+		}
 	}
 
-	memset(bk_debug, 0, sizeof(bk_debug));
-	bk_debug_count = 0;
+	return SANLK_OK;
+}
 
-	num_reads = 0;
+/*
+ * Run one phase of a ballot: write our dblock to each disk and then read
+ * the dblocks of all hosts from that disk.  The io to all disks is
+ * outstanding at once, and a disk's read is started as soon as our write
+ * to it completes.  The phase is done once a majority of disks have been
+ * written and read, so a slow replica outside the majority doesn't delay
+ * it.  Reads still outstanding at that point are abandoned, but our
+ * writes are waited for (up to the io timeout) so that one cannot land
+ * on top of a later write of the same dblock.
+ *
+ * iobuf[d] is NULL on return if the read buffer for disk d could not be
+ * freed because its io is still outstanding.
+ */
+
+static int run_ballot_phase(struct task *task, struct token *token, uint32_t flags,
+			    int phase, int num_hosts, uint64_t next_lver,
+			    struct paxos_dblock *dblock, char **iobuf, int iobuf_len,
+			    struct ballot_state *bs)
+{
+	struct iobuf_req wr[SANLK_MAX_DISKS];
+	struct iobuf_req rd[SANLK_MAX_DISKS];
+	struct iobuf_req *reqs[2 * SANLK_MAX_DISKS];
+	struct iobuf_req *submit[SANLK_MAX_DISKS];
+	char *wbuf[SANLK_MAX_DISKS];
+	struct sync_disk *disk;
+	int num_disks = token->r.num_disks;
+	int sector_size = token->sector_size;
+	int num_reads = 0, write_errors = 0, read_errors = 0;
+	int num_submit, pending, done, decided = 0;
+	int error = SANLK_OK;
+	int d, rv = 0;
+
+	memset(wr, 0, sizeof(wr));
+	memset(rd, 0, sizeof(rd));
+	memset(wbuf, 0, sizeof(wbuf));
+	memset(bs->bk_debug, 0, sizeof(bs->bk_debug));
+	bs->bk_debug_count = 0;
 
 	for (d = 0; d < num_disks; d++) {
-		disk = &token->disks[d];
+		reqs[d] = &wr[d];
+		reqs[num_disks + d] = &rd[d];
+	}
 
-		if (!iobuf[d])
-			continue;
-		memset(iobuf[d], 0, iobuf_len);
+	for (d = 0; d < num_disks; d++) {
+		disk = &token->disks[d];
 
-		/* acquire io: read 2 */
-		rv = read_iobuf(disk->fd, disk->offset, iobuf[d], iobuf_len, task, token->io_timeout, NULL);
-		if (rv == SANLK_AIO_TIMEOUT)
+		/* the read buffer is lost if the previous phase's read timed out */
+		if (!iobuf[d] && posix_memalign((void *)&iobuf[d], getpagesize(), iobuf_len)) {
 			iobuf[d] = NULL;
-		if (rv < 0)
-			continue;
-		num_reads++;
+			error = -ENOMEM;
+			goto out;
+		}
+
+		if (posix_memalign((void *)&wbuf[d], getpagesize(), sector_size)) {
+			wbuf[d] = NULL;
+			error = -ENOMEM;
+			goto out;
+		}
+		memset(wbuf[d], 0, sector_size);
+		dblock_to_iobuf(token, dblock, wbuf[d]);
 
-		for (q = 0; q < num_hosts; q++) {
-			bk_end = (struct paxos_dblock *)(iobuf[d] + ((2 + q)*sector_size));
+		/* 1 leader block + 1 request block; host_id N is block offset N-1 */
+		wr[d].fd = disk->fd;
+		wr[d].cmd = IO_CMD_PWRITE;
+		wr[d].buf = wbuf[d];
+		wr[d].len = sector_size;
+		wr[d].offset = disk->offset + ((2 + token->host_id - 1) * sector_size);
+	}
+
+	/* acquire io: write 1 (phase1), write 2 (phase2) */
+	submit_iobufs(task, reqs, num_disks, token->io_timeout);
+
+	while (1) {
+		num_submit = 0;
+
+		for (d = 0; d < num_disks; d++) {
+			disk = &token->disks[d];
 
-			checksum = dblock_checksum(bk_end);
+			if (wr[d].state == IOBUF_DONE) {
+				wr[d].state = IOBUF_IDLE;
 
-			paxos_dblock_in(bk_end, &bk_in);
-			bk = &bk_in;
+				/* the buf now belongs to the unreaped aio */
+				if (wr[d].rv == SANLK_AIO_TIMEOUT)
+					wbuf[d] = NULL;
 
-			if (bk_in.mbal && ((flags & PAXOS_ACQUIRE_DEBUG_ALL) || (bk_in.lver >= dblock.lver))) {
-				if (bk_debug_count >= BK_DEBUG_COUNT) {
-					log_token(token, "ballot %llu phase1 read %s",
-						  (unsigned long long)next_lver, bk_debug);
-					memset(bk_debug, 0, sizeof(bk_debug));
-					bk_debug_count = 0;
+				if (wr[d].rv < 0) {
+					log_errot(token, "ballot %llu phase%d write error %d %s",
+						  (unsigned long long)next_lver, phase, wr[d].rv, disk->path);
+					rv = wr[d].rv;
+					write_errors++;
+					continue;
 				}
 
-				memset(bk_str, 0, sizeof(bk_str));
-				snprintf(bk_str, BK_STR_SIZE, "%d:%llu:%llu:%llu:%llu:%llu:%llu:%x,", q,
-					 (unsigned long long)bk_in.mbal,
-					 (unsigned long long)bk_in.bal,
-					 (unsigned long long)bk_in.inp,
-					 (unsigned long long)bk_in.inp2,
-					 (unsigned long long)bk_in.inp3,
-					 (unsigned long long)bk_in.lver,
-					 bk_in.flags);
-				bk_str[BK_STR_SIZE-1] = '\0';
-				strncat(bk_debug, bk_str, BK_STR_SIZE-1);
-				bk_debug_count++;
+				if (decided)
+					continue;
+
+				memset(iobuf[d], 0, iobuf_len);
+
+				rd[d].fd = disk->fd;
+				rd[d].cmd = IO_CMD_PREAD;
+				rd[d].buf = iobuf[d];
+				rd[d].len = iobuf_len;
+				rd[d].offset = disk->offset;
+				submit[num_submit++] = &rd[d];
 			}
 
-			rv = verify_dblock(token, bk, checksum);
-			if (rv < 0)
-				continue;
+			if (rd[d].state == IOBUF_DONE) {
+				rd[d].state = IOBUF_IDLE;
 
-			check_mode_block(token, next_lver, q, (char *)bk_end);
+				if (rd[d].rv == SANLK_AIO_TIMEOUT)
+					iobuf[d] = NULL;
 
-			if (bk->lver < dblock.lver)
-				continue;
-
-			if (bk->lver > dblock.lver) {
-				log_warnt(token, "ballot %llu abort1 larger lver in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
-					  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
-					  (unsigned long long)next_lver, q,
-					  (unsigned long long)bk->mbal,
-					  (unsigned long long)bk->bal,
-					  (unsigned long long)bk->inp,
-					  (unsigned long long)bk->inp2,
-					  (unsigned long long)bk->inp3,
-					  (unsigned long long)bk->lver,
-					  (unsigned long long)dblock.mbal,
-					  (unsigned long long)dblock.bal,
-					  (unsigned long long)dblock.inp,
-					  (unsigned long long)dblock.inp2,
-					  (unsigned long long)dblock.inp3,
-					  (unsigned long long)dblock.lver);
-
-				log_token(token, "ballot %llu phase1 read %s",
-					  (unsigned long long)next_lver, bk_debug);
-
-				error = SANLK_DBLOCK_LVER;
-				goto out;
+				if (rd[d].rv < 0) {
+					if (!decided)
+						rv = rd[d].rv;
+					read_errors++;
+					continue;
+				}
+
+				if (decided)
+					continue;
+
+				num_reads++;
+
+				error = check_ballot_disk(token, flags, phase, num_hosts,
+							  next_lver, iobuf[d], dblock, bs);
+				if (error < 0)
+					decided = 1;
 			}
+		}
 
-			/* see "It aborts the ballot" in comment above */
-
-			if (bk->mbal > dblock.mbal) {
-				log_warnt(token, "ballot %llu abort1 larger mbal in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
-					  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
-					  (unsigned long long)next_lver, q,
-					  (unsigned long long)bk->mbal,
-					  (unsigned long long)bk->bal,
-					  (unsigned long long)bk->inp,
-					  (unsigned long long)bk->inp2,
-					  (unsigned long long)bk->inp3,
-					  (unsigned long long)bk->lver,
-					  (unsigned long long)dblock.mbal,
-					  (unsigned long long)dblock.bal,
-					  (unsigned long long)dblock.inp,
-					  (unsigned long long)dblock.inp2,
-					  (unsigned long long)dblock.inp3,
-					  (unsigned long long)dblock.lver);
-
-				log_token(token, "ballot %llu phase1 read %s",
-					  (unsigned long long)next_lver, bk_debug);
-
-				error = SANLK_DBLOCK_MBAL;
-				goto out;
+		/* acquire io: read 2 (phase1), read 3 (phase2) */
+		if (num_submit) {
+			submit_iobufs(task, submit, num_submit, token->io_timeout);
+			continue;
+		}
+
+		if (!decided) {
+			if (majority_disks(num_disks, num_reads)) {
+				decided = 1;
+			} else if (!majority_disks(num_disks, num_disks - write_errors)) {
+				decided = 1;
+				error = SANLK_DBLOCK_WRITE;
+			} else if (!majority_disks(num_disks, num_disks - write_errors - read_errors)) {
+				decided = 1;
+				error = SANLK_DBLOCK_READ;
 			}
+		}
 
-			/* see choosing inp for phase 2 in comment below */
+		pending = 0;
+		done = 0;
 
-			if (!bk->inp)
-				continue;
+		for (d = 0; d < 2 * num_disks; d++) {
+			if (decided && (reqs[d]->cmd == IO_CMD_PREAD))
+				abandon_iobuf(task, reqs[d]);
 
-			if (!bk->bal) {
-				log_errot(token, "ballot %llu zero bal inp[%d] %llu",
-					  (unsigned long long)next_lver, q,
-					  (unsigned long long)bk->inp);
-				continue;
-			}
+			if (reqs[d]->state == IOBUF_PENDING)
+				pending++;
+			else if (reqs[d]->state == IOBUF_DONE)
+				done++;
+		}
 
-			if (bk->bal > bk_max.bal) {
-				bk_max = *bk;
-				q_max = q;
-			}
+		if (done)
+			continue;
+		if (!pending)
+			break;
+
+		reap_iobufs(task, reqs, 2 * num_disks);
+	}
+
+	if (!decided)
+		error = SANLK_DBLOCK_READ;
+
+	if (error == SANLK_DBLOCK_WRITE) {
+		log_errot(token, "ballot %llu %s error %d",
+			  (unsigned long long)next_lver,
+			  (phase == 1) ? "dblock write" : "our dblock write2", rv);
+	} else if ((error == SANLK_OK) || (error == SANLK_DBLOCK_READ)) {
+		log_token(token, "ballot %llu phase%d read %s",
+			  (unsigned long long)next_lver, phase, bs->bk_debug);
+
+		if (error == SANLK_DBLOCK_READ)
+			log_errot(token, "ballot %llu %s error %d",
+				  (unsigned long long)next_lver,
+				  (phase == 1) ? "dblock read" : "dblock read2", rv);
+	}
+ out:
+	for (d = 0; d < num_disks; d++) {
+		if (wbuf[d])
+			free(wbuf[d]);
+	}
+	return error;
+}
+
+static int run_ballot(struct task *task, struct token *token, uint32_t flags,
+		      int num_hosts, uint64_t next_lver, uint64_t our_mbal,
+		      struct paxos_dblock *dblock_out)
+{
+	struct ballot_state bs;
+	struct paxos_dblock dblock;
+	char *iobuf[SANLK_MAX_DISKS];
+	char **p_iobuf[SANLK_MAX_DISKS];
+	int num_disks = token->r.num_disks;
+	int sector_size = token->sector_size;
+	int sector_count;
+	int iobuf_len;
+	int phase2 = 0;
+	int d, rv = 0;
+	int error;
+
+	sector_count = roundup_power_of_two(num_hosts + 2);
+
+	iobuf_len = sector_count * sector_size;
+
+	if (!iobuf_len)
+		return -EINVAL;
+
+	memset(iobuf, 0, sizeof(iobuf));
+
+	for (d = 0; d < num_disks; d++) {
+		p_iobuf[d] = &iobuf[d];
+
+		rv = posix_memalign((void *)p_iobuf[d], getpagesize(), iobuf_len);
+		if (rv) {
+			iobuf[d] = NULL;
+			error = rv;
+			goto out;
 		}
 	}
 
-	log_token(token, "ballot %llu phase1 read %s",
-		  (unsigned long long)next_lver, bk_debug);
 
-	if (!majority_disks(num_disks, num_reads)) {
-		log_errot(token, "ballot %llu dblock read error %d",
-			  (unsigned long long)next_lver, rv);
-		error = SANLK_DBLOCK_READ;
+	/*
+	 * phase 1
+	 *
+	 * "For each disk d, it tries first to write dblock[p] to disk[d][p]
+	 * and then to read disk[d][q] for all other processors q.  It aborts
+	 * the ballot if, for any d and q, it finds disk[d][q].mbal >
+	 * dblock[p].mbal. The phase completes when p has written and read a
+	 * majority of the disks, without reading any block whose mbal
+	 * component is greater than dblock[p].mbal."
+	 */
+
+	log_token(token, "ballot %llu phase1 write mbal %llu",
+		  (unsigned long long)next_lver,
+		  (unsigned long long)our_mbal);
+
+	memset(&dblock, 0, sizeof(struct paxos_dblock));
+	dblock.mbal = our_mbal;
+	dblock.lver = next_lver;
+	dblock.checksum = 0; /* set after paxos_dblock_out */
+
+	memset(&bs, 0, sizeof(bs));
+	bs.q_max = -1;
+
+	error = run_ballot_phase(task, token, flags, 1, num_hosts, next_lver,
+				 &dblock, iobuf, iobuf_len, &bs);
+	if (error < 0)
 		goto out;
-	}
 
 
 	/*
@@ -685,11 +787,11 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	 * nonInitBlks having the largest value of bk.bal."
 	 */
 
-	if (bk_max.inp) {
+	if (bs.bk_max.inp) {
 		/* lver and mbal are already set */
-		dblock.inp = bk_max.inp;
-		dblock.inp2 = bk_max.inp2;
-		dblock.inp3 = bk_max.inp3;
+		dblock.inp = bs.bk_max.inp;
+		dblock.inp2 = bs.bk_max.inp2;
+		dblock.inp3 = bs.bk_max.inp3;
 	} else {
 		/* lver and mbal are already set */
 		dblock.inp = token->host_id;
@@ -699,15 +801,15 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	dblock.bal = dblock.mbal;
 	dblock.checksum = 0; /* set after paxos_dblock_out */
 
-	if (bk_max.inp) {
+	if (bs.bk_max.inp) {
 		log_token(token, "ballot %llu choose bk_max[%d] lver %llu mbal %llu bal %llu inp %llu %llu %llu",
-			  (unsigned long long)next_lver, q_max,
-			  (unsigned long long)bk_max.lver,
-			  (unsigned long long)bk_max.mbal,
-			  (unsigned long long)bk_max.bal,
-			  (unsigned long long)bk_max.inp,
-			  (unsigned long long)bk_max.inp2,
-			  (unsigned long long)bk_max.inp3);
+			  (unsigned long long)next_lver, bs.q_max,
+			  (unsigned long long)bs.bk_max.lver,
+			  (unsigned long long)bs.bk_max.mbal,
+			  (unsigned long long)bs.bk_max.bal,
+			  (unsigned long long)bs.bk_max.inp,
+			  (unsigned long long)bs.bk_max.inp2,
+			  (unsigned long long)bs.bk_max.inp3);
 	}
 
 
@@ -725,151 +827,12 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		  (unsigned long long)dblock.inp,
 		  (unsigned long long)dblock.inp2,
 		  (unsigned long long)dblock.inp3,
-		  q_max);
-
-	num_writes = 0;
-
-	for (d = 0; d < num_disks; d++) {
-		/* acquire io: write 2 */
-		rv = write_dblock(task, token, &token->disks[d], token->host_id, &dblock);
-		if (rv < 0)
-			continue;
-		num_writes++;
-	}
-
-	if (!majority_disks(num_disks, num_writes)) {
-		log_errot(token, "ballot %llu our dblock write2 error %d",
-			  (unsigned long long)next_lver, rv);
-		error = SANLK_DBLOCK_WRITE;
-		goto out;
-	}
-
-	memset(bk_debug, 0, sizeof(bk_debug));
-	bk_debug_count = 0;
-
-	num_reads = 0;
-
-	for (d = 0; d < num_disks; d++) {
-		disk = &token->disks[d];
-
-		if (!iobuf[d])
-			continue;
-		memset(iobuf[d], 0, iobuf_len);
-
-		/* acquire io: read 3 */
-		rv = read_iobuf(disk->fd, disk->offset, iobuf[d], iobuf_len, task, token->io_timeout, NULL);
-		if (rv == SANLK_AIO_TIMEOUT)
-			iobuf[d] = NULL;
-		if (rv < 0)
-			continue;
-		num_reads++;
-
-		for (q = 0; q < num_hosts; q++) {
-			bk_end = (struct paxos_dblock *)(iobuf[d] + ((2 + q)*sector_size));
-
-			checksum = dblock_checksum(bk_end);
-
-			paxos_dblock_in(bk_end, &bk_in);
-			bk = &bk_in;
-
-			if (bk->mbal && ((flags & PAXOS_ACQUIRE_DEBUG_ALL) || (bk->lver >= dblock.lver))) {
-				if (bk_debug_count >= BK_DEBUG_COUNT) {
-					log_token(token, "ballot %llu phase2 read %s",
-						  (unsigned long long)next_lver, bk_debug);
-					memset(bk_debug, 0, sizeof(bk_debug));
-					bk_debug_count = 0;
-				}
-
-				memset(bk_str, 0, sizeof(bk_str));
-				snprintf(bk_str, BK_STR_SIZE, "%d:%llu:%llu:%llu:%llu:%llu:%llu:%x,", q,
-					 (unsigned long long)bk->mbal,
-					 (unsigned long long)bk->bal,
-					 (unsigned long long)bk->inp,
-					 (unsigned long long)bk->inp2,
-					 (unsigned long long)bk->inp3,
-					 (unsigned long long)bk->lver,
-					 bk->flags);
-				bk_str[BK_STR_SIZE-1] = '\0';
-				strncat(bk_debug, bk_str, BK_STR_SIZE-1);
-				bk_debug_count++;
-			}
-
-			rv = verify_dblock(token, bk, checksum);
-			if (rv < 0)
-				continue;
-
-			if (bk->lver < dblock.lver)
-				continue;
-
-			if (bk->lver > dblock.lver) {
-				/*
-				 * This happens when we choose another host's bk, that host
-				 * acquires the lease itself, releases it, and reacquires it
-				 * with a new lver, all before we get here, at which point
-				 * we see the larger lver.  I believe case this would always
-				 * also be caught the the bk->mbal > dblock.mbal condition
-				 * below.
-				 */
-				log_warnt(token, "ballot %llu abort2 larger lver in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
-					  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
-					  (unsigned long long)next_lver, q,
-					  (unsigned long long)bk->mbal,
-					  (unsigned long long)bk->bal,
-					  (unsigned long long)bk->inp,
-					  (unsigned long long)bk->inp2,
-					  (unsigned long long)bk->inp3,
-					  (unsigned long long)bk->lver,
-					  (unsigned long long)dblock.mbal,
-					  (unsigned long long)dblock.bal,
-					  (unsigned long long)dblock.inp,
-					  (unsigned long long)dblock.inp2,
-					  (unsigned long long)dblock.inp3,
-					  (unsigned long long)dblock.lver);
-
-				log_token(token, "ballot %llu phase2 read %s",
-					  (unsigned long long)next_lver, bk_debug);
-
-				error = SANLK_DBLOCK_LVER;
-				goto out;
-			}
-
-			/* see "It aborts the ballot" in comment above */
-
-			if (bk->mbal > dblock.mbal) {
-				log_warnt(token, "ballot %llu abort2 larger mbal in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
-					  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
-					  (unsigned long long)next_lver, q,
-					  (unsigned long long)bk->mbal,
-					  (unsigned long long)bk->bal,
-					  (unsigned long long)bk->inp,
-					  (unsigned long long)bk->inp2,
-					  (unsigned long long)bk->inp3,
-					  (unsigned long long)bk->lver,
-					  (unsigned long long)dblock.mbal,
-					  (unsigned long long)dblock.bal,
-					  (unsigned long long)dblock.inp,
-					  (unsigned long long)dblock.inp2,
-					  (unsigned long long)dblock.inp3,
-					  (unsigned long long)dblock.lver);
-
-				log_token(token, "ballot %llu phase2 read %s",
-					  (unsigned long long)next_lver, bk_debug);
-
-				error = SANLK_DBLOCK_MBAL;
-				goto out;
-			}
-		}
-	}
+		  bs.q_max);
 
-	log_token(token, "ballot %llu phase2 read %s",
-		  (unsigned long long)next_lver, bk_debug);
-
-	if (!majority_disks(num_disks, num_reads)) {
-		log_errot(token, "ballot %llu dblock read2 error %d",
-			  (unsigned long long)next_lver, rv);
-		error = SANLK_DBLOCK_READ;
+	error = run_ballot_phase(task, token, flags, 2, num_hosts, next_lver,
+				 &dblock, iobuf, iobuf_len, &bs);
+	if (error < 0)
 		goto out;
-	}
 
 	/* "When it completes phase 2, p has committed dblock[p].inp." */
 
@@ -1585,19 +1548,33 @@ static int write_new_leader(struct task *task,
 			    struct leader_record *nl,
 			    const char *caller)
 {
+	struct leader_record lr_end;
+	uint32_t checksum;
+	int results[SANLK_MAX_DISKS];
 	int num_disks = token->r.num_disks;
-	int num_writes = 0;
+	int num_writes;
 	int timeout = 0;
 	int rv = 0;
 	int d;
 
+	leader_record_out(nl, &lr_end);
+
+	/*
+	 * N.B. must compute checksum after the data has been byte swapped.
+	 */
+	checksum = leader_checksum(&lr_end);
+	nl->checksum = checksum;
+	lr_end.checksum = cpu_to_le32(checksum);
+
+	num_writes = write_sector_disks(token->disks, num_disks, token->sector_size, 0,
+					(char *)&lr_end, sizeof(struct leader_record),
+					task, token->io_timeout, "leader", results);
+
 	for (d = 0; d < num_disks; d++) {
-		rv = write_leader(task, token, &token->disks[d], nl);
-		if (rv == SANLK_AIO_TIMEOUT)
+		if (results[d] == SANLK_AIO_TIMEOUT)
 			timeout = 1;
-		if (rv < 0) 
-			continue;
-		num_writes++;
+		if (results[d] < 0)
+			rv = results[d];
 	}
 
 	if (!majority_disks(num_disks, num_writes)) {
@@ -1660,8 +1637,11 @@ int paxos_lease_acquire(struct task *task,
 	struct paxos_dblock dblock;
 	struct paxos_dblock owner_dblock;
 	struct host_status hs;
+	struct host_status hs_cur;
 	uint64_t wait_start, now;
+	uint64_t deadline_ms, leader_read_ms, wait_ms, now_ms;
 	uint64_t last_timestamp;
+	uint32_t status_gen;
 	uint64_t next_lver;
 	uint64_t max_mbal;
 	uint64_t num_mbal;
@@ -1672,9 +1652,15 @@ int paxos_lease_acquire(struct task *task,
 	int align_size;
 	int ls_sector_size;
 	int other_io_timeout, other_host_dead_seconds;
+	int renewal_fresh_seconds;
 
 	memset(&dblock, 0, sizeof(dblock)); /* shut up compiler */
 
+	/* a renewal is at most this old when the next is due, allowing
+	   for the renewal i/o itself */
+	renewal_fresh_seconds = calc_id_renewal_seconds(token->io_timeout) +
+				token->io_timeout;
+
 	log_token(token, "paxos_acquire begin offset %llu 0x%x %d %d",
 		  (unsigned long long)token->disks[0].offset, flags,
 		  token->sector_size, token->align_size);
@@ -1768,27 +1754,10 @@ int paxos_lease_acquire(struct task *task,
 	 * its watchdog has triggered and we can go for the paxos lease.
 	 */
 
-	if (!disk_open) {
-		memset(&host_id_disk, 0, sizeof(host_id_disk));
-
-		rv = lockspace_disk(cur_leader.space_name, &host_id_disk, &ls_sector_size);
-		if (rv < 0) {
-			log_errot(token, "paxos_acquire no lockspace info %.48s",
-			  	  cur_leader.space_name);
-			error = SANLK_ACQUIRE_LOCKSPACE;
-			goto out;
-		}
-		host_id_disk.fd = -1;
-
-		rv = open_disks_fd(&host_id_disk, 1);
-		if (rv < 0) {
-			log_errot(token, "paxos_acquire open host_id_disk error %d", rv);
-			error = SANLK_ACQUIRE_IDDISK;
-			goto out;
-		}
-		disk_open = 1;
-	}
+	status_gen = host_status_wait(token->space_id, 0, 0);
+	leader_read_ms = monotime_ms();
 
+	memset(&hs, 0, sizeof(hs));
 	rv = host_info(cur_leader.space_name, cur_leader.owner_id, &hs);
 	if (!rv && hs.last_check && hs.last_live &&
 	    hs.owner_id == cur_leader.owner_id &&
@@ -1811,6 +1780,45 @@ int paxos_lease_acquire(struct task *task,
 		  (unsigned long long)wait_start);
 
 	while (1) {
+		/*
+		 * Our lockspace thread reads the owner's delta lease in each
+		 * renewal.  If the last of those reads is recent, use it
+		 * rather than reading the owner's delta lease again here.
+		 */
+
+		rv = host_info(cur_leader.space_name, cur_leader.owner_id, &hs_cur);
+		if (!rv && hs_cur.last_check && !hs_cur.lease_bad &&
+		    monotime() - hs_cur.last_check <= renewal_fresh_seconds) {
+			memset(&host_id_leader, 0, sizeof(host_id_leader));
+			host_id_leader.owner_id = hs_cur.owner_id;
+			host_id_leader.owner_generation = hs_cur.owner_generation;
+			host_id_leader.timestamp = hs_cur.timestamp;
+			hs.last_check = hs_cur.last_check;
+			hs.last_live = hs_cur.last_live;
+			goto check_owner;
+		}
+
+		if (!disk_open) {
+			memset(&host_id_disk, 0, sizeof(host_id_disk));
+
+			rv = lockspace_disk(cur_leader.space_name, &host_id_disk, &ls_sector_size);
+			if (rv < 0) {
+				log_errot(token, "paxos_acquire no lockspace info %.48s",
+					  cur_leader.space_name);
+				error = SANLK_ACQUIRE_LOCKSPACE;
+				goto out;
+			}
+			host_id_disk.fd = -1;
+
+			rv = open_disks_fd(&host_id_disk, 1);
+			if (rv < 0) {
+				log_errot(token, "paxos_acquire open host_id_disk error %d", rv);
+				error = SANLK_ACQUIRE_IDDISK;
+				goto out;
+			}
+			disk_open = 1;
+		}
+
 		error = delta_lease_leader_read(task, ls_sector_size, token->io_timeout,
 						&host_id_disk,
 						cur_leader.space_name,
@@ -1828,6 +1836,7 @@ int paxos_lease_acquire(struct task *task,
 			goto out;
 		}
 
+ check_owner:
 		/* a host_id cannot become free in less than
 		   host_dead_seconds after the final renewal because
 		   a host_id must first be acquired before being freed,
@@ -1874,6 +1883,7 @@ int paxos_lease_acquire(struct task *task,
 		 *
 		 * 2. If our own renewal thread saw the owner's timestamp change
 		 * the last time it was checked, then consider the owner to be alive.
+		 * (hs is updated when host_id_leader is taken from the renewal.)
 		 */
 
 		if ((host_id_leader.timestamp != last_timestamp) ||
@@ -1948,14 +1958,34 @@ int paxos_lease_acquire(struct task *task,
 		}
 
  skip_live_check:
-		/* TODO: test with sleep(2) here */
-		sleep(1);
+		/*
+		 * Wait until our lockspace thread checks the owner's delta
+		 * lease again, which wakes us to recheck the owner right away,
+		 * or until the owner would be dead, host_dead_seconds after
+		 * wait_start.  The paxos leader is reread at most once a
+		 * second, so a release or a new owner is seen within a second.
+		 */
+
+		other_host_dead_seconds = calc_host_dead_seconds(hs.io_timeout);
+		deadline_ms = (wait_start + other_host_dead_seconds + 1) * 1000;
+
+		wait_ms = leader_read_ms + 1000;
+		if (deadline_ms < wait_ms)
+			wait_ms = deadline_ms;
+
+		now_ms = monotime_ms();
+		if (now_ms < wait_ms)
+			status_gen = host_status_wait(token->space_id, status_gen,
+						      wait_ms - now_ms);
 
 		if (external_shutdown) {
 			error = -1;
 			goto out;
 		}
 
+		if (monotime_ms() < leader_read_ms + 1000)
+			continue;
+
 		/*
 		 * In this while loop we are waiting for an indication that the
 		 * current owner is alive or dead, but if we see the leader
@@ -1963,6 +1993,8 @@ int paxos_lease_acquire(struct task *task,
 		 * process.
 		 */
 
+		leader_read_ms = monotime_ms();
+
 		error = paxos_lease_leader_read(task, token, &tmp_leader, "paxos_acquire");
 		if (error < 0)
 			goto out;
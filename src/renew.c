@@ -0,0 +1,393 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "sanlock_internal.h"
+#include "log.h"
+#include "lockspace.h"
+#include "renew.h"
+
+/*
+ * The renewal engine runs the delta lease renewals of all lockspaces
+ * from a few shared threads, in place of a thread per lockspace that
+ * slept between renewals.  Each lockspace is on a timer wheel at the
+ * time of its next step (a renewal, a check of other hosts' leases, or
+ * stopping), and a thread that finds a lockspace due moves it to the
+ * ready list and runs lockspace_renew() for it, which returns the time
+ * of the next step.  One idle thread waits for the next tick that has
+ * a lockspace on it; the others wait for ready lockspaces.
+ *
+ * A renewal can block for io_timeout seconds on a failing device, so
+ * when a lockspace is ready, or the wheel is unwatched, and no thread
+ * is free, another thread is started, up to one more than the number
+ * of lockspaces, to keep lockspaces on other devices from waiting
+ * behind it.  Threads beyond min_threads exit
+ * after they have been idle for RENEW_IDLE_SECONDS.
+ */
+
+#define RENEW_TICK_MS 100
+#define RENEW_WHEEL_SLOTS 512
+#define RENEW_IDLE_SECONDS 60
+
+#define RENEW_NONE	0
+#define RENEW_WHEEL	1
+#define RENEW_READY	2
+#define RENEW_RUNNING	3
+#define RENEW_DONE	4
+
+struct renew_engine {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* free threads wait for ready work */
+	pthread_cond_t timer_cond;	/* the timer thread waits for a tick */
+	pthread_cond_t done_cond;	/* lockspace done, or thread exit */
+	struct list_head wheel[RENEW_WHEEL_SLOTS];
+	struct list_head ready;
+	uint64_t tick;			/* next tick to expire */
+	uint64_t timer_ms;		/* wake time of the timer thread */
+	int timer;			/* a thread is waiting on timer_cond */
+	int wheel_count;
+	int spaces;
+	int num_threads;
+	int free_threads;
+	int min_threads;
+	int quit;
+	uint64_t steps;			/* stats */
+	uint64_t threads_started;
+	int threads_max;
+	uint64_t late_ms_max;
+};
+
+static struct renew_engine engine;
+
+static void *renew_thread(void *data);
+
+static void ms_to_ts(uint64_t ms, struct timespec *ts)
+{
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000;
+}
+
+/* called with engine.mutex held */
+
+static int start_thread(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int rv;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rv = pthread_create(&th, &attr, renew_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (rv) {
+		log_error("renew engine thread create error %d threads %d",
+			  rv, engine.num_threads);
+		return -1;
+	}
+
+	engine.num_threads++;
+	engine.threads_started++;
+	if (engine.num_threads > engine.threads_max)
+		engine.threads_max = engine.num_threads;
+	return 0;
+}
+
+/*
+ * Make sure that a thread will pick up ready work and that a thread is
+ * watching the wheel.  Called with engine.mutex held.
+ */
+
+static void kick_threads(void)
+{
+	if (engine.free_threads) {
+		if (!list_empty(&engine.ready) || !engine.timer)
+			pthread_cond_signal(&engine.cond);
+		return;
+	}
+
+	if (engine.timer && list_empty(&engine.ready))
+		return;
+
+	if (engine.num_threads < engine.spaces + 1)
+		start_thread();
+}
+
+/* called with engine.mutex held */
+
+static void queue_space(struct space *sp, uint64_t due_ms)
+{
+	uint64_t tick = due_ms / RENEW_TICK_MS;
+
+	sp->renew_due_ms = due_ms;
+
+	if (tick < engine.tick) {
+		sp->renew_where = RENEW_READY;
+		list_add_tail(&sp->renew_list, &engine.ready);
+		kick_threads();
+		return;
+	}
+
+	sp->renew_where = RENEW_WHEEL;
+	list_add_tail(&sp->renew_list, &engine.wheel[tick % RENEW_WHEEL_SLOTS]);
+	engine.wheel_count++;
+
+	if (engine.timer &&
+	    (!engine.timer_ms || (tick + 1) * RENEW_TICK_MS < engine.timer_ms))
+		pthread_cond_signal(&engine.timer_cond);
+	else if (!engine.timer)
+		kick_threads();
+}
+
+/*
+ * Move the lockspaces on each tick that has passed to the ready list.
+ * A lockspace on a slot for a later turn of the wheel stays.  Called
+ * with engine.mutex held.
+ */
+
+static void expire_wheel(uint64_t now)
+{
+	struct space *sp, *safe;
+	struct list_head *slot;
+	uint64_t end_ms;
+
+	if (!engine.wheel_count) {
+		engine.tick = now / RENEW_TICK_MS;
+		return;
+	}
+
+	while ((engine.tick + 1) * RENEW_TICK_MS <= now) {
+		slot = &engine.wheel[engine.tick % RENEW_WHEEL_SLOTS];
+		end_ms = (engine.tick + 1) * RENEW_TICK_MS;
+
+		list_for_each_entry_safe(sp, safe, slot, renew_list) {
+			if (sp->renew_due_ms >= end_ms)
+				continue;
+			sp->renew_where = RENEW_READY;
+			list_move_tail(&sp->renew_list, &engine.ready);
+			engine.wheel_count--;
+		}
+		engine.tick++;
+	}
+}
+
+/* the end of the next tick with a lockspace on it, 0 if none */
+
+static uint64_t next_timer_ms(void)
+{
+	uint64_t tick;
+
+	for (tick = engine.tick; tick < engine.tick + RENEW_WHEEL_SLOTS; tick++) {
+		if (!list_empty(&engine.wheel[tick % RENEW_WHEEL_SLOTS]))
+			return (tick + 1) * RENEW_TICK_MS;
+	}
+	return 0;
+}
+
+static void *renew_thread(void *data GNUC_UNUSED)
+{
+	struct space *sp;
+	struct timespec ts;
+	uint64_t now, due_ms;
+	int rv;
+
+	pthread_mutex_lock(&engine.mutex);
+
+	while (1) {
+		now = monotime_ms();
+		expire_wheel(now);
+
+		if (!list_empty(&engine.ready)) {
+			sp = list_first_entry(&engine.ready, struct space, renew_list);
+			list_del(&sp->renew_list);
+			sp->renew_where = RENEW_RUNNING;
+			sp->renew_wake = 0;
+
+			if (now > sp->renew_due_ms + RENEW_TICK_MS &&
+			    now - sp->renew_due_ms > engine.late_ms_max)
+				engine.late_ms_max = now - sp->renew_due_ms;
+			engine.steps++;
+
+			kick_threads();
+			pthread_mutex_unlock(&engine.mutex);
+
+			rv = lockspace_renew(sp, &due_ms);
+
+			pthread_mutex_lock(&engine.mutex);
+			if (!rv) {
+				sp->renew_where = RENEW_DONE;
+				engine.spaces--;
+				pthread_cond_broadcast(&engine.done_cond);
+				continue;
+			}
+			if (sp->renew_wake)
+				due_ms = 0;
+			queue_space(sp, due_ms);
+			continue;
+		}
+
+		if (engine.quit)
+			break;
+
+		if (!engine.timer) {
+			engine.timer = 1;
+			engine.timer_ms = next_timer_ms();
+			if (engine.timer_ms) {
+				ms_to_ts(engine.timer_ms, &ts);
+				pthread_cond_timedwait(&engine.timer_cond, &engine.mutex, &ts);
+			} else {
+				pthread_cond_wait(&engine.timer_cond, &engine.mutex);
+			}
+			engine.timer = 0;
+			engine.timer_ms = 0;
+			continue;
+		}
+
+		engine.free_threads++;
+		ms_to_ts(now + RENEW_IDLE_SECONDS * 1000, &ts);
+		rv = pthread_cond_timedwait(&engine.cond, &engine.mutex, &ts);
+		engine.free_threads--;
+
+		if (rv == ETIMEDOUT && engine.num_threads > engine.min_threads)
+			break;
+	}
+
+	engine.num_threads--;
+	pthread_cond_broadcast(&engine.done_cond);
+	pthread_mutex_unlock(&engine.mutex);
+	return NULL;
+}
+
+void renew_engine_add(struct space *sp, uint64_t due_ms)
+{
+	pthread_mutex_lock(&engine.mutex);
+	engine.spaces++;
+	queue_space(sp, due_ms);
+	pthread_mutex_unlock(&engine.mutex);
+}
+
+void renew_engine_wake(struct space *sp)
+{
+	pthread_mutex_lock(&engine.mutex);
+	switch (sp->renew_where) {
+	case RENEW_WHEEL:
+		list_del(&sp->renew_list);
+		engine.wheel_count--;
+		queue_space(sp, 0);
+		break;
+	case RENEW_RUNNING:
+		sp->renew_wake = 1;
+		break;
+	};
+	pthread_mutex_unlock(&engine.mutex);
+}
+
+int renew_engine_done(struct space *sp)
+{
+	int done;
+
+	pthread_mutex_lock(&engine.mutex);
+	done = (sp->renew_where == RENEW_DONE);
+	pthread_mutex_unlock(&engine.mutex);
+
+	return done;
+}
+
+void renew_engine_wait(struct space *sp)
+{
+	renew_engine_wake(sp);
+
+	pthread_mutex_lock(&engine.mutex);
+	while (sp->renew_where != RENEW_DONE)
+		pthread_cond_wait(&engine.done_cond, &engine.mutex);
+	pthread_mutex_unlock(&engine.mutex);
+}
+
+int setup_renew_engine(int min_threads)
+{
+	pthread_condattr_t attr;
+	int i, rv = 0;
+
+	memset(&engine, 0, sizeof(engine));
+	pthread_mutex_init(&engine.mutex, NULL);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&engine.cond, &attr);
+	pthread_cond_init(&engine.timer_cond, &attr);
+	pthread_cond_init(&engine.done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (i = 0; i < RENEW_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&engine.wheel[i]);
+	INIT_LIST_HEAD(&engine.ready);
+
+	engine.tick = monotime_ms() / RENEW_TICK_MS;
+	engine.min_threads = min_threads;
+
+	pthread_mutex_lock(&engine.mutex);
+	for (i = 0; i < min_threads; i++) {
+		rv = start_thread();
+		if (rv < 0)
+			break;
+	}
+	pthread_mutex_unlock(&engine.mutex);
+
+	if (rv < 0)
+		close_renew_engine();
+	return rv;
+}
+
+/* all lockspaces have been freed */
+
+void close_renew_engine(void)
+{
+	pthread_mutex_lock(&engine.mutex);
+	engine.quit = 1;
+	pthread_cond_broadcast(&engine.cond);
+	pthread_cond_broadcast(&engine.timer_cond);
+	while (engine.num_threads)
+		pthread_cond_wait(&engine.done_cond, &engine.mutex);
+	pthread_mutex_unlock(&engine.mutex);
+}
+
+int print_state_renew(char *str, int len)
+{
+	int rv;
+
+	pthread_mutex_lock(&engine.mutex);
+	rv = snprintf(str, len,
+		      " renew_threads=%d"
+		      " renew_threads_free=%d"
+		      " renew_threads_max=%d"
+		      " renew_threads_started=%llu"
+		      " renew_spaces=%d"
+		      " renew_steps=%llu"
+		      " renew_late_ms_max=%llu",
+		      engine.num_threads,
+		      engine.free_threads + engine.timer,
+		      engine.threads_max,
+		      (unsigned long long)engine.threads_started,
+		      engine.spaces,
+		      (unsigned long long)engine.steps,
+		      (unsigned long long)engine.late_ms_max);
+	pthread_mutex_unlock(&engine.mutex);
+
+	return rv < len ? rv : len;
+}
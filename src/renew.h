@@ -0,0 +1,27 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __RENEW_H__
+#define __RENEW_H__
+
+int setup_renew_engine(int min_threads);
+void close_renew_engine(void);
+
+/* run lockspace_renew() for sp from due_ms until it returns 0 */
+void renew_engine_add(struct space *sp, uint64_t due_ms);
+
+/* run the next step for sp now, e.g. after setting thread_stop */
+void renew_engine_wake(struct space *sp);
+
+/* returns 1 once lockspace_renew() has returned 0 for sp */
+int renew_engine_done(struct space *sp);
+void renew_engine_wait(struct space *sp);
+
+int print_state_renew(char *str, int len);
+
+#endif
@@ -22,8 +22,11 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "sanlock_internal.h"
+#include "sanlock_sock.h"
 #include "diskio.h"
 #include "ondisk.h"
 #include "log.h"
@@ -33,17 +36,15 @@
 #include "task.h"
 #include "timeouts.h"
 #include "helper.h"
+#include "diskcache.h"
 
 /* from cmd.c */
 void send_state_resource(int fd, struct resource *r, const char *list_name, int pid, uint32_t token_id);
+void status_resource(struct status_buf *sb, struct resource *r, uint32_t list, int pid, uint32_t token_id);
 
 /* from main.c */
 int get_rand(int a, int b);
 
-static pthread_t resource_pt;
-static int resource_thread_stop;
-static int resource_thread_work;
-static int resource_thread_work_examine;
 static struct list_head resources_free;
 static struct list_head resources_held;
 static struct list_head resources_add;
@@ -51,12 +52,99 @@ static struct list_head resources_rem;
 static struct list_head resources_orphan;
 static pthread_mutex_t resource_mutex;
 static pthread_cond_t resource_cond;
+static struct list_head release_queue;   /* resources_rem to release on disk */
+static struct list_head examine_queue;   /* resources_held to examine */
 static struct list_head host_events;
 static int resources_free_count;
 static uint32_t resource_id_counter = 2; /* id 1 used for internal rindex lease */
 
 #define FREE_RES_COUNT 128
 
+/*
+ * Every struct resource on one of the resources_ lists is also in
+ * resource_hash, keyed by lockspace name and resource name, so that
+ * finding a resource does not scan the lists.  Lists are changed only
+ * through res_list_add/res_list_move/res_list_del to keep the two in
+ * sync.  r->res_list records which list r is on.
+ */
+
+#define RESOURCE_HASH_SIZE 8192 /* power of 2 */
+
+static struct list_head resource_hash[RESOURCE_HASH_SIZE];
+
+static uint32_t resource_hash_key(const char *space_name, const char *res_name)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < NAME_ID_SIZE && space_name[i]; i++)
+		h = (h ^ (uint8_t)space_name[i]) * 16777619U;
+
+	h = (h ^ ':') * 16777619U;
+
+	for (i = 0; i < NAME_ID_SIZE && res_name[i]; i++)
+		h = (h ^ (uint8_t)res_name[i]) * 16777619U;
+
+	return h & (RESOURCE_HASH_SIZE - 1);
+}
+
+static struct list_head *resource_hash_head(const char *space_name, const char *res_name)
+{
+	return &resource_hash[resource_hash_key(space_name, res_name)];
+}
+
+static void res_list_add(struct resource *r, struct list_head *head)
+{
+	INIT_LIST_HEAD(&r->work_list);
+	list_add(&r->list, head);
+	list_add(&r->hash_list, resource_hash_head(r->r.lockspace_name, r->r.name));
+	r->res_list = head;
+}
+
+static void res_list_move(struct resource *r, struct list_head *head)
+{
+	list_del_init(&r->work_list);
+	list_move(&r->list, head);
+	r->res_list = head;
+}
+
+static void res_list_del(struct resource *r)
+{
+	list_del_init(&r->work_list);
+	list_del(&r->list);
+	list_del(&r->hash_list);
+	r->res_list = NULL;
+}
+
+/*
+ * Resources needing on-disk release or examination are queued for the
+ * resource workers on release_queue and examine_queue.  A resource is on
+ * at most one queue, through r->work_list, and is taken off the queue
+ * when it moves to another list.  These are called with resource_mutex
+ * held.
+ */
+
+static void add_release(struct resource *r)
+{
+	r->flags |= R_THREAD_RELEASE;
+	if (list_empty(&r->work_list))
+		list_add_tail(&r->work_list, &release_queue);
+}
+
+static void queue_release(struct resource *r)
+{
+	add_release(r);
+	pthread_cond_signal(&resource_cond);
+}
+
+static void queue_examine(struct resource *r)
+{
+	r->flags |= R_THREAD_EXAMINE;
+	if (list_empty(&r->work_list))
+		list_add_tail(&r->work_list, &examine_queue);
+	pthread_cond_signal(&resource_cond);
+}
+
 /*
  * There's not much advantage to saving resource structs and reusing them again
  * when they are requested again.  One advantage can be that the res_id remains
@@ -76,7 +164,7 @@ static void free_resource(struct resource *r)
 
 	if (resources_free_count < FREE_RES_COUNT) {
 		resources_free_count++;
-		list_add(&r->list, &resources_free);
+		res_list_add(r, &resources_free);
 		return;
 	}
 
@@ -84,7 +172,7 @@ static void free_resource(struct resource *r)
 
 	list_for_each_entry_reverse(rtmp, &resources_free, list) {
 		if (!rtmp->reused) {
-			list_del(&rtmp->list);
+			res_list_del(rtmp);
 			free(rtmp);
 			goto out;
 		}
@@ -94,11 +182,11 @@ static void free_resource(struct resource *r)
 	}
 
 	if (rmin) {
-		list_del(&rmin->list);
+		res_list_del(rmin);
 		free(rmin);
 	}
  out:
-	list_add(&r->list, &resources_free);
+	res_list_add(r, &resources_free);
 }
 
 static struct resource *get_free_resource(struct token *token, int *token_matches)
@@ -106,7 +194,9 @@ static struct resource *get_free_resource(struct token *token, int *token_matche
 	struct resource *r;
 
 	/* find a previous r that matches token */
-	list_for_each_entry(r, &resources_free, list) {
+	list_for_each_entry(r, resource_hash_head(token->r.lockspace_name, token->r.name), hash_list) {
+		if (r->res_list != &resources_free)
+			continue;
 		if (strcmp(r->r.lockspace_name, token->r.lockspace_name))
 			continue;
 		if (strcmp(r->r.name, token->r.name))
@@ -118,7 +208,7 @@ static struct resource *get_free_resource(struct token *token, int *token_matche
 
 		*token_matches = 1;
 		resources_free_count--;
-		list_del(&r->list);
+		res_list_del(r);
 		r->reused++;
 		return r;
 	}
@@ -154,6 +244,30 @@ void send_state_resources(int fd)
 	pthread_mutex_unlock(&resource_mutex);
 }
 
+void status_resources(struct status_buf *sb)
+{
+	struct resource *r;
+	struct token *token;
+
+	pthread_mutex_lock(&resource_mutex);
+	list_for_each_entry(r, &resources_held, list) {
+		list_for_each_entry(token, &r->tokens, list)
+			status_resource(sb, r, SANLK_STATUS_LIST_MAIN, token->pid, token->token_id);
+	}
+
+	list_for_each_entry(r, &resources_add, list) {
+		list_for_each_entry(token, &r->tokens, list)
+			status_resource(sb, r, SANLK_STATUS_LIST_ADD, token->pid, token->token_id);
+	}
+
+	list_for_each_entry(r, &resources_rem, list)
+		status_resource(sb, r, SANLK_STATUS_LIST_REM, r->pid, 0);
+
+	list_for_each_entry(r, &resources_orphan, list)
+		status_resource(sb, r, SANLK_STATUS_LIST_ORPHAN, r->pid, 0);
+	pthread_mutex_unlock(&resource_mutex);
+}
+
 int read_resource_owners(struct task *task, struct token *token,
 			 struct sanlk_resource *res,
 			 char **send_buf, int *send_len, int *count)
@@ -415,29 +529,19 @@ static int write_host_block(struct task *task, struct token *token,
 			    uint64_t host_id, uint64_t mb_gen, uint32_t mb_flags,
 			    struct paxos_dblock *pd)
 {
-	struct sync_disk *disk;
 	struct mode_block mb;
 	struct mode_block mb_end;
 	struct paxos_dblock pd_end;
-	char *iobuf, **p_iobuf;
-	uint64_t offset;
+	char iobuf[MBLOCK_OFFSET + sizeof(struct mode_block)];
+	int results[SANLK_MAX_DISKS];
 	uint32_t checksum;
 	int num_disks = token->r.num_disks;
-	int iobuf_len, rv, d;
+	int num_writes, rv = 0, d;
 
-	disk = &token->disks[0];
-
-	iobuf_len = token->sector_size;
-	if (!iobuf_len)
+	if (!token->sector_size)
 		return -EINVAL;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
-	if (rv)
-		return -ENOMEM;
-
-	memset(iobuf, 0, iobuf_len);
+	memset(iobuf, 0, sizeof(iobuf));
 
 	/*
 	 * When writing our mode block, we need to keep our dblock
@@ -477,14 +581,19 @@ static int write_host_block(struct task *task, struct token *token,
 		memcpy(iobuf + MBLOCK_OFFSET, &mb_end, sizeof(struct mode_block));
 	}
 
-	for (d = 0; d < num_disks; d++) {
-		disk = &token->disks[d];
-
-		offset = disk->offset + ((2 + host_id - 1) * token->sector_size);
+	num_writes = write_sector_disks(token->disks, num_disks, token->sector_size,
+					2 + host_id - 1, iobuf, sizeof(iobuf),
+					task, token->io_timeout, "host_block", results);
 
-		rv = write_iobuf(disk->fd, offset, iobuf, iobuf_len, task, token->io_timeout, NULL);
-		if (rv < 0)
-			break;
+	if (num_writes != num_disks) {
+		for (d = 0; d < num_disks; d++) {
+			if (results[d] < 0) {
+				rv = results[d];
+				break;
+			}
+		}
+		if (!rv)
+			rv = -EIO;
 	}
 
 	if (rv < 0) {
@@ -508,8 +617,6 @@ static int write_host_block(struct task *task, struct token *token,
 				  (unsigned long long)host_id, mb_flags, (unsigned long long)mb_gen);
 	}
 
-	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
 	return rv;
 }
 
@@ -887,8 +994,8 @@ static int release_disk(struct task *task, struct token *token,
  * Error handling:
  *
  * If any on-disk i/o operation times out in step 2, then the struct resource
- * is moved to the resource_thread for retrying and step 3 is deferred.
- * The resource_thread will retry the on-disk operations until they succeed,
+ * is queued for the resource workers for retrying and step 3 is deferred.
+ * The resource workers will retry the on-disk operations until they succeed,
  * then free the resource.
  *
  * [*] Reason for clearing our dblock when releasing an ex/owned lease:
@@ -957,7 +1064,7 @@ static int _release_token(struct task *task, struct token *token,
 	pthread_mutex_lock(&resource_mutex);
 	list_del(&token->list);
 	if (list_empty(&r->tokens)) {
-		list_move(&r->list, &resources_rem);
+		res_list_move(r, &resources_rem);
 		last_token = 1;
 	}
 	lver = r->leader.lver;
@@ -967,20 +1074,20 @@ static int _release_token(struct task *task, struct token *token,
 	if ((r_flags & R_SHARED) && !last_token) {
 		/* will release when final sh token is released */
 		log_token(token, "release_token more shared");
-		close_disks(token->disks, token->r.num_disks);
+		close_disks_cache(token->disks, token->r.num_disks, 0);
 		return SANLK_OK;
 	}
 
 	if (!last_token) {
 		/* should never happen */
 		log_errot(token, "release_token exclusive not last");
-		close_disks(token->disks, token->r.num_disks);
+		close_disks_cache(token->disks, token->r.num_disks, 0);
 		return SANLK_ERROR;
 	}
 
 	if (token->space_dead) {
 		/* don't bother trying disk op which will probably timeout */
-		close_disks(token->disks, token->r.num_disks);
+		close_disks_cache(token->disks, token->r.num_disks, 0);
 		goto out;
 	}
 
@@ -988,7 +1095,7 @@ static int _release_token(struct task *task, struct token *token,
 		goto out;
 
 	if (!opened) {
-		rv = open_disks_fd(token->disks, token->r.num_disks);
+		rv = open_disks_fd_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 		if (rv < 0) {
 			log_errot(token, "release_token open error %d", rv);
 			ret = rv;
@@ -1077,7 +1184,7 @@ static int _release_token(struct task *task, struct token *token,
 		if (!lver) {
 			/* zero lver means acquire did not get to the point of writing a leader,
 			   so we don't need to release the lease on disk. */
-			close_disks(token->disks, token->r.num_disks);
+			close_disks_cache(token->disks, token->r.num_disks, 0);
 			ret = SANLK_OK;
 			goto out;
 		}
@@ -1106,7 +1213,7 @@ static int _release_token(struct task *task, struct token *token,
 			retry_async = 1;
 	}
 
-	close_disks(token->disks, token->r.num_disks);
+	close_disks_cache(token->disks, token->r.num_disks, ret);
  out:
 	if (!retry_async) {
 		if (ret != SANLK_OK)
@@ -1114,7 +1221,7 @@ static int _release_token(struct task *task, struct token *token,
 		else
 			log_token(token, "release_token done r_flags %x", r_flags);
 		pthread_mutex_lock(&resource_mutex);
-		list_del(&r->list);
+		res_list_del(r);
 		free_resource(r);
 		pthread_mutex_unlock(&resource_mutex);
 		return ret;
@@ -1122,15 +1229,14 @@ static int _release_token(struct task *task, struct token *token,
 
 	/*
 	 * If a transient i/o error prevented the release on disk,
-	 * then handle this like an async release; set R_THREAD_RELEASE,
-	 * leave r on resources_rem, let resource_thread_release attempt
-	 * to release it.  We don't want to leave the lease locked on
+	 * then handle this like an async release; leave r on resources_rem
+	 * and queue it for a resource worker to release.  We don't want to leave the lease locked on
 	 * disk, preventing others from acquiring it.
 	 */
 
 	log_errot(token, "release_token timeout r_flags %x", r_flags);
 	pthread_mutex_lock(&resource_mutex);
-	r->flags |= R_THREAD_RELEASE;
+	queue_release(r);
 	pthread_mutex_unlock(&resource_mutex);
 	return SANLK_AIO_TIMEOUT;
 }
@@ -1151,41 +1257,95 @@ int release_token(struct task *task, struct token *token,
 	return _release_token(task, token, resrename, 0, 0);
 }
 
-/* We're releasing a token from the main thread, in which we don't want to block,
-   so we can't do a real release involving disk io.  So, pass the release off to
-   the resource_thread. */
+/*
+ * We're releasing tokens from the main thread, in which we don't want to block,
+ * or for a pid that has died, which nothing waits for.  So, we can't (or needn't)
+ * do a real release involving disk io here, and pass the releases off to the
+ * resource workers.
+ *
+ * All the tokens of a dead client are passed together, and their resources are
+ * queued at once and the workers woken together, so the on-disk releases run
+ * concurrently rather than one after the other.  The resources are queued
+ * grouped by device, taking one resource from each device in turn, so that
+ * each device has a worker releasing its leases from the start.
+ */
 
-void release_token_async(struct token *token)
+void release_tokens_async(struct token *tokens[], int num_tokens)
 {
-	struct resource *r = token->resource;
+	struct resource *rs[SANLK_MAX_RESOURCES];
+	struct resource *pass[SANLK_MAX_RESOURCES];
+	struct resource *r;
+	struct token *token;
+	int num_rs = 0, num_pass, queued = 0;
+	int i, j;
 
 	pthread_mutex_lock(&resource_mutex);
-	list_del(&token->list);
-	if (list_empty(&r->tokens)) {
+	for (i = 0; i < num_tokens; i++) {
+		token = tokens[i];
+		if (!token)
+			continue;
+		r = token->resource;
+
+		list_del(&token->list);
+		if (!list_empty(&r->tokens))
+			continue;
+
 		if (token->space_dead || !r->leader.lver) {
 			/* don't bother trying to release if the lockspace
 			   is dead (release will probably fail), or the
 			   lease was never acquired */
-			list_del(&r->list);
+			res_list_del(r);
 			free_resource(r);
 		} else if (token->acquire_flags & SANLK_RES_PERSISTENT) {
-			list_move(&r->list, &resources_orphan);
+			res_list_move(r, &resources_orphan);
 		} else {
-			r->flags |= R_THREAD_RELEASE;
-			resource_thread_work = 1;
-			list_move(&r->list, &resources_rem);
-			pthread_cond_signal(&resource_cond);
+			res_list_move(r, &resources_rem);
+			if (num_rs < SANLK_MAX_RESOURCES)
+				rs[num_rs++] = r;
+			else
+				add_release(r);
+		}
+	}
+
+	/* each pass queues the first remaining resource on each device */
+
+	while (queued < num_rs) {
+		num_pass = 0;
+		for (i = 0; i < num_rs; i++) {
+			if (!rs[i])
+				continue;
+			for (j = 0; j < num_pass; j++) {
+				if (!strncmp(pass[j]->r.disks[0].path, rs[i]->r.disks[0].path, SANLK_PATH_LEN))
+					break;
+			}
+			if (j < num_pass)
+				continue;
+			pass[num_pass++] = rs[i];
+			rs[i] = NULL;
 		}
+		for (j = 0; j < num_pass; j++)
+			add_release(pass[j]);
+		queued += num_pass;
 	}
+
+	if (!list_empty(&release_queue))
+		pthread_cond_broadcast(&resource_cond);
 	pthread_mutex_unlock(&resource_mutex);
 }
 
+void release_token_async(struct token *token)
+{
+	release_tokens_async(&token, 1);
+}
+
 static struct resource *find_resource(struct token *token,
 				      struct list_head *head)
 {
 	struct resource *r;
 
-	list_for_each_entry(r, head, list) {
+	list_for_each_entry(r, resource_hash_head(token->r.lockspace_name, token->r.name), hash_list) {
+		if (r->res_list != head)
+			continue;
 		if (strncmp(r->r.lockspace_name, token->r.lockspace_name, NAME_ID_SIZE))
 			continue;
 		if (strncmp(r->r.name, token->r.name, NAME_ID_SIZE))
@@ -1300,7 +1460,7 @@ static struct resource *get_resource(struct token *token, int *new_id)
 	memcpy(&r->r, &token->r, sizeof(struct sanlk_resource));
 	r->io_timeout = token->io_timeout;
 
-	/* disks copied after open_disks because open_disks sets sector_size
+	/* disks copied after open_disks_cache because it sets sector_size
 	   which we want copied */
 
 	INIT_LIST_HEAD(&r->tokens);
@@ -1600,7 +1760,7 @@ int convert_token(struct task *task, struct sanlk_resource *res, struct token *c
 		goto out;
 	}
 
-	rv = open_disks_fd(token->disks, token->r.num_disks);
+	rv = open_disks_fd_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "convert_token open error %d", rv);
 		goto out;
@@ -1615,7 +1775,7 @@ int convert_token(struct task *task, struct sanlk_resource *res, struct token *c
 		rv = -EINVAL;
 	}
 
-	close_disks(token->disks, token->r.num_disks);
+	close_disks_cache(token->disks, token->r.num_disks, rv);
  out:
 	return rv;
 }
@@ -1732,18 +1892,18 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		log_token(token, "acquire_token adopt shared orphan");
 		token->resource = r;
 		list_add(&token->list, &r->tokens);
-		list_move(&r->list, &resources_held);
+		res_list_move(r, &resources_held);
 		pthread_mutex_unlock(&resource_mutex);
 
 		/* do this to initialize some token fields */
-		rv = open_disks(token->disks, token->r.num_disks);
+		rv = open_disks_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 		if (rv < 0) {
 			/* TODO: what parts above need to be undone? */
 			log_errot(token, "acquire_token sh orphan open error %d", rv);
 			release_token_nodisk(task, token);
 			return rv;
 		}
-		close_disks(token->disks, token->r.num_disks);
+		close_disks_cache(token->disks, token->r.num_disks, 0);
 		return SANLK_OK;
 	}
 
@@ -1757,18 +1917,18 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		r->pid = token->pid;
 		token->resource = r;
 		list_add(&token->list, &r->tokens);
-		list_move(&r->list, &resources_held);
+		res_list_move(r, &resources_held);
 		pthread_mutex_unlock(&resource_mutex);
 
 		/* do this to initialize some token fields */
-		rv = open_disks(token->disks, token->r.num_disks);
+		rv = open_disks_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 		if (rv < 0) {
 			/* TODO: what parts above need to be undone? */
 			log_errot(token, "acquire_token orphan open error %d", rv);
 			release_token_nodisk(task, token);
 			return rv;
 		}
-		close_disks(token->disks, token->r.num_disks);
+		close_disks_cache(token->disks, token->r.num_disks, 0);
 		return SANLK_OK;
 	}
 
@@ -1792,7 +1952,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	memcpy(r->killpath, killpath, SANLK_HELPER_PATH_LEN);
 	memcpy(r->killargs, killargs, SANLK_HELPER_ARGS_LEN);
 	list_add(&token->list, &r->tokens);
-	list_add(&r->list, &resources_add);
+	res_list_add(r, &resources_add);
 	token->res_id = r->res_id;
 	token->resource = r;
 	pthread_mutex_unlock(&resource_mutex);
@@ -1806,7 +1966,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 			  (unsigned long long)token->r.disks[0].offset);
 	}
 
-	rv = open_disks(token->disks, token->r.num_disks);
+	rv = open_disks_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "acquire_token open error %d", rv);
 		release_token_nodisk(task, token);
@@ -1979,10 +2139,10 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		}
 	}
 
-	close_disks(token->disks, token->r.num_disks);
+	close_disks_cache(token->disks, token->r.num_disks, 0);
 
 	pthread_mutex_lock(&resource_mutex);
-	list_move(&r->list, &resources_held);
+	res_list_move(r, &resources_held);
 	pthread_mutex_unlock(&resource_mutex);
 
 	return SANLK_OK;
@@ -1998,7 +2158,7 @@ int request_token(struct task *task, struct token *token, uint32_t force_mode,
 
 	memset(&req, 0, sizeof(req));
 
-	rv = open_disks(token->disks, token->r.num_disks);
+	rv = open_disks_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "request_token open error %d", rv);
 		return rv;
@@ -2079,7 +2239,7 @@ int request_token(struct task *task, struct token *token, uint32_t force_mode,
 
 	rv = paxos_lease_request_write(task, token, &req);
  out:
-	close_disks(token->disks, token->r.num_disks);
+	close_disks_cache(token->disks, token->r.num_disks, rv);
 
 	log_token(token, "request_token rv %d owner %llu lver %llu mode %u",
 		  rv, (unsigned long long)*owner_id,
@@ -2194,50 +2354,95 @@ int set_resource_examine(char *space_name, char *res_name)
 			continue;
 		if (res_name && strncmp(r->r.name, res_name, NAME_ID_SIZE))
 			continue;
-		r->flags |= R_THREAD_EXAMINE;
-		resource_thread_work = 1;
-		resource_thread_work_examine = 1;
+		queue_examine(r);
 		count++;
 	}
-	if (count)
-		pthread_cond_signal(&resource_cond);
 	pthread_mutex_unlock(&resource_mutex);
 
 	return count;
 }
 
 /*
- * resource_thread
+ * resource workers
  * - on-disk lease release for pid's that exit without doing release
  * - on-disk lease release for which release_token had transient i/o error
  * - examines request blocks of resources
+ * - delivers host events to registered clients
+ *
+ * A pool of workers takes resources from release_queue and examine_queue,
+ * so that the leases of a removed lockspace or of a dead pid are released
+ * on disk concurrently rather than one after the other.  A release can
+ * block for io_timeout on a failing device, so the releases in progress
+ * on one device (the first disk of the lease) are limited to one less than
+ * the number of workers, keeping a worker for releases on other devices.
+ * Host events are delivered by one worker at a time to keep them in order.
  */
 
-static struct resource *find_resource_thread(struct list_head *head, uint32_t flag)
+struct resource_worker {
+	pthread_t thread;
+	int num;
+	int busy;
+	char path[SANLK_PATH_LEN];	/* first disk of the release in progress */
+};
+
+static struct resource_worker *resource_workers;
+static int resource_worker_count;
+static int resource_workers_stop;
+static int host_event_busy;
+static uint64_t release_done_count;	/* stats */
+static uint64_t release_retry_count;
+static uint64_t examine_done_count;
+
+/* called with resource_mutex held */
+
+static struct resource *next_release(void)
 {
 	struct resource *r;
-	uint64_t now = monotime();
+	int i, max, count;
 
-	list_for_each_entry(r, head, list) {
-		if (!(r->flags & flag))
-			continue;
-
-		if (flag & R_THREAD_EXAMINE)
-			return r;
+	max = resource_worker_count > 1 ? resource_worker_count - 1 : 1;
 
-		if (now >= r->thread_release_retry)
+	list_for_each_entry(r, &release_queue, work_list) {
+		count = 0;
+		for (i = 0; i < resource_worker_count; i++) {
+			if (resource_workers[i].busy &&
+			    !strncmp(resource_workers[i].path, r->r.disks[0].path, SANLK_PATH_LEN))
+				count++;
+		}
+		if (count < max)
 			return r;
 	}
 	return NULL;
 }
 
+/*
+ * A fake/tmp token struct we copy necessary res info into, because other
+ * functions take a token struct arg.  Called with resource_mutex held;
+ * r can't be used once the mutex is unlocked since it could be released.
+ */
+
+static void resource_to_token(struct resource *r, struct token *tt, int tt_len)
+{
+	memset(tt, 0, tt_len);
+	tt->disks = (struct sync_disk *)&tt->r.disks[0];
+
+	memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
+	copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
+	tt->host_id = r->host_id;
+	tt->host_generation = r->host_generation;
+	tt->res_id = r->res_id;
+	tt->io_timeout = r->io_timeout;
+	tt->sector_size = r->sector_size;
+	tt->align_size = r->align_size;
+}
+
 /*
  * When release_token is called from a context where it cannot block by doing
  * disk io, the token itself is released, but the struct resource is passed to
- * the resource_thread to do the on-disk operations.
+ * the resource workers to do the on-disk operations.
  *
  * Also, if release_token gets an io timeout during the disk operations, it
- * removes the token, but passes the struct resource to the resource_thread
+ * removes the token, but passes the struct resource to the resource workers
  * to retry the on-disk release operations.  It doesn't want to leave a
  * potentially locked lease on disk simply due to a transient io error.
  *
@@ -2245,7 +2450,8 @@ static struct resource *find_resource_thread(struct list_head *head, uint32_t fl
  * a fake token emulating the original because the paxos layer wants that.
  *
  * As long as the on-disk release fails due to io timeouts, the struct resource
- * is kept and the on-disk release retried.  If another, non-timeout error occurs,
+ * is kept and the on-disk release retried, queued again by rem_resources once
+ * thread_release_retry is reached.  If another, non-timeout error occurs,
  * we give up and delete/free the struct resource.
  */
 
@@ -2259,14 +2465,14 @@ static void resource_thread_release(struct task *task, struct resource *r, struc
 
 	r_flags = r->flags;
 
-	rv = open_disks_fd(token->disks, token->r.num_disks);
+	rv = open_disks_fd_cache(token->disks, token->r.num_disks, token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "release async open error %d", rv);
 		goto out;
 	}
 
 	/* The lockspace may fail after the resource was transferred to the
-	   resource_thread, so we need to check here if if that's the case. */
+	   resource workers, so we need to check here if if that's the case. */
 
 	rv = lockspace_info(token->r.lockspace_name, &spi);
 	if (rv < 0 || spi.killing_pids) {
@@ -2356,12 +2562,12 @@ static void resource_thread_release(struct task *task, struct resource *r, struc
 	}
 
  out_close:
-	close_disks(token->disks, token->r.num_disks);
+	close_disks_cache(token->disks, token->r.num_disks, retry_async ? SANLK_AIO_TIMEOUT : rv);
  out:
 	if (!retry_async) {
 		log_token(token, "release async done r_flags %x", r_flags);
 		pthread_mutex_lock(&resource_mutex);
-		list_del(&r->list);
+		res_list_del(r);
 		free_resource(r);
 		pthread_mutex_unlock(&resource_mutex);
 		return;
@@ -2379,7 +2585,7 @@ static void resource_thread_examine(struct task *task, struct token *tt, int pid
 	struct request_record req;
 	int rv;
 
-	rv = open_disks_fd(tt->disks, tt->r.num_disks);
+	rv = open_disks_fd_cache(tt->disks, tt->r.num_disks, tt->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(tt, "examine open error %d", rv);
 		return;
@@ -2387,7 +2593,7 @@ static void resource_thread_examine(struct task *task, struct token *tt, int pid
 
 	rv = examine_token(task, tt, &req);
 
-	close_disks(tt->disks, tt->r.num_disks);
+	close_disks_cache(tt->disks, tt->r.num_disks, rv);
 
 	if (rv != SANLK_OK)
 		return;
@@ -2435,20 +2641,13 @@ void add_host_event(uint32_t space_id, struct sanlk_host_event *he,
 
 	pthread_mutex_lock(&resource_mutex);
 	list_add_tail(&rhe->list, &host_events);
-	resource_thread_work = 1;
 	pthread_cond_signal(&resource_cond);
 	pthread_mutex_unlock(&resource_mutex);
 }
 
-static struct recv_he *find_host_event(void)
-{
-	if (list_empty(&host_events))
-		return NULL;
-	return list_first_entry(&host_events, struct recv_he, list);
-}
-
-static void *resource_thread(void *arg GNUC_UNUSED)
+static void *resource_worker(void *arg)
 {
+	struct resource_worker *w = arg;
 	struct task task;
 	struct resource *r;
 	struct token *tt = NULL;
@@ -2458,55 +2657,36 @@ static void *resource_thread(void *arg GNUC_UNUSED)
 
 	memset(&task, 0, sizeof(struct task));
 	setup_task_aio(&task, main_task.use_aio, RESOURCE_AIO_CB_SIZE);
-	sprintf(task.name, "%s", "resource");
-
-	/* a fake/tmp token struct we copy necessary res info into,
-	   because other functions take a token struct arg */
+	snprintf(task.name, NAME_ID_SIZE, "resource%d", w->num);
 
 	tt_len = sizeof(struct token) + (SANLK_MAX_DISKS * sizeof(struct sync_disk));
 	tt = malloc(tt_len);
 	if (!tt) {
-		log_error("resource_thread tt malloc error");
+		log_error("resource_worker tt malloc error");
 		goto out;
 	}
 
-	while (1) {
-		pthread_mutex_lock(&resource_mutex);
-		while (!resource_thread_work) {
-			if (resource_thread_stop) {
-				pthread_mutex_unlock(&resource_mutex);
-				goto out;
-			}
-			pthread_cond_wait(&resource_cond, &resource_mutex);
-		}
+	pthread_mutex_lock(&resource_mutex);
 
-		rhe = find_host_event();
-		if (rhe) {
+	while (1) {
+		if (!host_event_busy && !list_empty(&host_events)) {
+			rhe = list_first_entry(&host_events, struct recv_he, list);
 			list_del(&rhe->list);
+			host_event_busy = 1;
 			pthread_mutex_unlock(&resource_mutex);
+
 			send_event_callbacks(rhe->space_id, rhe->from_host_id, rhe->from_generation, &rhe->he);
 			free(rhe);
+
+			pthread_mutex_lock(&resource_mutex);
+			host_event_busy = 0;
 			continue;
 		}
 
-		/* FIXME: it's not nice how we copy a bunch of stuff
-		 * from token to r so that we can later copy it back from
-		 * r into a temp token.  The whole duplication of stuff
-		 * between token and r would be nice to clean up. */
-
-		memset(tt, 0, tt_len);
-		tt->disks = (struct sync_disk *)&tt->r.disks[0];
-
-		r = find_resource_thread(&resources_rem, R_THREAD_RELEASE);
+		r = next_release();
 		if (r) {
-			memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
-			copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
-			tt->host_id = r->host_id;
-			tt->host_generation = r->host_generation;
-			tt->res_id = r->res_id;
-			tt->io_timeout = r->io_timeout;
-			tt->sector_size = r->sector_size;
-			tt->align_size = r->align_size;
+			list_del_init(&r->work_list);
+			resource_to_token(r, tt, tt_len);
 			tt->resource = r;
 
 			/*
@@ -2519,32 +2699,26 @@ static void *resource_thread(void *arg GNUC_UNUSED)
 				r->thread_release_retry = monotime() + (r->io_timeout * 2);
 
 			r->flags &= ~R_THREAD_RELEASE;
+			memcpy(w->path, r->r.disks[0].path, SANLK_PATH_LEN);
+			w->busy = 1;
 			pthread_mutex_unlock(&resource_mutex);
 
 			resource_thread_release(&task, r, tt);
+
+			pthread_mutex_lock(&resource_mutex);
+			w->busy = 0;
+			release_done_count++;
+
+			/* a release held back by the device limit can go now */
+			if (!list_empty(&release_queue))
+				pthread_cond_signal(&resource_cond);
 			continue;
 		}
 
-		/*
-		 * We don't want to search all of resource_held each time
-		 * we are woken unless we know there is something to examine.
-		 */
-		if (!resource_thread_work_examine)
-			goto find_done;
-
-		r = find_resource_thread(&resources_held, R_THREAD_EXAMINE);
-		if (r) {
-			/* make copies of things we need because we can't use r
-			   once we unlock the mutex since it could be released */
-
-			memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
-			copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
-			tt->host_id = r->host_id;
-			tt->host_generation = r->host_generation;
-			tt->res_id = r->res_id;
-			tt->io_timeout = r->io_timeout;
-			tt->sector_size = r->sector_size;
-			tt->align_size = r->align_size;
+		if (!list_empty(&examine_queue)) {
+			r = list_first_entry(&examine_queue, struct resource, work_list);
+			list_del_init(&r->work_list);
+			resource_to_token(r, tt, tt_len);
 			pid = r->pid;
 			lver = r->leader.lver;
 
@@ -2552,14 +2726,19 @@ static void *resource_thread(void *arg GNUC_UNUSED)
 			pthread_mutex_unlock(&resource_mutex);
 
 			resource_thread_examine(&task, tt, pid, lver);
+
+			pthread_mutex_lock(&resource_mutex);
+			examine_done_count++;
 			continue;
 		}
 
- find_done:
-		resource_thread_work = 0;
-		resource_thread_work_examine = 0;
-		pthread_mutex_unlock(&resource_mutex);
+		if (resource_workers_stop)
+			break;
+
+		pthread_cond_wait(&resource_cond, &resource_mutex);
 	}
+
+	pthread_mutex_unlock(&resource_mutex);
  out:
 	if (tt)
 		free(tt);
@@ -2579,16 +2758,11 @@ int release_orphan(struct sanlk_resource *res)
 
 		if (!res->name[0] || !strncmp(r->r.name, res->name, NAME_ID_SIZE)) {
 			log_debug("release orphan %.48s:%.48s", r->r.lockspace_name, r->r.name);
-			r->flags |= R_THREAD_RELEASE;
-			list_move(&r->list, &resources_rem);
+			res_list_move(r, &resources_rem);
+			queue_release(r);
 			count++;
 		}
 	}
-
-	if (count) {
-		resource_thread_work = 1;
-		pthread_cond_signal(&resource_cond);
-	}
 	pthread_mutex_unlock(&resource_mutex);
 
 	return count;
@@ -2604,7 +2778,7 @@ static void purge_resource_list(struct list_head *head, char *space_name, const
 			continue;
 		if (list_name)
 			log_debug("purge %s %.48s:%.48s", list_name, r->r.lockspace_name, r->r.name);
-		list_del(&r->list);
+		res_list_del(r);
 		free(r);
 	}
 	pthread_mutex_unlock(&resource_mutex);
@@ -2621,26 +2795,77 @@ void purge_resource_free(char *space_name)
 }
 
 /*
- * This is called by the main_loop once a second during normal operation.
- * The resources_rem list should normally be empty, so this does nothing.
- * This is needed to wake up the resource_thread to retry release operations
- * that had timed out previously and need to be retried.
+ * This is called by the main_loop each time it wakes, and once a second
+ * while it returns 1.  The resources_rem list should normally be empty,
+ * so this does nothing.  This is needed to queue release operations that
+ * had timed out previously for the resource workers to retry.
  */
 
-void rem_resources(void)
+int rem_resources(void)
 {
+	struct resource *r;
+	uint64_t now;
+	int rem = 0;
+
 	pthread_mutex_lock(&resource_mutex);
-	if (!list_empty(&resources_rem) && !resource_thread_work) {
-		resource_thread_work = 1;
-		pthread_cond_signal(&resource_cond);
+	if (!list_empty(&resources_rem)) {
+		rem = 1;
+		now = monotime();
+
+		list_for_each_entry(r, &resources_rem, list) {
+			if (!(r->flags & R_THREAD_RELEASE) || !list_empty(&r->work_list))
+				continue;
+			if (now < r->thread_release_retry)
+				continue;
+			release_retry_count++;
+			queue_release(r);
+		}
 	}
 	pthread_mutex_unlock(&resource_mutex);
+
+	return rem;
 }
 
-int setup_token_manager(void)
+int print_state_resource_workers(char *str, int len)
 {
+	struct resource *r;
+	int i, busy = 0, releases = 0, examines = 0;
 	int rv;
 
+	pthread_mutex_lock(&resource_mutex);
+	for (i = 0; i < resource_worker_count; i++) {
+		if (resource_workers[i].busy)
+			busy++;
+	}
+	list_for_each_entry(r, &release_queue, work_list)
+		releases++;
+	list_for_each_entry(r, &examine_queue, work_list)
+		examines++;
+
+	rv = snprintf(str, len,
+		      " release_workers=%d"
+		      " release_workers_busy=%d"
+		      " release_queue=%d"
+		      " examine_queue=%d"
+		      " release_done=%llu"
+		      " release_retry=%llu"
+		      " examine_done=%llu",
+		      resource_worker_count,
+		      busy,
+		      releases,
+		      examines,
+		      (unsigned long long)release_done_count,
+		      (unsigned long long)release_retry_count,
+		      (unsigned long long)examine_done_count);
+	pthread_mutex_unlock(&resource_mutex);
+
+	return rv < len ? rv : len;
+}
+
+int setup_token_manager(int num_workers)
+{
+	int i, rv;
+
 	pthread_mutex_init(&resource_mutex, NULL);
 	pthread_cond_init(&resource_cond, NULL);
 	INIT_LIST_HEAD(&resources_add);
@@ -2648,20 +2873,43 @@ int setup_token_manager(void)
 	INIT_LIST_HEAD(&resources_held);
 	INIT_LIST_HEAD(&resources_free);
 	INIT_LIST_HEAD(&resources_orphan);
+	INIT_LIST_HEAD(&release_queue);
+	INIT_LIST_HEAD(&examine_queue);
 	INIT_LIST_HEAD(&host_events);
 
-	rv = pthread_create(&resource_pt, NULL, resource_thread, NULL);
-	if (rv)
+	for (i = 0; i < RESOURCE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&resource_hash[i]);
+
+	resource_workers = calloc(num_workers, sizeof(struct resource_worker));
+	if (!resource_workers)
+		return -ENOMEM;
+
+	for (i = 0; i < num_workers; i++) {
+		resource_workers[i].num = i;
+		rv = pthread_create(&resource_workers[i].thread, NULL, resource_worker, &resource_workers[i]);
+		if (rv) {
+			log_error("resource worker create error %d", rv);
+			break;
+		}
+		pthread_mutex_lock(&resource_mutex);
+		resource_worker_count++;
+		pthread_mutex_unlock(&resource_mutex);
+	}
+
+	if (!resource_worker_count)
 		return -1;
 	return 0;
 }
 
 void close_token_manager(void)
 {
+	int i;
+
 	pthread_mutex_lock(&resource_mutex);
-	resource_thread_stop = 1;
-	pthread_cond_signal(&resource_cond);
+	resource_workers_stop = 1;
+	pthread_cond_broadcast(&resource_cond);
 	pthread_mutex_unlock(&resource_mutex);
-	pthread_join(resource_pt, NULL);
-}
 
+	for (i = 0; i < resource_worker_count; i++)
+		pthread_join(resource_workers[i].thread, NULL);
+}
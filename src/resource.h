@@ -17,6 +17,10 @@
 /* locks resource_mutex */
 void send_state_resources(int fd);
 
+/* locks resource_mutex */
+struct status_buf;
+void status_resources(struct status_buf *sb);
+
 /* locks resource_mutex */
 int lockspace_is_used(struct sanlk_lockspace *ls);
 
@@ -40,6 +44,7 @@ int release_token(struct task *task, struct token *token,
 
 /* locks resource_mutex */
 void release_token_async(struct token *token);
+void release_tokens_async(struct token *tokens[], int num_tokens);
 
 /* no locks */
 int request_token(struct task *task, struct token *token, uint32_t force_mode,
@@ -60,7 +65,7 @@ int read_resource_owners(struct task *task, struct token *token,
                          char **send_buf, int *send_len, int *count);
 
 /* locks resource_mutex */
-void rem_resources(void);
+int rem_resources(void);
 
 /* locks resource_mutex */
 int release_orphan(struct sanlk_resource *res);
@@ -73,7 +78,10 @@ void purge_resource_free(char *space_name);
 void add_host_event(uint32_t space_id, struct sanlk_host_event *he,
 		    uint64_t from_host_id, uint64_t from_generation);
 
-int setup_token_manager(void);
+/* locks resource_mutex */
+int print_state_resource_workers(char *str, int len);
+
+int setup_token_manager(int num_workers);
 void close_token_manager(void);
 
 #endif
@@ -125,6 +125,69 @@ int sanlock_get_hosts(const char *ls_name, uint64_t host_id,
 		      struct sanlk_host **hss, int *hss_count,
 		      uint32_t flags);
 
+/*
+ * shm_inq_lockspace, shm_get_lockspaces and shm_get_hosts return the
+ * same as inq_lockspace, get_lockspaces and get_hosts, but read the
+ * state that the daemon publishes in a shared memory file in its run
+ * dir, without a connection to the daemon.  The host state is that
+ * seen in the last renewal of the lockspace.  They can also return:
+ * -ENOENT (shm_get_lockspaces): the daemon has not created the file
+ * -ECONNREFUSED: the daemon that published the state has stopped
+ * -EOVERFLOW: more lockspaces exist than the file holds, so the
+ *  lockspace may exist but not be published; use the calls above
+ * -EPROTO: the file was created by an incompatible daemon version
+ * -EAGAIN: the state is being updated or initialized, try again
+ */
+
+int sanlock_shm_inq_lockspace(struct sanlk_lockspace *ls, uint32_t flags);
+
+int sanlock_shm_get_lockspaces(struct sanlk_lockspace **lss, int *lss_count,
+			       uint32_t flags);
+
+int sanlock_shm_get_hosts(const char *ls_name, uint64_t host_id,
+			  struct sanlk_host **hss, int *hss_count,
+			  uint32_t flags);
+
+/*
+ * Persistent connection
+ *
+ * conn_open returns a connection to the daemon that can be used for
+ * any number of the commands below, avoiding a new connection for
+ * each command.  Each conn_ function sends its request and returns
+ * a seq number (> 0) without waiting for the reply, or -errno.
+ * conn_result waits for the reply to the request with the given seq
+ * and returns the result that the equivalent function above would
+ * return.  The buffers passed to a conn_ function are filled in when
+ * its reply is read, so they must remain valid until conn_result has
+ * returned for that seq.  Several requests can be outstanding on one
+ * connection, but the daemon processes them one at a time in the
+ * order they were sent.
+ *
+ * If the connection fails, every outstanding request returns the
+ * error, and the connection must be closed with conn_close.
+ */
+
+int sanlock_conn_open(void);
+int sanlock_conn_close(int conn);
+int sanlock_conn_result(int conn, int seq);
+
+int sanlock_conn_add_lockspace(int conn, struct sanlk_lockspace *ls,
+			       uint32_t flags, uint32_t io_timeout);
+int sanlock_conn_inq_lockspace(int conn, struct sanlk_lockspace *ls, uint32_t flags);
+int sanlock_conn_rem_lockspace(int conn, struct sanlk_lockspace *ls, uint32_t flags);
+int sanlock_conn_read_lockspace(int conn, struct sanlk_lockspace *ls,
+				uint32_t flags, uint32_t *io_timeout);
+int sanlock_conn_read_resource(int conn, struct sanlk_resource *res, uint32_t flags);
+int sanlock_conn_get_lockspaces(int conn, struct sanlk_lockspace **lss,
+				int *lss_count, uint32_t flags);
+int sanlock_conn_get_hosts(int conn, const char *ls_name, uint64_t host_id,
+			   struct sanlk_host **hss, int *hss_count,
+			   uint32_t flags);
+int sanlock_conn_request(int conn, uint32_t flags, uint32_t force_mode,
+			 struct sanlk_resource *res);
+int sanlock_conn_examine(int conn, uint32_t flags, struct sanlk_lockspace *ls,
+			 struct sanlk_resource *res);
+
 /*
  * set_config cmd values
  *
@@ -135,6 +135,9 @@ struct token {
 
 struct resource {
 	struct list_head list;
+	struct list_head hash_list;  /* resource_hash entry while on a list */
+	struct list_head work_list;  /* release_queue or examine_queue */
+	struct list_head *res_list;  /* the resources_ list r is on */
 	struct list_head tokens;     /* only one token when ex, multiple sh */
 	uint64_t host_id;
 	uint64_t host_generation;
@@ -163,9 +166,7 @@ struct lease_status {
 	uint64_t renewal_last_attempt;
 	uint64_t renewal_last_success;
 
-	uint32_t renewal_read_count;
-	uint32_t renewal_read_check;
-	char *renewal_read_buf;
+	int renewal_read_hosts; /* number of host leases read by the last renewal */
 };
 
 struct host_status {
@@ -190,6 +191,31 @@ struct renewal_history {
 	int next_errors;
 };
 
+/*
+ * Lockspaces whose delta leases are on the same device (the same block
+ * device, or files on the same filesystem) share an io_device, which
+ * spaces out their renewals and collects renewal io stats.
+ */
+
+struct io_device {
+	struct list_head list;
+	uint64_t dev;		/* st_rdev of a block device, or st_dev of a file */
+	char path[SANLK_PATH_LEN]; /* first lockspace path seen on the device */
+	int spaces;		/* lockspaces using the device */
+	int depth;		/* renewals in progress */
+	int max_depth;
+	uint64_t next_start_ms;	/* earliest start of the next renewal */
+	uint64_t renewals;
+	uint64_t delayed;	/* renewals delayed to space them out */
+	uint64_t delay_ms;	/* total delay */
+	uint64_t read_count;
+	uint64_t read_ms;	/* total read time */
+	uint64_t write_count;
+	uint64_t write_ms;	/* total write time */
+	int read_ms_max;
+	int write_ms_max;
+};
+
 /* The max number of connections that can get events for a lockspace. */
 #define MAX_EVENT_FDS 32
 
@@ -198,6 +224,7 @@ struct renewal_history {
 
 struct space {
 	struct list_head list;
+	struct list_head hash_list; /* space_hash while on spaces list */
 	char space_name[NAME_ID_SIZE];
 	uint32_t space_id; /* used to refer to this space instance in log messages */
 	uint64_t host_id;
@@ -208,6 +235,11 @@ struct space {
 	uint32_t flags; /* SP_ */
 	uint32_t used_retries;
 	uint32_t renewal_read_extend_sec; /* defaults to io_timeout */
+	uint32_t renewal_full_scan_sec; /* 0: every renewal reads all host leases */
+	uint64_t renewal_full_scan_time; /* renewal thread */
+	int renewal_read_len; /* renewal thread, length of last renewal read */
+	int renewal_used_hosts; /* highest host_id in use, protected by mutex */
+	int check_hosts; /* host leases examined by check_other_leases, protected by mutex */
 	uint32_t rindex_op;
 	unsigned int set_max_sectors_kb;
 	int sector_size;
@@ -218,6 +250,12 @@ struct space {
 	int killing_pids;
 	int external_remove;
 	int thread_stop;
+	int added; /* on spaces list, protected by mutex */
+	uint64_t check_ms; /* main_loop, time of next check */
+	int *clients; /* ci of clients that may hold tokens, protected by spaces_mutex */
+	int clients_count;
+	int clients_size;
+	int shm_slot; /* see shmstatus.c */
 	int wd_fd;
 	int event_fds[MAX_EVENT_FDS];
 	struct sanlk_host_event host_event;
@@ -226,6 +264,12 @@ struct space {
 	pthread_mutex_t mutex; /* protects lease_status, thread_stop  */
 	struct lease_status lease_status;
 	struct host_status host_status[DEFAULT_MAX_HOSTS];
+	struct io_device *io_device;
+	struct renew_state *renew; /* renewal engine steps, see lockspace_renew */
+	struct list_head renew_list; /* protected by renew engine mutex */
+	uint64_t renew_due_ms;
+	int renew_where;
+	int renew_wake;
 	struct renewal_history *renewal_history;
 	int renewal_history_size;
 	int renewal_history_next;
@@ -253,17 +297,52 @@ struct space_info {
 #define RX_OP_REBUILD 6
 
 #define HOSTID_AIO_CB_SIZE 4
-#define WORKER_AIO_CB_SIZE 2
+#define WORKER_AIO_CB_SIZE (2 * SANLK_MAX_DISKS)
 #define DIRECT_AIO_CB_SIZE 1
-#define RESOURCE_AIO_CB_SIZE 2
+#define RESOURCE_AIO_CB_SIZE (2 * SANLK_MAX_DISKS)
 #define LIB_AIO_CB_SIZE 1
 
+struct iobuf_req;
+
 struct aicb {
 	int used;
 	char *buf;
+	struct iobuf_req *req; /* set while a submit_iobuf request is pending */
 	struct iocb iocb;
 };
 
+/*
+ * An io submitted with submit_iobuf() and collected with reap_iobufs(),
+ * allowing a task to have io outstanding to several disks at once.
+ */
+
+#define IOBUF_IDLE    0
+#define IOBUF_PENDING 1
+#define IOBUF_DONE    2
+
+/* max iocbs passed to one io_submit or returned by one io_getevents */
+#define IOBUF_EVENTS_MAX 16
+
+struct iobuf_req {
+	int fd;
+	int cmd;                /* IO_CMD_PREAD or IO_CMD_PWRITE */
+	int len;
+	int ioto;               /* seconds, 0 to use the submit_iobufs ioto */
+	int state;              /* IOBUF_ */
+	int rv;                 /* result when state is IOBUF_DONE */
+	char *buf;
+	uint64_t offset;
+	uint64_t deadline_ms;   /* CLOCK_MONOTONIC msec */
+	struct aicb *aicb;
+};
+
+/* task use_aio values */
+#define USE_AIO_SYNC  0              /* lseek and read/write */
+#define USE_AIO_LINUX 1              /* libaio */
+#define USE_AIO_URING 2              /* io_uring */
+
+struct uring;
+
 struct task {
 	char name[NAME_ID_SIZE+1];   /* for log messages */
 
@@ -274,6 +353,7 @@ struct task {
 	int cb_size;
 	char *iobuf;
 	io_context_t aio_ctx;
+	struct uring *uring;         /* use_aio USE_AIO_URING */
 	struct aicb *read_iobuf_timeout_aicb;
 	struct aicb *callbacks;
 };
@@ -316,7 +396,7 @@ struct client {
 EXTERN struct client *client;
 
 #define DEFAULT_WATCHDOG_FIRE_TIMEOUT 60
-#define DEFAULT_USE_AIO 1
+#define DEFAULT_USE_AIO USE_AIO_LINUX
 #define DEFAULT_IO_TIMEOUT 10
 #define DEFAULT_GRACE_SEC 40
 #define DEFAULT_USE_WATCHDOG 1
@@ -325,12 +405,17 @@ EXTERN struct client *client;
 #define DEFAULT_SOCKET_UID 0
 #define DEFAULT_SOCKET_GID 0
 #define DEFAULT_SOCKET_MODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)
+#define DEFAULT_SHM_STATUS_MODE (S_IRUSR|S_IWUSR|S_IRGRP)
 #define DEFAULT_MIN_WORKER_THREADS 2
 #define DEFAULT_MAX_WORKER_THREADS 8
+#define DEFAULT_RENEWAL_THREADS 2
+#define DEFAULT_RELEASE_THREADS 8
 #define DEFAULT_SH_RETRIES 8
 #define DEFAULT_QUIET_FAIL 1
 #define DEFAULT_RENEWAL_HISTORY_SIZE 180 /* about 1 hour with 20 sec renewal interval */
 #define DEFAULT_WRITE_INIT_IO_TIMEOUT 60
+#define DEFAULT_RENEWAL_FULL_SCAN_SEC 0 /* read all host leases in every renewal */
+#define RENEWAL_EXTRA_HOSTS 8 /* read beyond the highest host_id in use */
 
 #define DEFAULT_MAX_SECTORS_KB_IGNORE 0     /* don't change it */
 #define DEFAULT_MAX_SECTORS_KB_ALIGN  0     /* set it to align size */
@@ -361,6 +446,8 @@ struct command_line {
 	int names_log_priority;
 	int mlock_level;
 	int max_worker_threads;
+	int renewal_threads;
+	int release_threads;
 	int aio_arg;
 	int write_init_io_timeout;
 	int set_bitmap_seconds;
@@ -391,6 +478,7 @@ struct command_line {
 	int renewal_history_size;
 	int renewal_read_extend_sec_set; /* 1 if renewal_read_extend_sec is configured */
 	uint32_t renewal_read_extend_sec;
+	uint32_t renewal_full_scan_sec;
 	char our_host_name[SANLK_NAME_LEN+1];
 	char *file_path;
 	char *dump_path;
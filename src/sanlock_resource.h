@@ -143,6 +143,37 @@ int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
 int sanlock_release(int sock, int pid, uint32_t flags, int res_count,
 		    struct sanlk_resource *res_args[]);
 
+/*
+ * Asynchronous acquire and release
+ *
+ * async_open returns a context for acquiring and releasing leases on
+ * behalf of other registered pids (like sock -1 above) without waiting
+ * for the daemon.  The returned fd can be polled, and is readable when
+ * a request may have completed.  async_acquire and async_release send
+ * the request and return a request id (> 0), or -EAGAIN if too many
+ * requests are outstanding, or another -errno.  The res_args are copied
+ * before returning.  async_result returns 0 and sets id and result for
+ * one completed request, where result is what sanlock_acquire or
+ * sanlock_release would have returned, or returns -EAGAIN if no request
+ * has completed.  Call async_result until it returns -EAGAIN each time
+ * the fd is readable.  async_acquire returns -EINVAL if opt_in->len is
+ * set, since the string after opt is not supported.
+ *
+ * Requests for different pids run concurrently, and requests for the
+ * same pid run one at a time in the order they were sent.
+ */
+
+int sanlock_async_open(void);
+int sanlock_async_close(int actx);
+int sanlock_async_result(int actx, int *id, int *result);
+
+int sanlock_async_acquire(int actx, int pid, uint32_t flags, int res_count,
+			  struct sanlk_resource *res_args[],
+			  struct sanlk_options *opt_in);
+
+int sanlock_async_release(int actx, int pid, uint32_t flags, int res_count,
+			  struct sanlk_resource *res_args[]);
+
 int sanlock_inquire(int sock, int pid, uint32_t flags, int *res_count,
 		    char **res_state);
 
@@ -70,7 +70,7 @@ struct sm_header {
 	uint32_t cmd; /* SM_CMD_ */
 	uint32_t cmd_flags;
 	uint32_t length;
-	uint32_t seq;
+	uint32_t seq; /* copied to reply, nonzero from persistent conn */
 	uint32_t data;
 	uint32_t data2;
 };
@@ -83,6 +83,7 @@ struct sm_header {
 #define SANLK_STATE_RESOURCE    4
 #define SANLK_STATE_HOST	5
 #define SANLK_STATE_RENEWAL	6
+#define SANLK_STATE_DEVICE	7
 
 struct sanlk_state {
 	uint32_t type; /* SANLK_STATE_ */
@@ -94,6 +95,125 @@ struct sanlk_state {
 	char str[0]; /* string of internal state */
 };
 
+/*
+ * SM_CMD_STATUS with SANLK_STATUS_BIN in cmd_flags asks for the state in
+ * binary records instead of sanlk_state.  The daemon sets data2 in the
+ * reply header to SANLK_STATUS_VERSION, and then sends records until it
+ * closes the connection.  (A daemon without binary status ignores the
+ * flag, leaves data2 0, and sends sanlk_state.)
+ *
+ * Each record begins with sanlk_status_rec, where type is SANLK_STATE_
+ * and len is the size of the whole record, a multiple of 8.  Fields are
+ * only added at the end of a record, so readers use len to skip unknown
+ * records and fields, and SANLK_STATUS_VERSION changes only when the
+ * existing fields change.
+ */
+
+#define SANLK_STATUS_BIN	0x00000001
+#define SANLK_STATUS_VERSION	1
+
+/* list in sanlk_status_lockspace and sanlk_status_resource */
+#define SANLK_STATUS_LIST_MAIN		0	/* spaces, resources_held */
+#define SANLK_STATUS_LIST_ADD		1
+#define SANLK_STATUS_LIST_REM		2
+#define SANLK_STATUS_LIST_ORPHAN	3
+
+struct sanlk_status_rec {
+	uint32_t type; /* SANLK_STATE_ */
+	uint32_t len;
+};
+
+/* str is the same as sanlk_state str for SANLK_STATE_DAEMON */
+
+struct sanlk_status_daemon {
+	struct sanlk_status_rec rec;
+	char name[SANLK_NAME_LEN]; /* our_host_name */
+	uint32_t str_len;
+	uint32_t pad;
+	char str[0];
+};
+
+struct sanlk_status_client {
+	struct sanlk_status_rec rec;
+	char name[SANLK_NAME_LEN]; /* owner_name */
+	int32_t ci;
+	int32_t fd;
+	int32_t pid;
+	uint32_t flags;
+	uint32_t restricted;
+	int32_t cmd_active;
+	int32_t cmd_last;
+	int32_t pid_dead;
+	int32_t kill_count;
+	int32_t suspend;
+	int32_t need_free;
+	uint32_t pad;
+	uint64_t kill_last;
+};
+
+struct sanlk_status_lockspace {
+	struct sanlk_status_rec rec;
+	uint32_t list; /* SANLK_STATUS_LIST_ */
+	uint32_t space_id;
+	uint32_t io_timeout;
+	int32_t sector_size;
+	int32_t align_size;
+	int32_t renew_fail;
+	int32_t space_dead;
+	int32_t killing_pids;
+	uint32_t used_retries;
+	uint32_t external_used;
+	uint32_t used_by_orphans;
+	uint32_t renewal_read_extend_sec;
+	uint32_t renewal_full_scan_sec;
+	int32_t renewal_read_hosts;
+	uint32_t set_max_sectors_kb;
+	int32_t corrupt_result;
+	int32_t acquire_last_result;
+	int32_t renewal_last_result;
+	uint64_t host_generation;
+	uint64_t acquire_last_attempt;
+	uint64_t acquire_last_success;
+	uint64_t renewal_last_attempt;
+	uint64_t renewal_last_success;
+	struct sanlk_lockspace ls;
+};
+
+/* r is followed by r.num_disks sanlk_disk */
+
+struct sanlk_status_resource {
+	struct sanlk_status_rec rec;
+	uint32_t list; /* SANLK_STATUS_LIST_ */
+	uint32_t flags; /* R_ */
+	int32_t sector_size;
+	int32_t align_size;
+	uint32_t reused;
+	uint32_t res_id;
+	uint32_t token_id;
+	int32_t pid;
+	uint64_t lver; /* from the leader */
+	struct sanlk_resource r;
+};
+
+struct sanlk_status_device {
+	struct sanlk_status_rec rec;
+	char name[SANLK_NAME_LEN]; /* major:minor */
+	char path[SANLK_PATH_LEN];
+	int32_t lockspaces;
+	int32_t depth;
+	int32_t max_depth;
+	int32_t read_ms_max;
+	int32_t write_ms_max;
+	uint32_t pad;
+	uint64_t renewals;
+	uint64_t delayed;
+	uint64_t delay_ms;
+	uint64_t read_count;
+	uint64_t read_ms;
+	uint64_t write_count;
+	uint64_t write_ms;
+};
+
 int sanlock_socket_address(const char *dir, struct sockaddr_un *addr);
 
 struct event_cb {
@@ -103,4 +223,71 @@ struct event_cb {
 	uint64_t from_generation;
 };
 
+/*
+ * Status segment
+ *
+ * The daemon publishes the state of lockspaces and hosts in the file
+ * SANLK_SHM_NAME in the run dir, which it maps shared and the library
+ * maps read only (sanlock_shm_ functions.)  The file has a header, then
+ * max_spaces slots of space_size bytes.  Each slot holds one lockspace:
+ * a sanlk_shm_space followed by num_hosts sanlk_shm_host entries, for
+ * host_id 1 to num_hosts.
+ *
+ * Each slot is written under its own seqlock: seq is odd while the slot
+ * is being written.  A reader copies what it needs from the slot when
+ * seq is even, and uses the copy if seq has not changed since.  A slot
+ * is in use while used is set.  spaces_unpublished counts lockspaces
+ * that did not fit in a slot.
+ */
+
+#define SANLK_SHM_NAME "sanlock.status"
+#define SANLK_SHM_MAGIC 0x53414e53
+#define SANLK_SHM_VERSION 0x00000001
+
+#define SANLK_SHM_MAX_SPACES 128
+#define SANLK_SHM_MAX_HOSTS 2000
+
+/* sanlk_shm_host flags */
+#define SANLK_SHM_HOST_SELF	0x00000001 /* our own host_id */
+#define SANLK_SHM_HOST_UNSEEN	0x00000002 /* no renewal seen since first check */
+
+struct sanlk_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t space_size;
+	uint32_t max_spaces;
+	uint32_t max_hosts;
+	uint32_t daemon_pid;
+	uint32_t spaces_unpublished;
+};
+
+struct sanlk_shm_host {
+	uint64_t generation;
+	uint64_t timestamp;
+	uint64_t last;		/* monotime of last renewal seen, or first check */
+	uint32_t io_timeout;
+	uint32_t fail_seconds;	/* host is FAIL when now - last > fail_seconds */
+	uint32_t dead_seconds;	/* host is DEAD when now - last > dead_seconds */
+	uint32_t flags;		/* SANLK_SHM_HOST_ */
+};
+
+struct sanlk_shm_space {
+	uint32_t seq;
+	uint32_t used;
+	uint32_t checked;	/* other hosts have been checked */
+	uint32_t max_hosts;
+	uint32_t num_hosts;
+	uint32_t pad;
+	uint64_t update_time;	/* monotime of the last update */
+	struct sanlk_lockspace ls; /* ls.flags SANLK_LSF_ADD or SANLK_LSF_REM */
+	struct sanlk_shm_host hosts[0];
+};
+
+#define SANLK_SHM_SPACE_SIZE \
+	(sizeof(struct sanlk_shm_space) + SANLK_SHM_MAX_HOSTS * sizeof(struct sanlk_shm_host))
+
+#define SANLK_SHM_SIZE \
+	(sizeof(struct sanlk_shm_header) + SANLK_SHM_MAX_SPACES * SANLK_SHM_SPACE_SIZE)
+
 #endif
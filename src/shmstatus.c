@@ -0,0 +1,292 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sanlock_internal.h"
+#include "sanlock_sock.h"
+#include "log.h"
+#include "timeouts.h"
+#include "monotime.h"
+#include "shmstatus.h"
+
+/*
+ * The status segment lets sanlock_shm_get_lockspaces, sanlock_shm_get_hosts
+ * and sanlock_shm_inq_lockspace read the lockspace and host state without a
+ * connection to the daemon (see sanlock_sock.h for the layout.)  A lockspace
+ * gets a slot when it is added and gives it up when it is freed, and its
+ * hosts are copied into the slot after each check_other_leases.
+ *
+ * sp->shm_slot is the slot number + 1, 0 before the lockspace has a slot
+ * or after it has given it up, or -1 if there was no free slot for it.
+ *
+ * The file is opened and not recreated when the daemon starts, so that a
+ * reader that mapped it before a restart goes on to see the new daemon's
+ * state.  All writers take shm_mutex, so a slot has one writer at a time.
+ */
+
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *shm_base;
+static int shm_fd = -1;
+
+static struct sanlk_shm_header *shm_header(void)
+{
+	return (struct sanlk_shm_header *)shm_base;
+}
+
+static struct sanlk_shm_space *shm_space(int slot)
+{
+	return (struct sanlk_shm_space *)(shm_base + sizeof(struct sanlk_shm_header) +
+					  (size_t)slot * SANLK_SHM_SPACE_SIZE);
+}
+
+/* called with shm_mutex held, around the changes to a slot */
+
+static void write_begin(struct sanlk_shm_space *ss)
+{
+	__atomic_store_n(&ss->seq, ss->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct sanlk_shm_space *ss)
+{
+	__atomic_store_n(&ss->seq, ss->seq + 1, __ATOMIC_RELEASE);
+}
+
+int setup_shm_status(const char *run_dir)
+{
+	struct sanlk_shm_header *hdr;
+	struct sanlk_shm_space *ss;
+	char path[PATH_MAX];
+	char *base;
+	int fd, i;
+
+	snprintf(path, PATH_MAX, "%s/%s", run_dir, SANLK_SHM_NAME);
+
+	fd = open(path, O_CREAT|O_RDWR|O_CLOEXEC, DEFAULT_SHM_STATUS_MODE);
+	if (fd < 0) {
+		log_error("shm status open error %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	/* readable by the same users as the socket, also if created by
+	   an older daemon */
+	if (fchmod(fd, DEFAULT_SHM_STATUS_MODE) < 0 ||
+	    fchown(fd, com.uid, com.gid) < 0) {
+		log_error("shm status permissions error %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* readers may have the file mapped, so it is never made smaller */
+	if (ftruncate(fd, SANLK_SHM_SIZE) < 0) {
+		log_error("shm status truncate error %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, SANLK_SHM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		log_error("shm status mmap error %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&shm_mutex);
+	shm_base = base;
+	shm_fd = fd;
+
+	/* slots left by a previous daemon */
+	for (i = 0; i < SANLK_SHM_MAX_SPACES; i++) {
+		ss = shm_space(i);
+		if (ss->seq & 1)
+			__atomic_store_n(&ss->seq, ss->seq + 1, __ATOMIC_RELEASE);
+		if (!ss->used)
+			continue;
+		write_begin(ss);
+		ss->used = 0;
+		write_end(ss);
+	}
+
+	hdr = shm_header();
+	hdr->header_size = sizeof(struct sanlk_shm_header);
+	hdr->space_size = SANLK_SHM_SPACE_SIZE;
+	hdr->max_spaces = SANLK_SHM_MAX_SPACES;
+	hdr->max_hosts = SANLK_SHM_MAX_HOSTS;
+	hdr->daemon_pid = getpid();
+	hdr->spaces_unpublished = 0;
+	hdr->version = SANLK_SHM_VERSION;
+	__atomic_store_n(&hdr->magic, SANLK_SHM_MAGIC, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shm_mutex);
+
+	return 0;
+}
+
+/* all lockspaces have been freed */
+
+void close_shm_status(void)
+{
+	pthread_mutex_lock(&shm_mutex);
+	if (shm_base) {
+		shm_header()->daemon_pid = 0;
+		munmap(shm_base, SANLK_SHM_SIZE);
+		close(shm_fd);
+		shm_base = NULL;
+		shm_fd = -1;
+	}
+	pthread_mutex_unlock(&shm_mutex);
+}
+
+void shm_status_add_space(struct space *sp)
+{
+	struct sanlk_shm_space *ss;
+	int i;
+
+	pthread_mutex_lock(&shm_mutex);
+	if (!shm_base)
+		goto out;
+
+	for (i = 0; i < SANLK_SHM_MAX_SPACES; i++) {
+		ss = shm_space(i);
+		if (!ss->used)
+			break;
+	}
+
+	if (i == SANLK_SHM_MAX_SPACES) {
+		if (!shm_header()->spaces_unpublished++)
+			log_erros(sp, "shm status no free slot");
+		sp->shm_slot = -1;
+		goto out;
+	}
+
+	write_begin(ss);
+	ss->used = 1;
+	ss->checked = 0;
+	ss->max_hosts = 0;
+	ss->num_hosts = 0;
+	ss->update_time = monotime();
+	memset(&ss->ls, 0, sizeof(struct sanlk_lockspace));
+	memcpy(ss->ls.name, sp->space_name, NAME_ID_SIZE);
+	ss->ls.host_id = sp->host_id;
+	ss->ls.flags = SANLK_LSF_ADD;
+	memcpy(ss->ls.host_id_disk.path, sp->host_id_disk.path, SANLK_PATH_LEN);
+	ss->ls.host_id_disk.offset = sp->host_id_disk.offset;
+	write_end(ss);
+
+	sp->shm_slot = i + 1;
+ out:
+	pthread_mutex_unlock(&shm_mutex);
+}
+
+void shm_status_set_flags(struct space *sp, uint32_t flags)
+{
+	struct sanlk_shm_space *ss;
+
+	pthread_mutex_lock(&shm_mutex);
+	if (!shm_base || sp->shm_slot <= 0)
+		goto out;
+
+	ss = shm_space(sp->shm_slot - 1);
+	write_begin(ss);
+	ss->ls.flags = flags;
+	ss->update_time = monotime();
+	write_end(ss);
+ out:
+	pthread_mutex_unlock(&shm_mutex);
+}
+
+void shm_status_rem_space(struct space *sp)
+{
+	struct sanlk_shm_space *ss;
+
+	pthread_mutex_lock(&shm_mutex);
+	if (!shm_base)
+		goto out;
+
+	if (sp->shm_slot < 0) {
+		shm_header()->spaces_unpublished--;
+		goto out;
+	}
+
+	if (!sp->shm_slot)
+		goto out;
+
+	ss = shm_space(sp->shm_slot - 1);
+	write_begin(ss);
+	ss->used = 0;
+	ss->num_hosts = 0;
+	write_end(ss);
+ out:
+	sp->shm_slot = 0;
+	pthread_mutex_unlock(&shm_mutex);
+}
+
+/* called with sp->mutex held */
+
+void shm_status_update_hosts(struct space *sp)
+{
+	struct sanlk_shm_space *ss;
+	struct sanlk_shm_host *sh;
+	struct host_status *hs;
+	int i, max_hosts, num_hosts = 0;
+
+	pthread_mutex_lock(&shm_mutex);
+	if (!shm_base || sp->shm_slot <= 0)
+		goto out;
+
+	ss = shm_space(sp->shm_slot - 1);
+	max_hosts = sp->max_hosts < SANLK_SHM_MAX_HOSTS ? sp->max_hosts : SANLK_SHM_MAX_HOSTS;
+
+	for (i = 0; i < max_hosts; i++) {
+		if (sp->host_status[i].timestamp)
+			num_hosts = i + 1;
+	}
+
+	write_begin(ss);
+
+	for (i = 0; i < num_hosts; i++) {
+		hs = &sp->host_status[i];
+		sh = &ss->hosts[i];
+
+		sh->generation = hs->owner_generation;
+		sh->timestamp = hs->timestamp;
+		sh->last = hs->last_live ? hs->last_live : hs->first_check;
+		sh->io_timeout = hs->io_timeout;
+		sh->fail_seconds = calc_id_renewal_fail_seconds(hs->io_timeout);
+		sh->dead_seconds = calc_host_dead_seconds(hs->io_timeout);
+		sh->flags = 0;
+		if (sp->host_id == hs->owner_id)
+			sh->flags |= SANLK_SHM_HOST_SELF;
+		if (hs->first_check == hs->last_live)
+			sh->flags |= SANLK_SHM_HOST_UNSEEN;
+	}
+
+	ss->max_hosts = max_hosts;
+	ss->num_hosts = num_hosts;
+	ss->checked = sp->host_status[0].last_check ? 1 : 0;
+	ss->update_time = monotime();
+	write_end(ss);
+ out:
+	pthread_mutex_unlock(&shm_mutex);
+}
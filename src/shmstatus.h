@@ -0,0 +1,25 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __SHMSTATUS_H__
+#define __SHMSTATUS_H__
+
+int setup_shm_status(const char *run_dir);
+void close_shm_status(void);
+
+/* take a slot for sp when it is added, and give it up when sp is freed */
+void shm_status_add_space(struct space *sp);
+void shm_status_rem_space(struct space *sp);
+
+/* SANLK_LSF_ADD, SANLK_LSF_REM, or 0 while the lockspace is joined */
+void shm_status_set_flags(struct space *sp, uint32_t flags);
+
+/* copy the host_status of sp, called with sp->mutex held */
+void shm_status_update_hosts(struct space *sp);
+
+#endif
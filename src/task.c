@@ -25,6 +25,7 @@
 #include "sanlock_internal.h"
 #include "log.h"
 #include "task.h"
+#include "uring.h"
 
 void setup_task_aio(struct task *task, int use_aio, int cb_size)
 {
@@ -44,10 +45,22 @@ void setup_task_aio(struct task *task, int use_aio, int cb_size)
 	if (!cb_size)
 		return;
 
+	if (use_aio == USE_AIO_URING) {
+		task->uring = uring_setup(cb_size);
+		if (task->uring)
+			goto callbacks;
+
+		/* kernel without io_uring, or with it disabled */
+		log_error("io_uring unavailable, using libaio");
+		task->use_aio = USE_AIO_LINUX;
+	}
+
 	rv = io_setup(cb_size, &task->aio_ctx);
 	if (rv < 0)
 		goto fail;
 
+ callbacks:
+
 	task->cb_size = cb_size;
 	task->callbacks = malloc(cb_size * sizeof(struct aicb));
 	if (!task->callbacks) {
@@ -58,7 +71,12 @@ void setup_task_aio(struct task *task, int use_aio, int cb_size)
 	return;
 
  fail_setup:
-	io_destroy(task->aio_ctx);
+	if (task->uring) {
+		uring_close(task->uring);
+		task->uring = NULL;
+	} else {
+		io_destroy(task->aio_ctx);
+	}
  fail:
 	task->use_aio = 0;
 }
@@ -113,7 +131,10 @@ void close_task_aio(struct task *task)
 
 		memset(&event, 0, sizeof(event));
 
-		rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
+		if (task->uring)
+			rv = uring_getevents(task->uring, &event, 1, ts.tv_sec * 1000);
+		else
+			rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
 		if (rv == -EINTR)
 			continue;
 		if (rv < 0)
@@ -137,7 +158,12 @@ void close_task_aio(struct task *task)
 	if (used)
 		log_taskd(task, "close_task_aio destroy %d incomplete ops", used);
 
-	io_destroy(task->aio_ctx);
+	if (task->uring) {
+		uring_close(task->uring);
+		task->uring = NULL;
+	} else {
+		io_destroy(task->aio_ctx);
+	}
 
 	if (used)
 		log_taske(task, "close_task_aio destroyed %d incomplete ops", used);
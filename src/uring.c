@@ -0,0 +1,547 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/time_types.h>
+#include <linux/io_uring.h>
+
+#include "sanlock_internal.h"
+#include "log.h"
+#include "uring.h"
+
+/*
+ * io_uring engine for task disk io, selected with use_aio 2.
+ *
+ * The ring is driven with the io_uring syscalls directly, so nothing
+ * beyond the kernel headers is needed.  Callers keep using the aicb slots
+ * of the task: each sqe carries the address of the aicb's iocb in
+ * user_data, and completions are returned as struct io_event, so the code
+ * collecting events is the same for libaio and io_uring.  Cancel requests
+ * are submitted with user_data 0, and their completions are dropped; the
+ * canceled io still completes (with -ECANCELED) through its own cqe.
+ *
+ * One buffer and a small table of fds can be registered with the ring.
+ * Io to the registered buffer uses READ_FIXED/WRITE_FIXED so the pages are
+ * not mapped for each io, and io on a registered fd uses the fixed file
+ * table so the fd is not looked up for each io.
+ */
+
+#define URING_MAX_FILES 8
+
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int sq_tail;		/* local tail, published in uring_submit */
+	unsigned int sq_pending;
+	unsigned int *sq_khead;
+	unsigned int *sq_ktail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_khead;
+	unsigned int *cq_ktail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *sqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_sz;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	char *fixed_buf;
+	int fixed_len;
+	int fixed_inflight;
+	int files_registered;
+	int files[URING_MAX_FILES];
+};
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	int rv;
+
+	rv = syscall(__NR_io_uring_setup, entries, p);
+	return (rv < 0) ? -errno : rv;
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			   unsigned int flags, void *arg, size_t argsz)
+{
+	int rv;
+
+	rv = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+	return (rv < 0) ? -errno : rv;
+}
+
+static int sys_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	int rv;
+
+	rv = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+	return (rv < 0) ? -errno : rv;
+}
+
+static uint64_t uring_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int is_fixed_buf(struct uring *ur, char *buf, unsigned long len)
+{
+	if (!ur->fixed_buf)
+		return 0;
+	if (buf < ur->fixed_buf)
+		return 0;
+	if (buf + len > ur->fixed_buf + ur->fixed_len)
+		return 0;
+	return 1;
+}
+
+static void unmap_rings(struct uring *ur)
+{
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_sz);
+	if (ur->sq_ring)
+		munmap(ur->sq_ring, ur->sq_ring_sz);
+}
+
+struct uring *uring_setup(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	void *ptr;
+	int i, rv;
+
+	ur = malloc(sizeof(struct uring));
+	if (!ur)
+		return NULL;
+	memset(ur, 0, sizeof(struct uring));
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+
+	rv = sys_uring_setup(entries, &p);
+	if (rv < 0) {
+		log_error("uring setup %u error %d", entries, rv);
+		free(ur);
+		return NULL;
+	}
+	ur->fd = rv;
+
+	/* timed waits for completions need IORING_ENTER_EXT_ARG */
+
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		log_error("uring setup no ext_arg features 0x%x", p.features);
+		goto fail;
+	}
+
+	ur->sq_entries = p.sq_entries;
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_sz > ur->sq_ring_sz)
+			ur->sq_ring_sz = ur->cq_ring_sz;
+		ur->cq_ring_sz = ur->sq_ring_sz;
+	}
+
+	ptr = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		log_error("uring setup mmap sq error %d", errno);
+		goto fail;
+	}
+	ur->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ptr = mmap(NULL, ur->cq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			log_error("uring setup mmap cq error %d", errno);
+			goto fail;
+		}
+		ur->cq_ring = ptr;
+	}
+
+	ptr = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		log_error("uring setup mmap sqes error %d", errno);
+		goto fail;
+	}
+	ur->sqes = ptr;
+
+	ur->sq_khead = (unsigned int *)((char *)ur->sq_ring + p.sq_off.head);
+	ur->sq_ktail = (unsigned int *)((char *)ur->sq_ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)((char *)ur->sq_ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *)((char *)ur->sq_ring + p.sq_off.array);
+	ur->cq_khead = (unsigned int *)((char *)ur->cq_ring + p.cq_off.head);
+	ur->cq_ktail = (unsigned int *)((char *)ur->cq_ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)((char *)ur->cq_ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ring + p.cq_off.cqes);
+	ur->sq_tail = *ur->sq_ktail;
+
+	/* an empty (sparse) fixed file table that fds are added to later
+	   by uring_register_fd; io on other fds works without it */
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		ur->files[i] = -1;
+
+	rv = sys_uring_register(ur->fd, IORING_REGISTER_FILES, ur->files, URING_MAX_FILES);
+	if (rv < 0)
+		log_error("uring setup register files error %d", rv);
+	else
+		ur->files_registered = 1;
+
+	return ur;
+
+ fail:
+	unmap_rings(ur);
+	close(ur->fd);
+	free(ur);
+	return NULL;
+}
+
+/* closing the ring fd drops the registered buffer and files */
+
+void uring_close(struct uring *ur)
+{
+	if (!ur)
+		return;
+
+	unmap_rings(ur);
+	close(ur->fd);
+	free(ur);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(ur->sq_khead, __ATOMIC_ACQUIRE);
+
+	if (ur->sq_tail - head >= ur->sq_entries)
+		return NULL;
+
+	idx = ur->sq_tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	ur->sq_array[idx] = idx;
+	ur->sq_tail++;
+	ur->sq_pending++;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+static int find_file(struct uring *ur, int fd)
+{
+	int i;
+
+	if (!ur->files_registered)
+		return -1;
+
+	for (i = 0; i < URING_MAX_FILES; i++) {
+		if (ur->files[i] == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* queue an sqe for the io described by iocb; it's sent by uring_submit */
+
+int uring_prep_iocb(struct uring *ur, struct iocb *iocb)
+{
+	struct io_uring_sqe *sqe;
+	char *buf = iocb->u.c.buf;
+	int fixed, slot;
+
+	sqe = get_sqe(ur);
+	if (!sqe)
+		return -EAGAIN;
+
+	fixed = is_fixed_buf(ur, buf, iocb->u.c.nbytes);
+
+	if (iocb->aio_lio_opcode == IO_CMD_PWRITE)
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	else
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+
+	slot = find_file(ur, iocb->aio_fildes);
+	if (slot >= 0) {
+		sqe->fd = slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = iocb->aio_fildes;
+	}
+
+	sqe->addr = (unsigned long)buf;
+	sqe->len = iocb->u.c.nbytes;
+	sqe->off = iocb->u.c.offset;
+	sqe->user_data = (unsigned long)iocb;
+
+	if (fixed) {
+		sqe->buf_index = 0;
+		ur->fixed_inflight++;
+	}
+	return 0;
+}
+
+/*
+ * Send the queued sqes to the kernel.  Returns the number submitted.
+ * Any that the kernel did not take are removed from the sq (the kernel
+ * only looks at the sq during io_uring_enter) so the caller can treat
+ * them as never submitted.
+ */
+
+int uring_submit(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+	int rv;
+
+	if (!ur->sq_pending)
+		return 0;
+
+	__atomic_store_n(ur->sq_ktail, ur->sq_tail, __ATOMIC_RELEASE);
+ retry:
+	rv = sys_uring_enter(ur->fd, ur->sq_pending, 0, 0, NULL, 0);
+	if (rv == -EINTR)
+		goto retry;
+
+	if (rv < 0 || (unsigned int)rv < ur->sq_pending) {
+		head = __atomic_load_n(ur->sq_khead, __ATOMIC_ACQUIRE);
+
+		while (ur->sq_tail != head) {
+			ur->sq_tail--;
+			sqe = &ur->sqes[ur->sq_tail & *ur->sq_mask];
+			if (sqe->opcode == IORING_OP_READ_FIXED ||
+			    sqe->opcode == IORING_OP_WRITE_FIXED)
+				ur->fixed_inflight--;
+		}
+		__atomic_store_n(ur->sq_ktail, ur->sq_tail, __ATOMIC_RELEASE);
+	}
+
+	ur->sq_pending = 0;
+	return rv;
+}
+
+/*
+ * Ask the kernel to cancel the io for iocb.  Whether or not the cancel
+ * succeeds, the io's own completion is still returned by uring_getevents.
+ */
+
+int uring_cancel(struct uring *ur, struct iocb *iocb)
+{
+	struct io_uring_sqe *sqe;
+	int rv;
+
+	sqe = get_sqe(ur);
+	if (!sqe)
+		return -EAGAIN;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long)iocb;
+	sqe->user_data = 0;
+
+	rv = uring_submit(ur);
+	if (rv < 0)
+		return rv;
+	return rv ? 0 : -EAGAIN;
+}
+
+static int reap_cqes(struct uring *ur, struct io_event *events, int nr)
+{
+	struct io_uring_cqe *cqe;
+	struct iocb *iocb;
+	unsigned int head, tail;
+	int n = 0;
+
+	head = *ur->cq_khead;
+	tail = __atomic_load_n(ur->cq_ktail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && n < nr) {
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		head++;
+
+		/* completion of a cancel request */
+		if (!cqe->user_data)
+			continue;
+
+		iocb = (struct iocb *)(unsigned long)cqe->user_data;
+
+		if (is_fixed_buf(ur, iocb->u.c.buf, iocb->u.c.nbytes))
+			ur->fixed_inflight--;
+
+		memset(&events[n], 0, sizeof(struct io_event));
+		events[n].obj = iocb;
+		events[n].res = cqe->res;
+		n++;
+	}
+
+	__atomic_store_n(ur->cq_khead, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/*
+ * Wait up to wait_ms for at least one io completion, and return up to nr
+ * of them in events.  Returns the number of events, 0 on timeout.
+ */
+
+int uring_getevents(struct uring *ur, struct io_event *events, int nr, uint64_t wait_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	uint64_t now, end;
+	int rv;
+
+	end = uring_now_ms() + wait_ms;
+
+	while (1) {
+		rv = reap_cqes(ur, events, nr);
+		if (rv)
+			return rv;
+
+		now = uring_now_ms();
+		if (now >= end)
+			return 0;
+
+		memset(&ts, 0, sizeof(ts));
+		ts.tv_sec = (end - now) / 1000;
+		ts.tv_nsec = ((end - now) % 1000) * 1000000;
+
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+
+		rv = sys_uring_enter(ur->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				     &arg, sizeof(arg));
+		if (rv < 0 && rv != -ETIME && rv != -EINTR)
+			return rv;
+	}
+}
+
+/*
+ * Register buf as the ring's fixed buffer, replacing a previous one.
+ * The previous one cannot be replaced while io on it is in flight.
+ */
+
+int uring_register_buf(struct uring *ur, char *buf, int len)
+{
+	struct iovec iov;
+	int rv;
+
+	if (ur->fixed_buf == buf && ur->fixed_len == len)
+		return 0;
+
+	if (ur->fixed_buf) {
+		if (ur->fixed_inflight)
+			return -EBUSY;
+		sys_uring_register(ur->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		ur->fixed_buf = NULL;
+		ur->fixed_len = 0;
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	rv = sys_uring_register(ur->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	if (rv < 0)
+		return rv;
+
+	ur->fixed_buf = buf;
+	ur->fixed_len = len;
+	return 0;
+}
+
+/* must be called before the registered buf is freed */
+
+void uring_unregister_buf(struct uring *ur, char *buf)
+{
+	if (!ur->fixed_buf || ur->fixed_buf != buf)
+		return;
+
+	sys_uring_register(ur->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	ur->fixed_buf = NULL;
+	ur->fixed_len = 0;
+	ur->fixed_inflight = 0;
+}
+
+static int update_file(struct uring *ur, int slot, int fd)
+{
+	struct io_uring_files_update up;
+	int fds = fd;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (unsigned long)&fds;
+
+	return sys_uring_register(ur->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+/*
+ * Add fd to the fixed file table.  The fd must be unregistered before it
+ * is closed, otherwise io on a new file reusing the fd number would go to
+ * the old file.
+ */
+
+int uring_register_fd(struct uring *ur, int fd)
+{
+	int slot, rv;
+
+	if (!ur->files_registered || fd < 0)
+		return -EOPNOTSUPP;
+
+	if (find_file(ur, fd) >= 0)
+		return 0;
+
+	slot = find_file(ur, -1);
+	if (slot < 0)
+		return -ENOSPC;
+
+	rv = update_file(ur, slot, fd);
+	if (rv < 0)
+		return rv;
+
+	ur->files[slot] = fd;
+	return 0;
+}
+
+void uring_unregister_fd(struct uring *ur, int fd)
+{
+	int slot;
+
+	if (fd < 0)
+		return;
+
+	slot = find_file(ur, fd);
+	if (slot < 0)
+		return;
+
+	update_file(ur, slot, -1);
+	ur->files[slot] = -1;
+}
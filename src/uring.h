@@ -0,0 +1,27 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+struct uring;
+
+struct uring *uring_setup(unsigned int entries);
+void uring_close(struct uring *ur);
+
+int uring_prep_iocb(struct uring *ur, struct iocb *iocb);
+int uring_submit(struct uring *ur);
+int uring_cancel(struct uring *ur, struct iocb *iocb);
+int uring_getevents(struct uring *ur, struct io_event *events, int nr, uint64_t wait_ms);
+
+int uring_register_buf(struct uring *ur, char *buf, int len);
+void uring_unregister_buf(struct uring *ur, char *buf);
+int uring_register_fd(struct uring *ur, int fd);
+void uring_unregister_fd(struct uring *ur, int fd);
+
+#endif
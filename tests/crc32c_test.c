@@ -0,0 +1,90 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Check that each crc32c implementation supported by this cpu gives the
+ * same result as the table implementation, over a range of lengths and
+ * buffer alignments.  Exits 0 if all match.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length);
+uint32_t crc32c_sw(uint32_t crc, uint8_t *data, size_t length);
+uint32_t crc32c_sse42(uint32_t crc, uint8_t *data, size_t length);
+uint32_t crc32c_pclmul(uint32_t crc, uint8_t *data, size_t length);
+int crc32c_hw_level(void);
+
+#define BUF_LEN (8192 + 64)
+
+static int check(const char *name, uint32_t (*fn)(uint32_t, uint8_t *, size_t),
+		 uint8_t *buf)
+{
+	uint32_t a, b, init;
+	size_t len;
+	int off, errors = 0;
+
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len <= 8192; len = (len < 1024) ? len + 1 : len + 61) {
+			init = (len & 1) ? (uint32_t)~1 : (uint32_t)~0;
+
+			a = crc32c_sw(init, buf + off, len);
+			b = fn(init, buf + off, len);
+
+			if (a != b) {
+				if (errors++ < 10)
+					printf("%s off %d len %zu crc %08x expected %08x\n",
+					       name, off, len, b, a);
+			}
+		}
+	}
+
+	printf("%s %s\n", name, errors ? "FAIL" : "ok");
+	return errors;
+}
+
+int main(void)
+{
+	uint8_t *buf;
+	uint32_t crc;
+	int level, i, errors = 0;
+
+	/* standard check value for crc32c("123456789") */
+
+	crc = ~crc32c_sw(~0, (uint8_t *)"123456789", 9);
+	if (crc != 0xE3069283) {
+		printf("crc32c_sw check value %08x FAIL\n", crc);
+		return 1;
+	}
+
+	buf = malloc(BUF_LEN);
+	if (!buf)
+		return 1;
+
+	srandom(1);
+	for (i = 0; i < BUF_LEN; i++)
+		buf[i] = random() & 0xFF;
+
+	level = crc32c_hw_level();
+	printf("crc32c_hw_level %d\n", level);
+
+	if (level >= 1)
+		errors += check("crc32c_sse42", crc32c_sse42, buf);
+	if (level >= 2)
+		errors += check("crc32c_pclmul", crc32c_pclmul, buf);
+	errors += check("crc32c", crc32c, buf);
+
+	free(buf);
+	return errors ? 1 : 0;
+}
@@ -393,9 +393,10 @@ def test_add_rem_lockspace_async(tmpdir, sanlock_daemon):
     # This will take about 3 seconds.
     sanlock.rem_lockspace(b"ls_name", 1, path, wait=False)
 
-    # Wait until the lockspace change state from True to None.
+    # Wait until the lockspace change state from True to None. The daemon
+    # checks a lockspace being released every 200 milliseconds.
     while sanlock.inq_lockspace(b"ls_name", 1, path, wait=False):
-        time.sleep(1)
+        time.sleep(0.05)
 
     # While the lockspace is being released, we expect to get None.
     acquired = sanlock.inq_lockspace(b"ls_name", 1, path, wait=False)
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Measure the time for the daemon to acquire a lease as the number of
+ * leases already held grows.  Creates a lockspace and COUNT resource
+ * leases in DIR, then acquires them all (SANLK_MAX_RESOURCES per
+ * registered connection), printing the average acquire and release
+ * time for each STEP leases.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "sanlock.h"
+#include "sanlock_admin.h"
+#include "sanlock_resource.h"
+
+#define ONEMB 1048576
+#define LS_NAME "resbench"
+
+static struct sanlk_lockspace ls;
+static char res_path[SANLK_PATH_LEN];
+static int *fds;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static void set_res(struct sanlk_resource *res, int i)
+{
+	memset(res, 0, sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk));
+	strcpy(res->lockspace_name, LS_NAME);
+	snprintf(res->name, SANLK_NAME_LEN, "r%d", i);
+	res->num_disks = 1;
+	memcpy(res->disks[0].path, res_path, SANLK_PATH_LEN);
+	res->disks[0].offset = (uint64_t)i * ONEMB;
+}
+
+static int create_file(const char *path, uint64_t size)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -errno;
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk)];
+	struct sanlk_resource *res = (struct sanlk_resource *)buf;
+	struct rlimit rlim;
+	uint64_t begin, total;
+	int count = 2000, step = 250, nfds;
+	int i, rv;
+
+	if (argc < 2) {
+		printf("%s DIR [COUNT] [STEP]\n", argv[0]);
+		return 0;
+	}
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (argc > 3)
+		step = atoi(argv[3]);
+	if (count <= 0 || step <= 0)
+		return 1;
+
+	nfds = (count + SANLK_MAX_RESOURCES - 1) / SANLK_MAX_RESOURCES;
+
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	if (rlim.rlim_cur < (rlim_t)nfds + 64) {
+		rlim.rlim_cur = nfds + 64;
+		if (rlim.rlim_max < rlim.rlim_cur)
+			rlim.rlim_max = rlim.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+			printf("setrlimit nofile %d error %d\n", nfds + 64, errno);
+	}
+
+	fds = calloc(nfds, sizeof(int));
+	if (!fds)
+		return 1;
+
+	memset(&ls, 0, sizeof(ls));
+	strcpy(ls.name, LS_NAME);
+	ls.host_id = 1;
+	snprintf(ls.host_id_disk.path, SANLK_PATH_LEN, "%s/resbench_ls", argv[1]);
+	snprintf(res_path, sizeof(res_path), "%s/resbench_res", argv[1]);
+
+	rv = create_file(ls.host_id_disk.path, ONEMB);
+	if (!rv)
+		rv = create_file(res_path, (uint64_t)count * ONEMB);
+	if (rv < 0) {
+		printf("create files error %d\n", rv);
+		return 1;
+	}
+
+	rv = sanlock_write_lockspace(&ls, 0, 0, 0);
+	if (rv < 0) {
+		printf("write_lockspace error %d\n", rv);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		set_res(res, i);
+		rv = sanlock_write_resource(res, 0, 0, 0);
+		if (rv < 0) {
+			printf("write_resource %d error %d\n", i, rv);
+			return 1;
+		}
+	}
+
+	printf("add_lockspace %s\n", LS_NAME);
+
+	rv = sanlock_add_lockspace(&ls, 0);
+	if (rv < 0) {
+		printf("add_lockspace error %d\n", rv);
+		return 1;
+	}
+
+	total = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!(i % SANLK_MAX_RESOURCES)) {
+			fds[i / SANLK_MAX_RESOURCES] = sanlock_register();
+			if (fds[i / SANLK_MAX_RESOURCES] < 0) {
+				printf("register error %d\n", fds[i / SANLK_MAX_RESOURCES]);
+				count = i;
+				break;
+			}
+		}
+
+		set_res(res, i);
+
+		begin = now_us();
+		rv = sanlock_acquire(fds[i / SANLK_MAX_RESOURCES], -1, 0, 1, &res, NULL);
+		total += now_us() - begin;
+
+		if (rv < 0) {
+			printf("acquire %d error %d\n", i, rv);
+			count = i;
+			break;
+		}
+
+		if (!((i + 1) % step)) {
+			printf("held %d acquire_us %llu\n", i + 1,
+			       (unsigned long long)(total / step));
+			total = 0;
+		}
+	}
+
+	total = 0;
+
+	for (i = count - 1; i >= 0; i--) {
+		set_res(res, i);
+
+		begin = now_us();
+		rv = sanlock_release(fds[i / SANLK_MAX_RESOURCES], -1, 0, 1, &res);
+		total += now_us() - begin;
+
+		if (rv < 0)
+			printf("release %d error %d\n", i, rv);
+
+		if (!(i % step)) {
+			printf("held %d release_us %llu\n", i,
+			       (unsigned long long)(total / step));
+			total = 0;
+		}
+
+		if (!(i % SANLK_MAX_RESOURCES))
+			close(fds[i / SANLK_MAX_RESOURCES]);
+	}
+
+	rv = sanlock_rem_lockspace(&ls, 0);
+	if (rv < 0)
+		printf("rem_lockspace error %d\n", rv);
+
+	free(fds);
+	return 0;
+}